@@ -0,0 +1,63 @@
+#ifndef FDTBL_H
+#define FDTBL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * @brief The entries of a page, allocated together
+ */
+#define FD_TABLE_PAGE_SIZE 256
+
+/**
+ * @brief A table indexed by file descriptor that grows with demand.
+ * @note The entries are stored in pages allocated on first use, so they never
+ * move: pointers to an entry stay valid while the table grows.
+ * @note Reserving and getting entries is safe from multiple threads,
+ * as long as each entry is only used by one of them.
+ */
+typedef struct fd_table
+{
+    size_t entry_size;
+    /**
+     * @brief The descriptors must be lower than the limit
+     */
+    int limit;
+    _Atomic(char *) *pages;
+} fd_table;
+
+/**
+ * @brief Creates an empty table
+ *
+ * @param entry_size The size of each entry, initialized with zeros.
+ * @param limit The descriptors accepted by the table are lower than this.
+ * @return fd_table* The table, or NULL if it couldn't be allocated.
+ */
+fd_table *new_fd_table(size_t entry_size, int limit);
+
+/**
+ * @brief Get the entry of a descriptor, allocating its page if needed
+ *
+ * @param table
+ * @param fd
+ * @return void* The entry, or NULL if the fd is past the limit or memory ran out.
+ */
+void *fd_table_reserve(fd_table *table, int fd);
+
+/**
+ * @brief Get the entry of a descriptor, without allocating
+ *
+ * @param table
+ * @param fd
+ * @return void* The entry, or NULL if it was never reserved.
+ */
+void *fd_table_get(const fd_table *table, int fd);
+
+/**
+ * @brief Free the table and its entries
+ *
+ * @param table
+ */
+void free_fd_table(fd_table *table);
+
+#endif
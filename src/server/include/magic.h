@@ -1,2 +0,0 @@
-// This should be enough spaces for 500 clients
-#define MAGIC_NUMBER 500 * 4 * 2
@@ -0,0 +1,105 @@
+#ifndef MAIL_CACHE_H
+#define MAIL_CACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief The memory kept for the listings of the mailboxes, in MiB
+ */
+#define DEFAULT_MAIL_CACHE_SIZE 64
+
+/**
+ * @brief The mails of a mailbox, one array per field
+ * @note Once filled, a listing is never modified, so it's shared between
+ * the cache and the sessions. Each session keeps its deletions apart.
+ * @note The arrays and the filenames share a single allocation.
+ */
+typedef struct mail_listing
+{
+    atomic_uint refs;
+    size_t count;
+    /**
+     * @brief The size of all the mails
+     */
+    uint64_t total_size;
+    /**
+     * @brief The mail sizes in bytes
+     */
+    uint64_t *sizes;
+    /**
+     * @brief Where each filename starts in the names arena
+     */
+    uint32_t *name_offsets;
+    /**
+     * @brief The filename lengths, without the NULL terminator
+     */
+    uint8_t *name_lengths;
+    /**
+     * @brief The length of the unique ID (the filename up to the ':'), 0 if it has none
+     */
+    uint8_t *uid_lengths;
+    /**
+     * @brief The NULL terminated filenames, one after the other
+     */
+    char *names;
+    /**
+     * @brief The bytes of the allocation
+     */
+    size_t memory;
+} mail_listing;
+
+/**
+ * @brief Allocate an empty listing, with room for count mails
+ *
+ * @param count The number of mails.
+ * @param names_size The size of the filenames, including their NULL terminators.
+ * @return mail_listing* The listing, with a single reference, or NULL if memory ran out.
+ */
+mail_listing *new_mail_listing(size_t count, size_t names_size);
+
+/**
+ * @brief Drop a reference to a listing, freeing it with the last one
+ *
+ * @param listing The listing, it may be NULL.
+ */
+void release_mail_listing(mail_listing *listing);
+
+/**
+ * @brief Set the memory of the cache
+ *
+ * @param megabytes The size in MiB, 0 disables the cache.
+ * @return true The size was set.
+ * @return false The size is negative.
+ */
+bool set_mail_cache_size(int megabytes);
+
+/**
+ * @brief Get the listing of a mailbox, if it didn't change since it was cached
+ * @note On a miss, the mailbox starts being watched, so it can be cached
+ * with mail_cache_put once it's loaded.
+ *
+ * @param user_path The directory of the mailbox.
+ * @param ticket Where to store the ticket for mail_cache_put, 0 if the mailbox can't be cached.
+ * @return mail_listing* A reference to the listing, or NULL on a miss.
+ */
+mail_listing *mail_cache_get(const char *user_path, uint64_t *ticket);
+
+/**
+ * @brief Cache the listing of a mailbox, if it didn't change since the ticket was given
+ * @note The least recently used mailboxes are evicted to make room.
+ *
+ * @param user_path The directory of the mailbox.
+ * @param listing The listing, a reference is taken if it's cached.
+ * @param ticket The ticket of the mail_cache_get that missed.
+ */
+void mail_cache_put(const char *user_path, mail_listing *listing, uint64_t ticket);
+
+/**
+ * @brief Drop every listing and stop watching the mailboxes
+ */
+void destroy_mail_cache();
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef MAIL_INDEX_H
+#define MAIL_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * @brief The index file, in the directory of each mailbox (next to new/ and cur/)
+ */
+#define MAIL_INDEX_FILE "pop3.index"
+
+/**
+ * @brief The state of a directory when it was indexed
+ * @note A zeroed stamp matches no directory.
+ */
+typedef struct mail_index_stamp
+{
+    uint64_t ino;
+    int64_t sec;
+    int64_t nsec;
+} mail_index_stamp;
+
+/**
+ * @brief The header of an index file
+ * @note It's followed by the sizes of the mails (uint64_t), the lengths of
+ * their filenames (uint8_t) and the filenames, NULL terminated one after the other.
+ */
+typedef struct mail_index_header
+{
+    char magic[8];
+    /**
+     * @brief new/ before its mails were moved to cur/
+     */
+    mail_index_stamp new_dir;
+    /**
+     * @brief cur/ before it was listed
+     */
+    mail_index_stamp cur_dir;
+    uint64_t count;
+    uint64_t names_size;
+} mail_index_header;
+
+/**
+ * @brief An index file mapped in memory, read only
+ */
+typedef struct mail_index
+{
+    void *map;
+    size_t map_size;
+    const mail_index_header *header;
+    const uint64_t *sizes;
+    const uint8_t *name_lengths;
+    const char *names;
+} mail_index;
+
+/**
+ * @brief Stamp a directory, from its stat
+ * @note A directory changed in the last second gets a zeroed stamp, its
+ * timestamp may not change again if something is added in the same tick.
+ *
+ * @param stamp
+ * @param st The stat of the directory.
+ */
+void stamp_mail_dir(mail_index_stamp *stamp, const struct stat *st);
+
+/**
+ * @brief Stamp a directory that only the caller changed since its last stamp
+ * @note Unlike stamp_mail_dir, a recent change doesn't zero the stamp: the
+ * mailbox lock keeps other sessions out of cur/, and deliveries go to new/.
+ *
+ * @param stamp
+ * @param st The stat of the directory.
+ */
+void settle_mail_dir(mail_index_stamp *stamp, const struct stat *st);
+
+/**
+ * @brief If a directory is still as it was stamped
+ *
+ * @param stamp
+ * @param st The stat of the directory.
+ * @return bool
+ */
+bool mail_dir_matches(const mail_index_stamp *stamp, const struct stat *st);
+
+/**
+ * @brief Map the index of a mailbox, checking it's well formed
+ *
+ * @param index
+ * @param dir_fd The directory of the mailbox.
+ * @return true The index is mapped, it must be closed.
+ * @return false There is no valid index.
+ */
+bool open_mail_index(mail_index *index, int dir_fd);
+
+/**
+ * @brief Unmap an index
+ *
+ * @param index
+ */
+void close_mail_index(mail_index *index);
+
+/**
+ * @brief Replace the index of a mailbox, atomically
+ * @note The whole file is written again: each field is an array of its own,
+ * so a new mail would shift all of them, and the file is a few bytes per mail.
+ *
+ * @param dir_fd The directory of the mailbox.
+ * @param header The header, its magic is filled in.
+ * @param sizes The sizes of the mails.
+ * @param name_lengths The lengths of the filenames.
+ * @param names The filenames, NULL terminated one after the other.
+ * @return true The index was written.
+ * @return false The index couldn't be written (errno is set), the old one is left as it was.
+ */
+bool write_mail_index(int dir_fd, mail_index_header *header, const uint64_t *sizes, const uint8_t *name_lengths, const char *names);
+
+#endif
@@ -8,7 +8,29 @@
 #include <statistics.h>
 
 #define MAX_CLIENTS 5
-#define MAX_PENDING_CLIENTS 10
+/**
+ * @brief The connections the kernel queues for a server before they are accepted
+ */
+#define DEFAULT_BACKLOG SOMAXCONN
+#define MAX_WORKERS 64
+/**
+ * @brief The worker of the servers with a loop of their own, on a thread with
+ * a higher priority, so their clients are served even when the workers are saturated
+ */
+#define PRIORITY_WORKER (-1)
+/**
+ * @brief The highest descriptor limit, whatever RLIMIT_NOFILE allows
+ */
+#define MAX_FD_LIMIT (1 << 20)
+/**
+ * @brief The seconds a client can stay idle, RFC 1939 asks for at least 10 minutes
+ */
+#define DEFAULT_IDLE_TIMEOUT 600
+/**
+ * @brief The bytes queued for a client before its commands stop being read,
+ * they are read again once half of them are sent
+ */
+#define MAX_QUEUED_BYTES (64 * 1024)
 
 typedef enum ON_MESSAGE_RESULT
 {
@@ -17,6 +39,23 @@ typedef enum ON_MESSAGE_RESULT
     CONNECTION_ERROR = -1
 } ON_MESSAGE_RESULT;
 
+typedef enum IO_ENGINE
+{
+    /**
+     * @brief Portable poll(2) engine, scans every descriptor on each wakeup
+     */
+    ENGINE_POLL,
+    /**
+     * @brief Linux epoll(7) engine, only ready descriptors are visited
+     */
+    ENGINE_EPOLL,
+    /**
+     * @brief Linux io_uring(7) engine, the readiness polls are queued in a ring
+     * and submitted together with the wait, so changing them costs no syscall
+     */
+    ENGINE_URING
+} IO_ENGINE;
+
 /**
  * @brief Handle a connection event
  *
@@ -33,7 +72,7 @@ typedef ON_MESSAGE_RESULT (*connection_event)(const int client_fd, struct sockad
  * @brief Handle a message event
  *
  * @param client_fd The client file descriptor.
- * @param body The message body.
+ * @param body The message body, the handler may modify it as it's discarded afterwards.
  * @param length The message length.
  * @param server_fd The server that received the message.
  * @param ip The client IP address.
@@ -41,7 +80,7 @@ typedef ON_MESSAGE_RESULT (*connection_event)(const int client_fd, struct sockad
  * @return CLOSE_CONNECTION to close.
  * @return CONNECTION_ERROR to save to stats and close.
  */
-typedef ON_MESSAGE_RESULT (*message_event)(const int client_fd, const char *body, size_t length, const int server_fd, const char *ip);
+typedef ON_MESSAGE_RESULT (*message_event)(const int client_fd, char *body, size_t length, const int server_fd, const char *ip);
 
 /**
  * @brief Handle a close event
@@ -56,28 +95,167 @@ typedef void (*close_event)(const int client_fd, ON_MESSAGE_RESULT result, const
 /**
  * @brief Handle a finished read and send event
  *
- * @param file The file that has been read.
+ * @param fd The file descriptor that has been read.
  * @return int Unused.
  */
-typedef int (*read_event)(FILE *file);
+typedef int (*read_event)(int fd);
+
+/**
+ * @brief Produce the next segment of a stream
+ * @note The segment must stay valid until the stream is released.
+ *
+ * @param state The stream state.
+ * @param segment Where to store the segment start.
+ * @return size_t The segment length, 0 once the stream is finished.
+ */
+typedef size_t (*produce_event)(void *state, const char **segment);
+
+/**
+ * @brief Release the state of a finished or abandoned stream
+ *
+ * @param state The stream state.
+ */
+typedef void (*release_event)(void *state);
+
+/**
+ * @brief Select the I/O engine used by server_loop.
+ * @note Must be called before server_loop. If io_uring is not available
+ * when the server starts, epoll is used instead.
+ *
+ * @param name The engine name, "poll", "epoll" or "uring".
+ * @return true If the engine is known.
+ * @return false If the engine is unknown, the current one is kept.
+ */
+bool set_io_engine(const char *name);
+/**
+ * @brief Get the I/O engine used by server_loop.
+ *
+ * @return IO_ENGINE The selected engine, ENGINE_EPOLL by default.
+ */
+IO_ENGINE get_io_engine();
+
+/**
+ * @brief Set the number of worker threads, each one running its own event loop.
+ * @note Must be called before start_server.
+ *
+ * @param count The number of workers, between 1 and MAX_WORKERS.
+ * @return true If the count is valid.
+ * @return false If the count is out of range, the current one is kept.
+ */
+bool set_workers(int count);
+/**
+ * @brief Get the number of worker threads.
+ *
+ * @return int The number of workers, 1 by default.
+ */
+int get_workers();
+
+/**
+ * @brief Set a ceiling for the descriptors used by the server.
+ * @note Must be called before start_server.
+ *
+ * @param count The highest number of descriptors, at least 1.
+ * @return true If the count is valid.
+ * @return false If the count is invalid, RLIMIT_NOFILE is used.
+ */
+bool set_max_fds(int count);
+/**
+ * @brief Get the limit for the descriptors, the connections past it are rejected.
+ * @note The first call raises RLIMIT_NOFILE up to its hard limit.
+ *
+ * @return int The lowest of the configured ceiling and RLIMIT_NOFILE (minus a margin).
+ */
+int get_fd_limit();
+
+/**
+ * @brief Set the backlog of the servers
+ * @note Must be called before start_server or inherit_servers, the kernel caps it
+ * at net.core.somaxconn.
+ *
+ * @param backlog The connections queued before they are accepted, at least 1.
+ * @return true If the backlog is valid.
+ * @return false If the backlog is invalid, the current one is kept.
+ */
+bool set_backlog(int backlog);
+/**
+ * @brief Get the backlog of the servers
+ *
+ * @return int The backlog, DEFAULT_BACKLOG by default.
+ */
+int get_backlog();
+
+/**
+ * @brief Set the seconds a client can go without sending or receiving anything.
+ * @note Safe to call while the server runs, it's checked when the current timeouts expire.
+ *
+ * @param seconds The idle timeout, 0 to disable it.
+ */
+void set_idle_timeout(unsigned int seconds);
+/**
+ * @brief Get the idle timeout.
+ *
+ * @return unsigned int The seconds, DEFAULT_IDLE_TIMEOUT by default.
+ */
+unsigned int get_idle_timeout();
+/**
+ * @brief Set the seconds a client can stay connected, even if it's active.
+ * @note Safe to call while the server runs, it's checked when the current timeouts expire.
+ *
+ * @param seconds The session lifetime, 0 (the default) to disable it.
+ */
+void set_session_lifetime(unsigned int seconds);
+/**
+ * @brief Get the session lifetime.
+ *
+ * @return unsigned int The seconds, 0 if disabled.
+ */
+unsigned int get_session_lifetime();
 
 /**
  * @brief Initialize a TCP server in non-blocking mode.
+ * @note With more than one worker the socket is created with SO_REUSEPORT,
+ * so each worker can bind its own socket to the same address.
  *
  * @param address The server address to bind.
  * @return int The server file descriptor, or -1 if an error occurred.
  */
 int start_server(struct sockaddr_in6 *address);
 /**
- * @brief Add a server to the poll list.
+ * @brief Add a server to the poll list of a worker.
  * 
  * @note Adding a server after the server_loop produces undefined behavior.
  * (not true, I 100% assert you it would collapse in less than 3 seconds).
  *
  * @param server_fd The server file descriptor.
  * @param address The server address.
+ * @param worker The worker that accepts the server connections, or PRIORITY_WORKER.
  */
-void add_server(int server_fd, struct sockaddr_in6 *address);
+void add_server(int server_fd, struct sockaddr_in6 *address, int worker);
+/**
+ * @brief Take the servers of the process that started this one to upgrade itself.
+ * @note The POP3 servers are handed out to the workers in turns, the one bound to the
+ * manager address goes to the PRIORITY_WORKER. Must be called instead of start_server.
+ *
+ * @param manager_address The manager address, to tell its server apart.
+ * @param manager_fd Where to store the manager server, left untouched if it wasn't handed over.
+ * @return int 1 if the servers were taken, 0 if this process isn't an upgrade, -1 on error.
+ */
+int inherit_servers(const struct sockaddr_in6 *manager_address, int *manager_fd);
+/**
+ * @brief Enable upgrades, executing the given command line to start the new process.
+ * @note The command is run as is, so a relative path is resolved from the current directory.
+ *
+ * @param argv The command line, NULL terminated. It must outlive the server.
+ */
+void set_upgrade_command(char *const argv[]);
+/**
+ * @brief Upgrade the server without dropping connections: the new process takes
+ * the servers and accepts the new clients, while this one stops accepting and
+ * exits once its clients are gone.
+ * @note Safe to call from a signal handler. If the new process fails before
+ * taking over, this one keeps serving as usual.
+ */
+void request_upgrade();
 /**
  * @brief The main server loop to handle incoming connections and messages.
  *
@@ -85,6 +263,12 @@ void add_server(int server_fd, struct sockaddr_in6 *address);
  * It's expected that on_connection will not allocate resources if it will not connect.
  *
  * @note The server will run until a SIGINT or SIGTERM signal is received, which will set the done flag to true.
+ * @note After request_upgrade hands the servers over, it returns once the clients are gone.
+ * @note The clients that reach their idle timeout or session lifetime are closed
+ * as if an error happened (on_close receives CONNECTION_ERROR).
+ * @note Every worker runs its own loop, the calling thread being the first one.
+ * A connection is handled by the worker that accepted it for its whole life,
+ * so the callbacks of a client are never run concurrently.
  * @param done The flag to indicate when the server should gracefully stop.
  * @param on_connection The callback function to handle incoming connections, it may be NULL.
  * @param on_message The callback function to handle incoming messages.
@@ -96,23 +280,104 @@ int server_loop(const bool *done, connection_event on_connection, message_event
 
 /**
  * @brief Asynchronously send a package to a client.
- * @note Can only be called during an event.
+ * @note Can only be called during an event, from the worker that owns the client.
  *
  * @param client_fd The client file descriptor.
  * @param message The message to send.
  * @param length The message length.
  */
 void asend(int client_fd, const char *message, size_t length);
+/**
+ * @brief Get space to format a message for a client in place, instead of copying it with asend.
+ * @note Can only be called during an event, from the worker that owns the client.
+ * Nothing else may be sent to the client until the space is committed.
+ * @note Consecutive messages share the same buffer while they fit.
+ *
+ * @param client_fd The client file descriptor.
+ * @param length The bytes needed.
+ * @return char* Where to write up to length bytes, or NULL if memory ran out.
+ */
+char *areserve(int client_fd, size_t length);
+/**
+ * @brief Queue the message written in the space got from areserve.
+ *
+ * @param client_fd The client file descriptor.
+ * @param length The bytes written, at most the reserved ones. 0 discards the space.
+ */
+void acommit(int client_fd, size_t length);
+
+/**
+ * @brief A response formatted straight into the output buffers of a client, in a single pass
+ * @note Long responses move on to new buffers as they fill, so their size is not needed beforehand.
+ */
+typedef struct response_builder
+{
+    int client_fd;
+    /**
+     * @brief The space reserved and not committed yet, NULL if there is none
+     */
+    char *start;
+    char *cursor;
+    char *end;
+} response_builder;
+
+/**
+ * @brief Start a response for a client.
+ * @note Can only be called during an event, from the worker that owns the client.
+ * Nothing else may be sent to the client until the response ends.
+ *
+ * @param builder The response to start.
+ * @param client_fd The client file descriptor.
+ */
+void abegin(response_builder *builder, int client_fd);
+/**
+ * @brief Append a token to a response.
+ * @note If memory runs out, the token is dropped like asend does.
+ *
+ * @param builder The response.
+ * @param token The bytes to append.
+ * @param length The token length.
+ */
+void aappend(response_builder *builder, const char *token, size_t length);
+/**
+ * @brief Append a number to a response, in decimal.
+ *
+ * @param builder The response.
+ * @param number The number to append.
+ */
+void aappend_number(response_builder *builder, uint64_t number);
+/**
+ * @brief Queue what's left of a response.
+ *
+ * @param builder The response, it may be started again afterwards.
+ */
+void aend(response_builder *builder);
 /**
  * @brief Asynchronously read a file and send it to a client.
- * @note Can only be called during an event.
+ * @note Can only be called during an event, from the worker that owns the client.
+ * @note Pipes are spliced to the client, so their content never reaches user space.
+ * The file is only read once the messages before it are sent.
  *
  * @param client_fd The client file descriptor.
- * @param filename The file to read.
- * @param callback The callback after sending the file.
+ * @param file_fd The file to read, usually a pipe.
+ * @param callback The callback after sending the file, it receives file_fd (e.g. close).
  * @return true If the file was added to the queue.
- * @return false If the file couldn't be opened (maybe it doesn't exists).
+ * @return false If the file couldn't be watched, it's not closed.
+ */
+bool fasend(int client_fd, int file_fd, read_event callback);
+/**
+ * @brief Asynchronously send a stream to a client, its segments are sent without copies.
+ * @note Can only be called during an event, from the worker that owns the client.
+ * @note The stream is only produced when the client is ready to receive it,
+ * so it's never fully loaded in memory.
+ *
+ * @param client_fd The client file descriptor.
+ * @param produce The callback producing the stream segments.
+ * @param release The callback releasing the stream, after the last segment is sent or the client closes.
+ * @param state The stream state, passed to the callbacks.
+ * @return true If the stream was added to the queue.
+ * @return false If the stream couldn't be queued, it must be released by the caller.
  */
-bool fasend(int client_fd, FILE *filename, read_event callback);
+bool pasend(int client_fd, produce_event produce, release_event release, void *state);
 
 #endif
@@ -0,0 +1,65 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/**
+ * @brief The memory requested at once for the objects of a pool
+ */
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct pool_slab
+{
+    struct pool_slab *next;
+} pool_slab;
+
+/**
+ * @brief A pool of objects of the same size, carved from big slabs
+ * @note Freed objects are kept for the next allocations, the slabs are only
+ * released when the pool is destroyed, so the memory never fragments.
+ * @note A pool is not thread safe, each one must belong to a single thread.
+ */
+typedef struct pool
+{
+    size_t object_size;
+    size_t slab_objects;
+    /**
+     * @brief The free objects, each one storing the next
+     */
+    void *free;
+    pool_slab *slabs;
+} pool;
+
+/**
+ * @brief Initialize an empty pool
+ *
+ * @param target
+ * @param object_size The size of the objects, at least the size of a pointer.
+ */
+void init_pool(pool *target, size_t object_size);
+
+/**
+ * @brief Get an object from the pool, uninitialized
+ *
+ * @param target
+ * @return void* The object, or NULL if memory ran out.
+ */
+void *pool_alloc(pool *target);
+
+/**
+ * @brief Return an object to its pool
+ *
+ * @param target The pool the object came from.
+ * @param object The object, it may be NULL.
+ */
+void pool_free(pool *target, void *object);
+
+/**
+ * @brief Release the slabs of a pool, its objects must not be used anymore
+ * @note A zeroed pool can be destroyed too.
+ *
+ * @param target
+ */
+void destroy_pool(pool *target);
+
+#endif
@@ -42,13 +42,13 @@ ON_MESSAGE_RESULT handle_pop_connect(int client_fd, struct sockaddr_in6 address,
  * @note Implementation of message_event handler.
  *
  * @param client_fd The client file descriptor.
- * @param body The message body.
+ * @param body The message body, the commands are terminated in place.
  * @param length The message length.
  * @param server_fd The server that received the message.
  * @param ip The client IP address.
  * @return ON_MESSAGE_RESULT The result of the message handling.
  */
-ON_MESSAGE_RESULT handle_pop_message(int client_fd, const char *body, size_t length, const int server_fd, const char *ip);
+ON_MESSAGE_RESULT handle_pop_message(int client_fd, char *body, size_t length, const int server_fd, const char *ip);
 
 /**
  * @brief Free the resources associated with a client connection.
@@ -10,9 +10,26 @@ typedef struct {
     char username[MAX_USERNAME_LENGTH + 1];
     char password[MAX_PASSWORD_LENGTH + 1];
     bool locked;
+    /**
+     * @brief The lock file of the mailbox while it's locked, -1 if it has none.
+     * @note It's held with flock, so the mailbox is also locked for another
+     * server process (the one taking over during an upgrade).
+     */
+    int lock_fd;
 } User;
 
 
+/**
+ * @brief Take the users lock, needed to use the result of get_user or get_users_arr
+ * @note The setters, delete_user and the user locks take it on their own,
+ * so they must not be called while holding it.
+ */
+void lock_users();
+/**
+ * @brief Release the users lock.
+ */
+void unlock_users();
+
 char *get_maildir();
 char *get_version();
 struct sockaddr_in6 get_pop_adport();
@@ -1,5 +1,6 @@
 #ifndef STSTC_H
 #define STSTC_H
+#include <pthread.h>
 #include <stdint.h>
 #include <time.h>
 #include "closed_hashing.h"
@@ -57,6 +58,10 @@ typedef struct statistics_manager
     pop_log **logs_array;
     uint64_t logs_array_dim;
     uint64_t logs_array_size;
+    /**
+     * @brief Serializes the workers, every public function takes it
+     */
+    pthread_mutex_t mutex;
 } statistics_manager;
 
 statistics_manager *create_statistics_manager();
@@ -64,7 +69,7 @@ void destroy_statistics_manager(statistics_manager *sm);
 timestamp log_now();
 char *readable_time(timestamp t);
 
-void log_bytes_transferred(statistics_manager *sm, char *username, char *ip, uint64_t bytes, timestamp time);
+void log_bytes_transferred(statistics_manager *sm, uint64_t bytes);
 void log_connect(statistics_manager *sm, char *username, char *ip, timestamp time);
 void log_disconnect(statistics_manager *sm, char *username, char *ip, timestamp time);
 void log_other(statistics_manager *sm, char *username, char *ip, timestamp time, void *data);
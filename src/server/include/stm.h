@@ -34,7 +34,7 @@ struct state_machine {
     const struct state_definition *current;
 };
 
-struct selector_key *key;
+struct selector_key;
 
 /**
  * definición de un estado de la máquina de estados
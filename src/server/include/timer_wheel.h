@@ -0,0 +1,110 @@
+#ifndef TMRWHL_H
+#define TMRWHL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief The slots of each level are indexed with this many bits of the tick
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+/**
+ * @brief Each level spans TIMER_WHEEL_SLOTS times the previous one,
+ * the timers further away wait in the last level, keeping their expiry,
+ * and are placed again each time it turns until they are in range
+ */
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+ * @brief A timer, meant to be embedded in the structure it belongs to
+ * @note It must be zeroed before its first use.
+ */
+typedef struct timer_node
+{
+    struct timer_node *next;
+    struct timer_node *prev;
+    /**
+     * @brief The tick in which the timer expires
+     */
+    uint64_t expires;
+} timer_node;
+
+/**
+ * @brief Handle an expired timer
+ * @note The timer is no longer in the wheel, it may be added again.
+ *
+ * @param timer The expired timer.
+ */
+typedef void (*timer_event)(timer_node *timer);
+
+/**
+ * @brief A hierarchical timing wheel, adding, removing and expiring a timer is O(1)
+ * @note Timers further than the first level are moved down (cascaded)
+ * as the wheel turns, each one at most once per level.
+ */
+typedef struct timer_wheel
+{
+    /**
+     * @brief The last tick processed
+     */
+    uint64_t now;
+    uint64_t count;
+    /**
+     * @brief The heads of the circular list of each slot
+     */
+    timer_node slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+/**
+ * @brief Initialize an empty wheel
+ *
+ * @param wheel
+ * @param now The current tick.
+ */
+void init_timer_wheel(timer_wheel *wheel, uint64_t now);
+
+/**
+ * @brief Schedule a timer, rescheduling it if it was already in the wheel
+ * @note A timer that already expired fires on the next tick.
+ *
+ * @param wheel
+ * @param timer
+ * @param expires The tick in which the timer expires.
+ */
+void timer_wheel_add(timer_wheel *wheel, timer_node *timer, uint64_t expires);
+
+/**
+ * @brief Remove a timer from the wheel, if it's in it
+ *
+ * @param wheel
+ * @param timer
+ */
+void timer_wheel_remove(timer_wheel *wheel, timer_node *timer);
+
+/**
+ * @brief Whether the timer is in a wheel
+ *
+ * @param timer
+ * @return bool
+ */
+bool timer_pending(const timer_node *timer);
+
+/**
+ * @brief Turn the wheel until the given tick, expiring the timers on the way
+ *
+ * @param wheel
+ * @param now The current tick.
+ * @param expire The handler of the expired timers.
+ */
+void timer_wheel_advance(timer_wheel *wheel, uint64_t now, timer_event expire);
+
+/**
+ * @brief The ticks the wheel can wait before it must turn again
+ *
+ * @param wheel
+ * @return int64_t The ticks until the next expiry or cascade, -1 if the wheel is empty.
+ */
+int64_t timer_wheel_next(const timer_wheel *wheel);
+
+#endif
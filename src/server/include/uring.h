@@ -0,0 +1,179 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * @brief An io_uring instance with its rings mapped, used through raw syscalls
+ * @note Only one thread may use a ring at a time.
+ */
+typedef struct uring
+{
+    int fd;
+    unsigned entries;
+
+    // Submission queue, the kernel moves the head and we move the tail
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    /**
+     * @brief The tail including the entries not submitted yet
+     */
+    unsigned sq_pending;
+
+    // Completion queue, the kernel moves the tail and we move the head
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring;
+
+/**
+ * @brief A group of buffers the kernel picks from when an operation selects one
+ * (a provided buffer ring, Linux 5.19)
+ * @note The buffers are given back one at a time once their data is used.
+ */
+typedef struct uring_buffers
+{
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    char *slab;
+    size_t slab_size;
+    size_t buffer_size;
+    unsigned count;
+    unsigned short group;
+} uring_buffers;
+
+/**
+ * @brief Create a ring
+ * @note The kernel must support waiting with a timeout (IORING_FEAT_EXT_ARG, Linux 5.11).
+ *
+ * @param ring
+ * @param entries The size of the submission queue, a power of 2.
+ * @return true The ring is ready.
+ * @return false The kernel refused it or doesn't support it (errno is set).
+ */
+bool init_uring(uring *ring, unsigned entries);
+
+/**
+ * @brief Whether io_uring can be used by this process (it may be disabled by a seccomp filter),
+ * with the given operations and provided buffer rings
+ *
+ * @param opcodes The IORING_OP_* operations needed.
+ * @param count The number of operations.
+ * @return bool
+ */
+bool uring_available(const unsigned char *opcodes, size_t count);
+
+/**
+ * @brief Get a free submission entry, zeroed, to be submitted on the next wait
+ * @note If the queue is full, the queued entries are submitted first.
+ *
+ * @param ring
+ * @return struct io_uring_sqe* The entry, or NULL if the queue couldn't be flushed.
+ */
+struct io_uring_sqe *uring_get_sqe(uring *ring);
+
+/**
+ * @brief Submit the queued entries and wait for at least one completion
+ *
+ * @param ring
+ * @param timeout The timeout in milliseconds, -1 to wait forever.
+ * @return int 0 on success or timeout, -1 on error (errno is set).
+ */
+int uring_wait(uring *ring, int timeout);
+
+/**
+ * @brief Get the oldest completion, without waiting
+ *
+ * @param ring
+ * @return struct io_uring_cqe* The completion, or NULL if there are none.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring *ring);
+
+/**
+ * @brief Release the completion returned by uring_peek_cqe
+ *
+ * @param ring
+ */
+void uring_cqe_seen(uring *ring);
+
+/**
+ * @brief Get the number of completions waiting to be read
+ *
+ * @param ring
+ * @return unsigned The completions, including the ones posted since the last wait.
+ */
+unsigned uring_ready(uring *ring);
+
+/**
+ * @brief Allocate a group of buffers and register it as a provided buffer ring
+ *
+ * @param ring
+ * @param buffers The group to initialize.
+ * @param group The group id, used by the operations to select a buffer from it.
+ * @param count The number of buffers, a power of 2 below 32768.
+ * @param size The size of each buffer.
+ * @return true Every buffer is available to the kernel.
+ * @return false The kernel refused the group or memory ran out (errno is set).
+ */
+bool uring_provide_buffers(uring *ring, uring_buffers *buffers, unsigned short group, unsigned count, size_t size);
+
+/**
+ * @brief Get a buffer of a group, from the id reported by its completion
+ *
+ * @param buffers
+ * @param id The buffer id, in the flags of the completion (IORING_CQE_BUFFER_SHIFT).
+ * @return char* The buffer.
+ */
+char *uring_buffer(uring_buffers *buffers, unsigned short id);
+
+/**
+ * @brief Give a buffer back to the kernel, once its data is used
+ *
+ * @param buffers
+ * @param id The buffer id.
+ */
+void uring_recycle_buffer(uring_buffers *buffers, unsigned short id);
+
+/**
+ * @brief Unregister a group of buffers and release its memory
+ * @note The operations that may select a buffer must have finished.
+ *
+ * @param ring
+ * @param buffers An initialized group.
+ */
+void uring_release_buffers(uring *ring, uring_buffers *buffers);
+
+/**
+ * @brief Register buffers for the fixed operations (IORING_OP_READ_FIXED and such),
+ * so their pages are not mapped again on every operation
+ * @note The pages are pinned, which counts against RLIMIT_MEMLOCK without CAP_IPC_LOCK.
+ *
+ * @param ring
+ * @param iov The buffers, the index of each one is its buf_index.
+ * @param count The number of buffers.
+ * @return true The buffers are registered.
+ * @return false The kernel refused them (errno is set).
+ */
+bool uring_register_buffers(uring *ring, const struct iovec *iov, unsigned count);
+
+/**
+ * @brief Unmap the rings and close the instance, cancelling what's still pending
+ *
+ * @param ring An initialized ring.
+ */
+void destroy_uring(uring *ring);
+
+#endif
@@ -1,9 +1,30 @@
 #include <argument_parser.h>
+#include <ctype.h>
+#include <errno.h>
+#include <mail_cache.h>
 #include <management_config.h>
 #include <pop_config.h>
 
 static void usage();
 static void help();
+/**
+ * @brief Parse a number of seconds, with the same rules as the SET command of the manager
+ *
+ * @param value The argument, it may be NULL if it's missing.
+ * @param seconds Where to store the seconds.
+ * @return true The argument is a number of seconds.
+ * @return false The argument is missing, it's not only digits or it's too big.
+ */
+static bool parse_seconds(const char *value, unsigned int *seconds);
+/**
+ * @brief Parse a whole number, rejecting trailing characters
+ *
+ * @param value The argument, it may be NULL if it's missing.
+ * @param number Where to store the number.
+ * @return true The argument is a number.
+ * @return false The argument is missing, it's not a number or it doesn't fit an int.
+ */
+static bool parse_int(const char *value, int *number);
 
 static const char *_progname;
 
@@ -44,6 +65,66 @@ void parse_arguments(int argc, const char *argv[], const char *progname)
             case 't':
                 set_transformer(argv[++i]);
                 break;
+            case 'w':
+                if (!set_workers(atoi(argv[++i])))
+                {
+                    printf("Workers must be between 1 and %d\n", MAX_WORKERS);
+                    exit(1);
+                }
+                break;
+            case 'e':
+                if (!set_io_engine(argv[++i]))
+                {
+                    printf("Engine must be poll, epoll or uring\n");
+                    exit(1);
+                }
+                break;
+            case 'i':
+            {
+                unsigned int seconds;
+                if (!parse_seconds(argv[++i], &seconds))
+                {
+                    printf("The idle timeout must be a number of seconds, 0 to disable it\n");
+                    exit(1);
+                }
+                set_idle_timeout(seconds);
+                break;
+            }
+            case 's':
+            {
+                unsigned int seconds;
+                if (!parse_seconds(argv[++i], &seconds))
+                {
+                    printf("The session lifetime must be a number of seconds, 0 to disable it\n");
+                    exit(1);
+                }
+                set_session_lifetime(seconds);
+                break;
+            }
+            case 'm':
+                if (!set_max_fds(atoi(argv[++i])))
+                {
+                    printf("The descriptors limit must be a positive number\n");
+                    exit(1);
+                }
+                break;
+            case 'b':
+                if (!set_backlog(atoi(argv[++i])))
+                {
+                    printf("The backlog must be a positive number\n");
+                    exit(1);
+                }
+                break;
+            case 'c':
+            {
+                int megabytes;
+                if (!parse_int(argv[++i], &megabytes) || !set_mail_cache_size(megabytes))
+                {
+                    printf("The cache size must be a non-negative number of MiB\n");
+                    exit(1);
+                }
+                break;
+            }
             case 'u':
                 while(++i < argc && argv[i][0] != '-')
                 {
@@ -108,6 +189,45 @@ void parse_arguments(int argc, const char *argv[], const char *progname)
     }
 }
 
+static bool parse_seconds(const char *value, unsigned int *seconds)
+{
+    if (!value || !isdigit((unsigned char)value[0]))
+    {
+        return false;
+    }
+
+    char *end;
+    unsigned long parsed = strtoul(value, &end, 10);
+
+    if (*end || parsed > UINT_MAX)
+    {
+        return false;
+    }
+
+    *seconds = parsed;
+    return true;
+}
+
+static bool parse_int(const char *value, int *number)
+{
+    if (!value || !*value)
+    {
+        return false;
+    }
+
+    char *end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+
+    if (*end || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX)
+    {
+        return false;
+    }
+
+    *number = parsed;
+    return true;
+}
+
 static void printUsage(FILE *fd)
 {
     fprintf(fd,
@@ -123,6 +243,13 @@ static void printUsage(FILE *fd)
             "   -v               Imprime información sobre la versión versión y termina.\n"
             "   -d <dir>         Carpeta donde residen los Maildirs\n"
             "   -t <cmd>         Comando para aplicar transformaciones\n"
+            "   -e <engine>      Motor de I/O: poll, epoll o uring (por defecto epoll)\n"
+            "   -w <workers>     Cantidad de hilos atendiendo conexiones POP3 (por defecto 1)\n"
+            "   -i <segundos>    Tiempo de inactividad tras el cual se desconecta al cliente, 0 para desactivarlo (por defecto 600)\n"
+            "   -s <segundos>    Duración máxima de una sesión, 0 para desactivarla (por defecto 0)\n"
+            "   -m <fds>         Máximo de descriptores abiertos, se rechazan las conexiones que lo superen (por defecto RLIMIT_NOFILE)\n"
+            "   -b <conexiones>  Conexiones encoladas por el kernel antes de ser aceptadas (por defecto SOMAXCONN)\n"
+            "   -c <MiB>         Memoria para el listado de los buzones, 0 para desactivarla (por defecto 64)\n"
             "\n",
             _progname);
 }
@@ -0,0 +1,89 @@
+#include <fd_table.h>
+#include <stdlib.h>
+
+#define PAGES(limit) (((limit) + FD_TABLE_PAGE_SIZE - 1) / FD_TABLE_PAGE_SIZE)
+
+fd_table *new_fd_table(size_t entry_size, int limit)
+{
+    fd_table *table = malloc(sizeof(fd_table));
+    if (!table)
+    {
+        return NULL;
+    }
+
+    table->entry_size = entry_size;
+    table->limit = limit > 0 ? limit : 0;
+    table->pages = calloc(PAGES(table->limit) + 1, sizeof(*table->pages));
+
+    if (!table->pages)
+    {
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+void *fd_table_reserve(fd_table *table, int fd)
+{
+    if (fd < 0 || fd >= table->limit)
+    {
+        return NULL;
+    }
+
+    _Atomic(char *) *slot = table->pages + fd / FD_TABLE_PAGE_SIZE;
+    char *page = atomic_load_explicit(slot, memory_order_acquire);
+
+    if (!page)
+    {
+        char *created = calloc(FD_TABLE_PAGE_SIZE, table->entry_size);
+        if (!created)
+        {
+            return NULL;
+        }
+
+        // Another thread may have created it in the meantime
+        if (atomic_compare_exchange_strong_explicit(slot, &page, created, memory_order_acq_rel, memory_order_acquire))
+        {
+            page = created;
+        }
+        else
+        {
+            free(created);
+        }
+    }
+
+    return page + (fd % FD_TABLE_PAGE_SIZE) * table->entry_size;
+}
+
+void *fd_table_get(const fd_table *table, int fd)
+{
+    if (fd < 0 || fd >= table->limit)
+    {
+        return NULL;
+    }
+
+    char *page = atomic_load_explicit(table->pages + fd / FD_TABLE_PAGE_SIZE, memory_order_acquire);
+    if (!page)
+    {
+        return NULL;
+    }
+
+    return page + (fd % FD_TABLE_PAGE_SIZE) * table->entry_size;
+}
+
+void free_fd_table(fd_table *table)
+{
+    if (!table)
+    {
+        return;
+    }
+
+    for (int i = 0; i < PAGES(table->limit); i++)
+    {
+        free(atomic_load(table->pages + i));
+    }
+
+    free(table->pages);
+    free(table);
+}
@@ -0,0 +1,493 @@
+#include <mail_cache.h>
+#include <closed_hashing.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Anything that adds, removes or renames a mail, and the directory going away
+#define WATCHED_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define EVENTS_BUFFER_SIZE 4096
+
+struct mail_cache_entry;
+
+/**
+ * @brief An inotify watch, looked up by its descriptor when an event comes
+ */
+typedef struct mail_cache_watch
+{
+    int wd;
+    struct mail_cache_entry *entry;
+} mail_cache_watch;
+
+/**
+ * @brief A watched mailbox, with its listing while it's up to date
+ */
+typedef struct mail_cache_entry
+{
+    /**
+     * @brief The directory of the mailbox, it includes the maildir so a new one never hits
+     */
+    char *path;
+    mail_cache_watch new_watch;
+    mail_cache_watch cur_watch;
+    /**
+     * @brief Changed every time the mailbox changes, a ticket is only valid while it matches
+     */
+    uint64_t generation;
+    /**
+     * @brief NULL until a session loads it, or after the mailbox changed
+     */
+    mail_listing *listing;
+    // The LRU list, the most recently used first
+    struct mail_cache_entry *prev;
+    struct mail_cache_entry *next;
+} mail_cache_entry;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t cache_limit = (size_t)DEFAULT_MAIL_CACHE_SIZE << 20;
+static size_t cache_used = 0;
+
+static int inotify_fd = -1;
+static bool inotify_failed = false;
+
+static uint64_t generations = 0;
+
+static hashset *entries = NULL;
+static hashset *watches = NULL;
+static mail_cache_entry *lru_first = NULL;
+static mail_cache_entry *lru_last = NULL;
+
+/**
+ * @brief Read the pending inotify events, dropping the listings of the mailboxes that changed
+ * @note Must be called with the cache locked.
+ */
+static void drain_events();
+
+/**
+ * @brief Start watching a mailbox
+ * @note Must be called with the cache locked.
+ *
+ * @param user_path The directory of the mailbox.
+ * @return mail_cache_entry* The new entry, or NULL if it couldn't be watched.
+ */
+static mail_cache_entry *watch_mailbox(const char *user_path);
+
+/**
+ * @brief Drop the listing of a mailbox, invalidating the tickets given for it
+ *
+ * @param entry
+ */
+static void invalidate(mail_cache_entry *entry);
+
+/**
+ * @brief Stop watching a mailbox and forget it
+ *
+ * @param entry
+ */
+static void evict(mail_cache_entry *entry);
+
+/**
+ * @brief Evict the least recently used mailboxes until the cache fits its limit
+ *
+ * @param keep The entry that must not be evicted.
+ */
+static void trim(const mail_cache_entry *keep);
+
+/**
+ * @brief Move an entry to the front of the LRU list
+ *
+ * @param entry
+ */
+static void touch(mail_cache_entry *entry);
+
+static uint64_t hash_entry(const void *element)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = (const unsigned char *)((const mail_cache_entry *)element)->path; *c; c++)
+    {
+        hash = (hash ^ *c) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static char equal_entries(const void *a, const void *b)
+{
+    return !strcmp(((const mail_cache_entry *)a)->path, ((const mail_cache_entry *)b)->path);
+}
+
+static void keep_entry(void *element)
+{
+    // The entries are freed by evict
+    (void)element;
+}
+
+static uint64_t hash_watch(const void *element)
+{
+    return (uint64_t)((const mail_cache_watch *)element)->wd;
+}
+
+static char equal_watches(const void *a, const void *b)
+{
+    return ((const mail_cache_watch *)a)->wd == ((const mail_cache_watch *)b)->wd;
+}
+
+mail_listing *new_mail_listing(size_t count, size_t names_size)
+{
+    // From the widest fields to the narrowest, so every array is aligned
+    size_t sizes_bytes = count * sizeof(uint64_t);
+    size_t offsets_bytes = count * sizeof(uint32_t);
+    size_t memory = sizeof(mail_listing) + sizes_bytes + offsets_bytes + 2 * count + names_size + 1;
+
+    mail_listing *listing = malloc(memory);
+    if (!listing)
+    {
+        return NULL;
+    }
+
+    char *block = (char *)(listing + 1);
+
+    atomic_init(&listing->refs, 1);
+    listing->count = 0;
+    listing->total_size = 0;
+    listing->sizes = (uint64_t *)block;
+    listing->name_offsets = (uint32_t *)(block + sizes_bytes);
+    listing->name_lengths = (uint8_t *)(block + sizes_bytes + offsets_bytes);
+    listing->uid_lengths = listing->name_lengths + count;
+    listing->names = (char *)(listing->uid_lengths + count);
+    listing->memory = memory;
+
+    return listing;
+}
+
+void release_mail_listing(mail_listing *listing)
+{
+    if (listing && atomic_fetch_sub(&listing->refs, 1) == 1)
+    {
+        free(listing);
+    }
+}
+
+bool set_mail_cache_size(int megabytes)
+{
+    if (megabytes < 0)
+    {
+        return false;
+    }
+
+    cache_limit = (size_t)megabytes << 20;
+    return true;
+}
+
+mail_listing *mail_cache_get(const char *user_path, uint64_t *ticket)
+{
+    *ticket = 0;
+
+    if (!cache_limit)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    if (inotify_fd < 0 && !inotify_failed)
+    {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        inotify_failed = inotify_fd < 0;
+
+        if (inotify_failed)
+        {
+            perror("inotify_init1");
+        }
+    }
+
+    if (inotify_failed)
+    {
+        pthread_mutex_unlock(&cache_mutex);
+        return NULL;
+    }
+
+    if (!entries)
+    {
+        entries = new_hashset(hash_entry, equal_entries, keep_entry, 64);
+        watches = new_hashset(hash_watch, equal_watches, keep_entry, 128);
+    }
+
+    drain_events();
+
+    mail_cache_entry key = {.path = (char *)user_path};
+    mail_cache_entry *entry = hashset_get(entries, &key);
+
+    if (!entry)
+    {
+        entry = watch_mailbox(user_path);
+    }
+    else
+    {
+        touch(entry);
+    }
+
+    mail_listing *listing = NULL;
+
+    if (entry && entry->listing)
+    {
+        listing = entry->listing;
+        atomic_fetch_add(&listing->refs, 1);
+    }
+    else if (entry)
+    {
+        *ticket = entry->generation;
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    return listing;
+}
+
+void mail_cache_put(const char *user_path, mail_listing *listing, uint64_t ticket)
+{
+    if (!ticket || listing->memory > cache_limit)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    // The events of the changes made while the mailbox was loaded invalidate the ticket
+    drain_events();
+
+    mail_cache_entry key = {.path = (char *)user_path};
+    mail_cache_entry *entry = hashset_get(entries, &key);
+
+    if (entry && entry->generation == ticket && !entry->listing)
+    {
+        atomic_fetch_add(&listing->refs, 1);
+        entry->listing = listing;
+        cache_used += listing->memory;
+
+        touch(entry);
+        trim(entry);
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void destroy_mail_cache()
+{
+    pthread_mutex_lock(&cache_mutex);
+
+    while (lru_first)
+    {
+        evict(lru_first);
+    }
+
+    if (entries)
+    {
+        free_hashset(entries);
+        free_hashset(watches);
+        entries = NULL;
+        watches = NULL;
+    }
+
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+static void drain_events()
+{
+    alignas(struct inotify_event) char events[EVENTS_BUFFER_SIZE];
+
+    ssize_t length;
+    while ((length = read(inotify_fd, events, sizeof(events))) > 0)
+    {
+        const struct inotify_event *event;
+        for (char *next = events; next < events + length; next += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event *)next;
+
+            // Some events were lost, any mailbox may have changed
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                for (mail_cache_entry *entry = lru_first; entry; entry = entry->next)
+                {
+                    invalidate(entry);
+                }
+                continue;
+            }
+
+            // The watches removed by evict are reported too, once their entry is gone
+            mail_cache_watch key = {.wd = event->wd};
+            mail_cache_watch *watch = hashset_get(watches, &key);
+            if (!watch)
+            {
+                continue;
+            }
+
+            mail_cache_entry *entry = watch->entry;
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                evict(entry);
+            }
+            else
+            {
+                invalidate(entry);
+            }
+        }
+    }
+}
+
+static mail_cache_entry *watch_mailbox(const char *user_path)
+{
+    mail_cache_entry *entry = malloc(sizeof(mail_cache_entry));
+    if (!entry)
+    {
+        return NULL;
+    }
+
+    entry->path = strdup(user_path);
+
+    char path[strlen(user_path) + sizeof("/new")];
+
+    snprintf(path, sizeof(path), "%s/new", user_path);
+    entry->new_watch.wd = inotify_add_watch(inotify_fd, path, WATCHED_EVENTS);
+    entry->new_watch.entry = entry;
+
+    snprintf(path, sizeof(path), "%s/cur", user_path);
+    entry->cur_watch.wd = inotify_add_watch(inotify_fd, path, WATCHED_EVENTS);
+    entry->cur_watch.entry = entry;
+
+    if (!entry->path || entry->new_watch.wd < 0 || entry->cur_watch.wd < 0)
+    {
+        if (entry->new_watch.wd >= 0)
+        {
+            inotify_rm_watch(inotify_fd, entry->new_watch.wd);
+        }
+
+        if (entry->cur_watch.wd >= 0)
+        {
+            inotify_rm_watch(inotify_fd, entry->cur_watch.wd);
+        }
+
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+
+    entry->generation = ++generations;
+    entry->listing = NULL;
+    entry->prev = NULL;
+    entry->next = lru_first;
+
+    if (lru_first)
+    {
+        lru_first->prev = entry;
+    }
+    else
+    {
+        lru_last = entry;
+    }
+
+    lru_first = entry;
+
+    hashset_add(entries, entry);
+    hashset_add(watches, &entry->new_watch);
+    hashset_add(watches, &entry->cur_watch);
+    cache_used += sizeof(mail_cache_entry) + strlen(entry->path) + 1;
+
+    trim(entry);
+
+    return entry;
+}
+
+static void invalidate(mail_cache_entry *entry)
+{
+    entry->generation = ++generations;
+
+    if (entry->listing)
+    {
+        cache_used -= entry->listing->memory;
+        release_mail_listing(entry->listing);
+        entry->listing = NULL;
+    }
+}
+
+static void evict(mail_cache_entry *entry)
+{
+    invalidate(entry);
+
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        lru_first = entry->next;
+    }
+
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        lru_last = entry->prev;
+    }
+
+    hashset_delete(entries, entry);
+    hashset_delete(watches, &entry->new_watch);
+    hashset_delete(watches, &entry->cur_watch);
+
+    // A watch already gone is refused, there is nothing to undo then
+    inotify_rm_watch(inotify_fd, entry->new_watch.wd);
+    inotify_rm_watch(inotify_fd, entry->cur_watch.wd);
+
+    cache_used -= sizeof(mail_cache_entry) + strlen(entry->path) + 1;
+
+    free(entry->path);
+    free(entry);
+}
+
+static void trim(const mail_cache_entry *keep)
+{
+    while (cache_used > cache_limit && lru_last && lru_last != keep)
+    {
+        evict(lru_last);
+    }
+}
+
+static void touch(mail_cache_entry *entry)
+{
+    if (entry == lru_first)
+    {
+        return;
+    }
+
+    entry->prev->next = entry->next;
+
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        lru_last = entry->prev;
+    }
+
+    entry->prev = NULL;
+    entry->next = lru_first;
+    lru_first->prev = entry;
+    lru_first = entry;
+}
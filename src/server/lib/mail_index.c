@@ -0,0 +1,165 @@
+#include <mail_index.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// The last byte is the version of the layout
+#define MAIL_INDEX_MAGIC "POP3IDX1"
+
+#define MAIL_INDEX_TEMP_FILE MAIL_INDEX_FILE ".tmp"
+
+void settle_mail_dir(mail_index_stamp *stamp, const struct stat *st)
+{
+    stamp->ino = st->st_ino;
+    stamp->sec = st->st_mtim.tv_sec;
+    stamp->nsec = st->st_mtim.tv_nsec;
+}
+
+void stamp_mail_dir(mail_index_stamp *stamp, const struct stat *st)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    int64_t age = (now.tv_sec - st->st_mtim.tv_sec) * 1000000000LL + (now.tv_nsec - st->st_mtim.tv_nsec);
+
+    if (age < 1000000000LL)
+    {
+        memset(stamp, 0, sizeof(mail_index_stamp));
+        return;
+    }
+
+    settle_mail_dir(stamp, st);
+}
+
+bool mail_dir_matches(const mail_index_stamp *stamp, const struct stat *st)
+{
+    return stamp->ino && stamp->ino == st->st_ino && stamp->sec == st->st_mtim.tv_sec && stamp->nsec == st->st_mtim.tv_nsec;
+}
+
+bool open_mail_index(mail_index *index, int dir_fd)
+{
+    memset(index, 0, sizeof(mail_index));
+
+    int fd = openat(dir_fd, MAIL_INDEX_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(mail_index_header))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+
+    index->map = map;
+    index->map_size = st.st_size;
+    index->header = map;
+
+    const mail_index_header *header = index->header;
+    size_t arrays_size = index->map_size - sizeof(mail_index_header);
+
+    // The counts are checked one at a time, so they can't overflow
+    if (memcmp(header->magic, MAIL_INDEX_MAGIC, sizeof(header->magic)) ||
+        header->count > arrays_size / (sizeof(uint64_t) + sizeof(uint8_t)) ||
+        header->names_size != arrays_size - header->count * (sizeof(uint64_t) + sizeof(uint8_t)))
+    {
+        close_mail_index(index);
+        return false;
+    }
+
+    index->sizes = (const uint64_t *)(header + 1);
+    index->name_lengths = (const uint8_t *)(index->sizes + header->count);
+    index->names = (const char *)(index->name_lengths + header->count);
+
+    // Every filename must end where its length says
+    size_t offset = 0;
+    for (uint64_t i = 0; i < header->count; i++)
+    {
+        offset += index->name_lengths[i];
+
+        if (offset >= header->names_size || index->names[offset])
+        {
+            close_mail_index(index);
+            return false;
+        }
+
+        offset++;
+    }
+
+    if (offset != header->names_size)
+    {
+        close_mail_index(index);
+        return false;
+    }
+
+    return true;
+}
+
+void close_mail_index(mail_index *index)
+{
+    if (index->map)
+    {
+        munmap(index->map, index->map_size);
+    }
+
+    memset(index, 0, sizeof(mail_index));
+}
+
+bool write_mail_index(int dir_fd, mail_index_header *header, const uint64_t *sizes, const uint8_t *name_lengths, const char *names)
+{
+    memcpy(header->magic, MAIL_INDEX_MAGIC, sizeof(header->magic));
+
+    int fd = openat(dir_fd, MAIL_INDEX_TEMP_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct iovec iov[] = {
+        {.iov_base = header, .iov_len = sizeof(mail_index_header)},
+        {.iov_base = (void *)sizes, .iov_len = header->count * sizeof(uint64_t)},
+        {.iov_base = (void *)name_lengths, .iov_len = header->count * sizeof(uint8_t)},
+        {.iov_base = (void *)names, .iov_len = header->names_size},
+    };
+
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(iov) / sizeof(iov[0]); i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    ssize_t written = writev(fd, iov, sizeof(iov) / sizeof(iov[0]));
+
+    if (close(fd) < 0 || written < 0 || (size_t)written != total)
+    {
+        int error = written < 0 ? errno : EIO;
+        unlinkat(dir_fd, MAIL_INDEX_TEMP_FILE, 0);
+        errno = error;
+        return false;
+    }
+
+    if (renameat(dir_fd, MAIL_INDEX_TEMP_FILE, dir_fd, MAIL_INDEX_FILE) < 0)
+    {
+        int error = errno;
+        unlinkat(dir_fd, MAIL_INDEX_TEMP_FILE, 0);
+        errno = error;
+        return false;
+    }
+
+    return true;
+}
@@ -1,30 +1,167 @@
 #include <netutils.h>
 
+#include <buffer.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fd_table.h>
 #include <logger.h>
-#include <magic.h>
+#include <pool.h>
 #include <poll.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <statistics.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <timer_wheel.h>
+#include <uring.h>
 
-#define CLOSE_SOCKET(fds, nfds, i) \
-    close(fds[i].fd);              \
-    fds[i--] = fds[--nfds];
+/**
+ * @brief The maximum number of events retrieved by a single epoll_wait call
+ */
+#define MAX_EPOLL_EVENTS 256
 
-#define NOTIFY_CLOSE(fds, pending, fd, on_close, status)                                        \
-    if (!pending[fd].closed)                                                                    \
-    {                                                                                           \
-        fds[i].events &= ~POLLIN;                                                               \
-        on_close(fd, status, pending[fd].server_fd);                                            \
-        char NOTIFY_CLOSE__ipv6_buffer[40];                                                     \
-        ipv6_to_str_unexpanded(NOTIFY_CLOSE__ipv6_buffer, &pending[fd].ip);                     \
-        log_disconnect(stats, NOTIFY_CLOSE__ipv6_buffer, NOTIFY_CLOSE__ipv6_buffer, log_now()); \
-        pending[fd].closed = true;                                                              \
-    }
+/**
+ * @brief The maximum number of completions dispatched in an iteration (io_uring engine)
+ */
+#define MAX_URING_EVENTS 256
+
+/**
+ * @brief The size of the submission queue, it's flushed early if it fills up
+ */
+#define URING_ENTRIES 1024
+
+/**
+ * @brief The io_uring user data of the submissions without a UringOp (cancellations
+ * and the polls linked before a read), their completions are skipped
+ */
+#define URING_IGNORED UINT64_MAX
+
+/**
+ * @brief The messages gathered by a send of the io_uring engine, its vector
+ * lives in the operation until the completion
+ */
+#define URING_SEND_IOVECS 64
+
+/**
+ * @brief The buffers the kernel fills with what the clients send, shared by the clients of a loop
+ */
+#define URING_RECV_BUFFERS 256
+#define URING_RECV_BUFFER_SIZE 2048
+#define URING_RECV_GROUP 0
+
+/**
+ * @brief The registered buffers the files are read into, the reads take a
+ * plain buffer once they are all in use
+ */
+#define URING_FILE_BUFFERS 16
+
+/**
+ * @brief The milliseconds waited for the cancelled operations when a loop is destroyed
+ */
+#define URING_DRAIN_TIMEOUT 1000
+
+/**
+ * @brief The maximum number of listening sockets across all workers
+ */
+#define MAX_SERVERS (MAX_WORKERS * 2)
+
+/**
+ * @brief The descriptors kept below the limit for the files of the clients
+ */
+#define FD_LIMIT_MARGIN 16
+
+/**
+ * @brief The connections accepted for a single server event, so a flood can't starve the clients
+ */
+#define MAX_ACCEPTS_PER_EVENT 256
+
+/**
+ * @brief The nice value of the thread of the PRIORITY_WORKER
+ */
+#define PRIORITY_NICE (-10)
+
+/**
+ * @brief The initial capacity of the poll array
+ */
+#define INITIAL_POLL_FDS 64
+
+/**
+ * @brief The resolution of the connection timeouts
+ */
+#define TIMER_TICK_MS 100
+
+/**
+ * @brief The maximum number of messages gathered in a single send call
+ */
+#define MAX_SEND_IOVECS 1024
+
+/**
+ * @brief The bytes sent to a client in a single turn, the rest waits for the
+ * next iteration so a bulk transfer can't hold the loop
+ */
+#define SEND_BUDGET (64 * 1024)
+
+/**
+ * @brief The microseconds spent dispatching the events of an iteration,
+ * the descriptors left are the first ones dispatched in the next
+ */
+#define DISPATCH_BUDGET_US 2000
+
+/**
+ * @brief The bytes produced by a stream each time it reaches the send queue
+ */
+#define STREAM_BATCH_SIZE (32 * 1024)
+
+/**
+ * @brief The bytes moved from a file to its client on each read
+ */
+#define FILE_CHUNK_SIZE (64 * 1024)
+
+/**
+ * @brief The bytes sent to a client before they are added to the statistics,
+ * so the shared counter is not locked on every send
+ */
+#define STATS_BATCH_SIZE (256 * 1024)
+
+/**
+ * @brief The environment variable with the descriptor of the channel to
+ * the process being upgraded, the servers are received through it
+ */
+#define UPGRADE_FD_ENV "POP3_UPGRADE_FD"
+
+/**
+ * @brief The payload sizes stored in the same allocation as their Data node,
+ * each one with its own pool. Bigger payloads are allocated apart.
+ */
+#define DATA_CLASSES 5
+static const size_t data_classes[DATA_CLASSES] = {0, 64, 256, 1024, 4096};
+
+/**
+ * @brief The class of the nodes whose payload is a registered file buffer (io_uring engine),
+ * the node itself comes from the pool of the first class
+ */
+#define FILE_BUFFER_CLASS DATA_CLASSES
+
+/**
+ * @brief The capacity of the output buffers that follow another one,
+ * the first buffer of a burst is only as big as its first message
+ */
+#define OUTPUT_BUFFER_SIZE 4096
+
+/**
+ * @brief The digits of the biggest uint64_t
+ */
+#define MAX_NUMBER_DIGITS 20
 
 typedef struct DataList
 {
@@ -58,18 +195,28 @@ typedef struct Data
         struct
         {
             /**
-             * @brief Please remember to free me later
+             * @brief Please remember to free me later (NULL if the payload is inline)
              */
             void *ptr;
             /**
-             * @brief Please never free me
+             * @brief The bytes to send are between its read and write pointers,
+             * the following messages are written after them while they fit
+             * @note The segments of a stream are full from the start, so nothing is added to them.
              */
-            char *data;
-            size_t length;
+            buffer buffer;
         } raw;
         struct
         {
             int fd;
+            /**
+             * @brief The stream of a splitter without file, NULL once finished
+             */
+            produce_event produce;
+            /**
+             * @brief Releases the stream once its segments are sent
+             */
+            release_event release;
+            void *state;
             DataList messages;
             /**
              * @brief The next splitter in the linked list of splitters
@@ -81,22 +228,139 @@ typedef struct Data
      * @brief The next node in the linked list of nodes
      */
     struct Data *next;
+    /**
+     * @brief The class of the node, the buffer of a RAW_DATA follows it unless it has a ptr
+     */
+    unsigned char data_class;
 } Data;
 
+/**
+ * @brief An operation queued in the ring, its address is the user data of its completions (io_uring engine)
+ */
+typedef struct UringOp
+{
+    enum UringOpType
+    {
+        /**
+         * @brief A multishot poll, for the descriptors only woken up (FD_WAKE and FD_UPGRADE)
+         */
+        URING_POLL,
+        URING_ACCEPT,
+        URING_RECV,
+        URING_SEND,
+        URING_READ
+    } type;
+    /**
+     * @brief The descriptor, -1 once it's detached from it: the completions only release the operation
+     */
+    int fd;
+    /**
+     * @brief The cancellation is queued, the last completion may still carry a result
+     */
+    bool cancelled;
+    union
+    {
+        /**
+         * @brief The server of an accept, kept after it's detached
+         */
+        int server_fd;
+        /**
+         * @brief The node a file is read into, appended to its splitter once filled
+         */
+        Data *chunk;
+        /**
+         * @brief The queue of a client closed during a send, released with its completion
+         */
+        struct
+        {
+            DataList messages;
+            DataList splitters;
+        } orphans;
+    };
+    /**
+     * @brief The messages of a send, their nodes stay in the queue until the completion
+     * @note Only the operations of the send pool have the vector.
+     */
+    struct msghdr msg;
+    struct iovec iov[];
+} UringOp;
+
 typedef struct DataHeader
 {
     enum DataHeaderType
     {
+        FD_UNUSED = 0,
+        FD_SERVER,
         FD_SOCKET,
-        FD_FILE
+        FD_FILE,
+        FD_WAKE,
+        FD_UPGRADE
     } type;
+    /**
+     * @brief If the descriptor is registered in the engine
+     */
+    bool watched;
+    /**
+     * @brief The fds array index of the descriptor (poll engine only)
+     */
+    int index;
+    /**
+     * @brief The operations in flight reading from and writing to the descriptor (io_uring engine only)
+     */
+    UringOp *input;
+    UringOp *output;
+    /**
+     * @brief If its operations are updated before the next wait, and the next descriptor to update (io_uring engine only)
+     */
+    bool submitting;
+    int next_submit;
+    /**
+     * @brief The events the descriptor is registered for
+     */
+    short events;
+    /**
+     * @brief The events reported by the last wait, consumed when dispatched
+     */
+    short revents;
     union
     {
         struct
         {
-            struct in6_addr ip;
+            /**
+             * @brief The client address, formatted once when accepted
+             */
+            char ip[40];
             int server_fd;
+            /**
+             * @brief The descriptor itself, to find it from its timer
+             */
+            int fd;
+            /**
+             * @brief Closes the connection once it's idle or too old
+             */
+            timer_node timer;
+            /**
+             * @brief The tick of the connection and of its last message (in either direction)
+             */
+            uint64_t started;
+            uint64_t active;
             bool closed;
+            /**
+             * @brief The connection only waits for its messages to be sent
+             */
+            bool draining;
+            /**
+             * @brief The commands are not read until the queue drains
+             */
+            bool paused;
+            /**
+             * @brief The bytes queued for the client, including the splitters
+             */
+            size_t queued;
+            /**
+             * @brief The bytes sent that were not added to the statistics yet
+             */
+            size_t unreported;
             DataList messages;
             DataList splitters;
         };
@@ -104,679 +368,3730 @@ typedef struct DataHeader
         {
             read_event read_callback;
             int client_fd;
-            FILE *file;
+            /**
+             * @brief The file can't be spliced, it goes through the loop buffer
+             */
+            bool buffered;
+            /**
+             * @brief The last read found nothing, the next one waits for the file (io_uring engine only)
+             */
+            bool poll_first;
         };
     };
 } DataHeader;
 
 /**
- * @brief Append to a data list a new message
+ * @brief The state of an event loop, owned by a single worker thread
+ */
+typedef struct EventLoop
+{
+    // Array to hold client sockets and poll event types (poll engine)
+    struct pollfd *fds;
+    int nfds;
+    int fds_capacity;
+
+    // The epoll instance (epoll engine)
+    int epoll_fd;
+
+    // The ring, the descriptors are read and written by the kernel and the results dispatched
+    // from the completions (io_uring engine)
+    uring ring;
+
+    // The operations in flight, by size as the sends carry their vector
+    pool op_pools[2];
+    int operations;
+
+    // The descriptors whose operations are updated before the next wait, linked by next_submit
+    int submit_first;
+    int submit_last;
+
+    // The buffers the receives select from, and the registered ones the files are read into
+    uring_buffers recv_buffers;
+    char *file_buffers;
+    int free_file_buffers[URING_FILE_BUFFERS];
+    int free_file_count;
+
+    // The kernel refused a multishot receive (before Linux 6.0), one-shot ones are queued instead
+    bool single_recv;
+
+    // Descriptors with events to dispatch in the current iteration, as big as fds,
+    // starting with the ones the previous iteration had no time for
+    int *ready_fds;
+    int deferred;
+
+    // Used to stream the files that can't be spliced
+    char file_buffer[FILE_CHUNK_SIZE];
+
+    // The Data nodes of the loop, by payload class
+    pool data_pools[DATA_CLASSES];
+
+    // The space given by the last reserve_data, and its node if it's not in the list yet
+    char *reserved_space;
+    Data *reserved;
+
+    // Table of DataHeader to hold pending messages or files, indexed by fd
+    fd_table *pending;
+
+    // Used by other threads to interrupt the wait
+    int wake_fd;
+
+    // Held open so a descriptor can be freed to shed a connection when they run out
+    int spare_fd;
+
+    // The client whose handler is running, its messages are sent once the handler returns
+    int dispatching;
+
+    // The connection timeouts, and the tick of the current iteration
+    timer_wheel timers;
+    uint64_t now;
+
+    // The clients of the loop, it exits when they are gone after an upgrade
+    int clients;
+    bool retired;
+
+    pthread_t thread;
+    int id;
+    int status;
+    const bool *done;
+
+    connection_event on_connection;
+    message_event on_message;
+    close_event on_close;
+    statistics_manager *stats;
+} EventLoop;
+
+typedef struct Server
+{
+    int fd;
+    struct sockaddr_in6 address;
+    int worker;
+} Server;
+
+/**
+ * @brief Get the state of a descriptor in the loop of this thread
  *
- * @note Must be called with the fds_mutex held
+ * @param fd A descriptor registered in the loop.
+ * @return DataHeader* The descriptor state.
+ */
+static DataHeader *get_header(int fd);
+/**
+ * @brief Start watching a file descriptor
  *
- * @param list The DataList to append to.
- * @param client_fd The client file descriptor.
- * @param message The message to send.
- * @param length The message length.
+ * @param fd The file descriptor.
+ * @param events The initial poll events.
+ * @return true The descriptor is being watched.
+ * @return false The engine refused the descriptor.
  */
-static void iasend(DataList *list, int client_fd, const char *message, size_t length);
+static bool watch_fd(int fd, short events);
 /**
- * @brief Sends the pending messages to the client
+ * @brief Update the events a watched file descriptor is interested in
  *
- * @note Must be called with the fds_mutex held
+ * @note O(1) for every engine, the fd is used as the registration key.
  *
- * @param list The DataList of pending messages.
- * @param client_fd The client file descriptor.
- * @param fds_index The poll array index of the client.
- * @param empty_node Indicates if the node must be removed from the list. The root call must send NULL.
- * @return KEEP_CONNECTION_OPEN to keep the connection open
- * @return CLOSE_CONNECTION to close the connection (an ESC node was found)
- * @return CONNECTION_ERROR if an error happened sending the message
+ * @param fd The file descriptor.
+ * @param events The new poll events.
+ */
+static void set_events(int fd, short events);
+/**
+ * @brief Stop watching a file descriptor
+ * @note Must be called before closing the descriptor
+ *
+ * @param fd The file descriptor.
+ */
+static void unwatch_fd(int fd);
+/**
+ * @brief Wait for events and collect the ready descriptors in ready_fds
+ *
+ * @param timeout The timeout in milliseconds, -1 to wait forever.
+ * @return int The number of ready descriptors, or -1 on error (errno is set).
+ */
+static int wait_events(int timeout);
+/**
+ * @brief Keep the descriptors that had no time at the start of ready_fds for the next iteration,
+ * the completions left (io_uring engine) wait in the ring
+ *
+ * @param dispatched The descriptors or completions dispatched.
+ * @param count The descriptors or completions that were ready.
+ */
+static void defer_events(int dispatched, int count);
+/**
+ * @brief Run the handler of a ready descriptor
+ *
+ * @param fd The descriptor.
+ * @param revents The events reported for it.
+ */
+static void dispatch_event(int fd, short revents);
+/**
+ * @brief Read the oldest completion of the ring and run the handler of its operation (io_uring engine)
  */
-static ON_MESSAGE_RESULT time_to_send(DataList *list, int client_fd, int fds_index, bool *empty_node, statistics_manager *stats);
+static void dispatch_completion();
 /**
- * @brief Sends a buffer of a file to a client
+ * @brief Update the operations of a descriptor before the next wait (io_uring engine)
  *
- * @note Must be called with the fds_mutex held
+ * @param fd The descriptor.
+ */
+static void queue_submit(int fd);
+/**
+ * @brief Queue the operations of the descriptors updated since the last wait (io_uring engine)
+ */
+static void submit_operations();
+/**
+ * @brief Queue the operations a descriptor needs and cancel the ones it no longer wants:
+ * a receive while POLLIN is set, a send while POLLOUT is, and a read or accept while watched
+ *
+ * @param fd The descriptor.
+ */
+static void update_operations(int fd);
+/**
+ * @brief Get an operation from the pools of the loop
+ *
+ * @param type The operation type, a send gets its vector.
+ * @param fd The descriptor.
+ * @return UringOp* The operation, or NULL if memory ran out.
+ */
+static UringOp *new_op(enum UringOpType type, int fd);
+/**
+ * @brief Return an operation to its pool, once its last completion is read
+ *
+ * @param op The operation.
+ */
+static void free_op(UringOp *op);
+/**
+ * @brief Queue the cancellation of an operation, if it's not queued yet
+ *
+ * @param op The operation.
+ */
+static void cancel_op(UringOp *op);
+/**
+ * @brief Cancel an operation of a descriptor about to be closed,
+ * its completions only release it from now on
+ *
+ * @param op The operation of the descriptor, cleared. Nothing is done if it's NULL.
+ */
+static void detach_op(UringOp **op);
+/**
+ * @brief Queue a multishot poll for the events of a descriptor
+ *
+ * @param fd A watched descriptor.
+ * @return true The poll is queued.
+ * @return false The submission queue is full or memory ran out.
+ */
+static bool submit_poll(int fd);
+/**
+ * @brief Queue a multishot accept on a server
+ *
+ * @param server_fd The server file descriptor.
+ * @return true The accept is queued.
+ * @return false The submission queue is full or memory ran out.
+ */
+static bool submit_accept(int server_fd);
+/**
+ * @brief Queue a receive on a client, multishot unless the kernel refused it,
+ * into the buffers provided to the ring
  *
  * @param client_fd The client file descriptor.
- * @param file The reading file.
- * @return true Keep reading the file
- * @return false Close the file and remove it from the poll
+ * @return true The receive is queued.
+ * @return false The submission queue is full or memory ran out.
  */
-static bool time_to_read(int client_fd, FILE *file);
+static bool submit_recv(int client_fd);
 /**
- * @brief Gracefully stop a socket connection,
- * disabling the POLLIN event and appending an ESC node
- * if the list still contains pending messages
+ * @brief Queue the read of the next chunk of a file, into a registered buffer if one is free
+ *
+ * @param file_fd The file descriptor.
+ * @return true The read is queued.
+ * @return false The submission queue is full or memory ran out.
+ */
+static bool submit_read(int file_fd);
+/**
+ * @brief Gather the pending messages of a client in a send,
+ * unless there's one in flight already as its completion sends the rest
  *
- * @param list The DataList of pending messages.
  * @param client_fd The client file descriptor.
- * @param fds_index The poll array index of the client.
- * @return true The connection can be closed immediately
- * @return false The connection must wait until all messages are sent
+ * @return KEEP_CONNECTION_OPEN if the send is queued or there's nothing to send
+ * @return CLOSE_CONNECTION if the messages ended with an ESC node
+ * @return CONNECTION_ERROR if the send couldn't be queued
  */
-static bool finish_transmition(DataList *list, int client_fd, int fds_index);
+static ON_MESSAGE_RESULT submit_send(int client_fd);
 /**
- * @brief Recursively deallocate the memory of a Data linked list
+ * @brief Handle a connection accepted by the kernel, or the error of the accept
  *
- * @param data The first node of the linked list
+ * @param op The accept.
+ * @param result The completion result, the new socket or -errno.
  */
-static void free_data(Data *data);
+static void handle_accept(UringOp *op, int result);
 /**
- * @brief IPv6 to string
+ * @brief Handle the data received from a client, or the error of the receive
  *
- * @param str The string to store the address
- * @param addr The IPv6 address
- * @return size_t The length of the string
+ * @param op The receive.
+ * @param result The completion result, the bytes received or -errno.
+ * @param flags The completion flags, with the buffer id.
  */
-static size_t ipv6_to_str_unexpanded(char str[40], const struct in6_addr *addr);
-
-// Array to hold client sockets and poll event types
-static struct pollfd fds[MAGIC_NUMBER];
-static sem_t fds_mutex;
-static int nfds = 0;
-
-static int servers_count = 0;
-
-// Array to hold pending messages or files
-static DataHeader pending[MAGIC_NUMBER];
-
-int start_server(struct sockaddr_in6 *address)
-{
-    int server_fd;
-    int opt;
-
-    // Initialize the pending mutex
-    if (sem_init(&fds_mutex, 0, 1) < 0)
-    {
-        perror("sem_init failed");
-        return -1;
-    }
-
-    // Create socket file descriptor
-    if ((server_fd = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP)) < 0)
-    {
-        perror("socket failed");
-        return -1;
-    }
-
+static void handle_recv(UringOp *op, int result, unsigned flags);
+/**
+ * @brief Handle the messages sent to a client, sending the rest
+ *
+ * @param op The send.
+ * @param result The completion result, the bytes sent or -errno.
+ */
+static void handle_send(UringOp *op, int result);
+/**
+ * @brief Handle a chunk of a file, queueing it in its splitter
+ *
+ * @param op The read.
+ * @param result The completion result, the bytes read or -errno.
+ */
+static void handle_read(UringOp *op, int result);
+/**
+ * @brief Release what a completion of a detached operation still holds
+ *
+ * @param op The operation.
+ * @param result The completion result.
+ * @param flags The completion flags.
+ */
+static void release_op(UringOp *op, int result, unsigned flags);
+/**
+ * @brief Cancel the operations of the loop and wait for their completions,
+ * as the kernel may be using their buffers
+ */
+static void drain_ring();
+/**
+ * @brief Run an event loop until the done flag is raised
+ *
+ * @param arg The EventLoop to run.
+ * @return void* Unused, the result is stored in the loop status.
+ */
+static void *run_loop(void *arg);
+/**
+ * @brief Interrupt the wait of an event loop
+ *
+ * @param target The loop to wake up.
+ */
+static void wake_loop(EventLoop *target);
+/**
+ * @brief Allocate an event loop and register its servers
+ *
+ * @param id The worker id.
+ * @return EventLoop* The new loop, or NULL if an error occurred.
+ */
+static EventLoop *create_loop(int id);
+/**
+ * @brief Release an event loop, closing its remaining clients
+ *
+ * @param target The loop to destroy.
+ */
+static void destroy_loop(EventLoop *target);
+/**
+ * @brief Start the new process of an upgrade and send it the servers
+ * @note Run by the first worker, which waits for the new process to be ready.
+ */
+static void start_upgrade();
+/**
+ * @brief Send the servers through a channel, with SCM_RIGHTS
+ *
+ * @param channel The channel to the new process.
+ * @return true The servers were sent.
+ * @return false An error occurred (errno is set).
+ */
+static bool send_servers(int channel);
+/**
+ * @brief Handle the answer of the new process of an upgrade
+ *
+ * @param fd The channel to the new process.
+ */
+static void handle_upgrade_event(int fd);
+/**
+ * @brief Stop accepting connections in the loop of this thread, closing its servers
+ */
+static void retire_servers();
+/**
+ * @brief Accept the connections queued in a server socket, until it's empty
+ *
+ * @param server_fd The server file descriptor.
+ * @return true The server may keep running.
+ * @return false Accepting failed and the server must stop.
+ */
+static bool handle_server_event(int server_fd);
+/**
+ * @brief Register a new connection and greet it
+ *
+ * @param server_fd The server file descriptor.
+ * @param new_socket The accepted socket, already non-blocking.
+ * @param address The address of the client.
+ */
+static void accept_client(int server_fd, int new_socket, struct sockaddr_in6 *address);
+/**
+ * @brief Accept and close a connection using the spare descriptor, when there are no others
+ * @note Otherwise the connection stays in the queue and the server keeps waking up for it.
+ *
+ * @param server_fd The server file descriptor.
+ */
+static void shed_connection(int server_fd);
+/**
+ * @brief Handle the events of a file being streamed to a client
+ *
+ * @param fd The file descriptor.
+ * @param revents The events reported for the file.
+ */
+static void handle_file_event(int fd, short revents);
+/**
+ * @brief Handle the events of a client socket
+ *
+ * @param fd The client file descriptor.
+ * @param revents The events reported for the socket.
+ */
+static void handle_socket_event(int fd, short revents);
+/**
+ * @brief Pass a message of a client to its handler, and close or drain
+ * the connection if the handler ends it
+ *
+ * @param fd The client file descriptor.
+ * @param buffer The message, the handler may modify it.
+ * @param length The message length.
+ * @return true The connection keeps reading messages.
+ * @return false The connection was closed, or only waits for its messages to be sent.
+ */
+static bool handle_message(int fd, char *buffer, int length);
+/**
+ * @brief Notify the close event once and stop receiving messages from the client
+ *
+ * @param client_fd The client file descriptor.
+ * @param status The result of the last message handled.
+ */
+static void notify_close(int client_fd, ON_MESSAGE_RESULT status);
+/**
+ * @brief Release every resource of a client socket and close it
+ * @note The messages of a send in flight are released with its completion (io_uring engine).
+ *
+ * @param client_fd The client file descriptor.
+ */
+static void close_socket(int client_fd);
+/**
+ * @brief Release the streams of a closed client and free its messages
+ * @note Its files must be closed already.
+ *
+ * @param messages The messages of the client.
+ * @param splitters The splitters of the client.
+ */
+static void release_messages(DataList *messages, DataList *splitters);
+/**
+ * @brief Stop streaming a file, running its callback
+ *
+ * @param file_fd The file descriptor.
+ */
+static void close_file(int file_fd);
+/**
+ * @brief Schedule the timeout of a client, from its last activity and its age
+ *
+ * @param client_fd The client file descriptor.
+ * @return true The timeout is scheduled, or disabled.
+ * @return false The timeout already expired.
+ */
+static bool schedule_timeout(int client_fd);
+/**
+ * @brief Log out an idle or expired client
+ * @note Implementation of timer_event handler.
+ *
+ * @param timer The timer of the client.
+ */
+static void handle_timeout(timer_node *timer);
+/**
+ * @brief Get the current tick of the monotonic clock
+ *
+ * @return uint64_t The tick, in TIMER_TICK_MS units.
+ */
+static uint64_t current_tick();
+/**
+ * @brief Get the current time of the monotonic clock, to measure the dispatch budget
+ *
+ * @return uint64_t The time, in microseconds.
+ */
+static uint64_t current_micros();
+/**
+ * @brief Pause or resume reading the commands of a client
+ * depending on the bytes queued for it
+ *
+ * @param client_fd The client file descriptor.
+ */
+static void update_backpressure(int client_fd);
+/**
+ * @brief Count bytes sent to a client, reporting them to the statistics in batches
+ *
+ * @param header The client state.
+ * @param bytes The bytes sent.
+ */
+static void count_bytes(DataHeader *header, size_t bytes);
+/**
+ * @brief Append to a data list a new message
+ *
+ * @note Must be called from the thread owning the client
+ *
+ * @param list The DataList to append to.
+ * @param client_fd The client file descriptor.
+ * @param message The message to send.
+ * @param length The message length.
+ */
+static void iasend(DataList *list, int client_fd, const char *message, size_t length);
+/**
+ * @brief Get space for a message at the end of a data list,
+ * in its last buffer if it fits or in a new one
+ *
+ * @note Must be called from the thread owning the client.
+ * Nothing else may be added to the list until the space is committed.
+ *
+ * @param list The DataList to append to.
+ * @param length The bytes needed.
+ * @param capacity Where to store the bytes that may be written, NULL if only length are needed.
+ * If given, a new buffer is never smaller than OUTPUT_BUFFER_SIZE.
+ * @return char* Where to write the message, or NULL if memory ran out.
+ */
+static char *reserve_data(DataList *list, size_t length, size_t *capacity);
+/**
+ * @brief Queue the message written in the space given by reserve_data
+ *
+ * @param list The DataList the space was reserved in.
+ * @param client_fd The client file descriptor.
+ * @param length The bytes written, at most the reserved ones.
+ */
+static void commit_data(DataList *list, int client_fd, size_t length);
+/**
+ * @brief Make room in a response for at least length more bytes,
+ * queueing what was written so far if it has to move to a new buffer
+ *
+ * @param builder The response.
+ * @param length The bytes needed.
+ * @return true The bytes fit after the cursor.
+ * @return false Memory ran out.
+ */
+static bool response_room(response_builder *builder, size_t length);
+/**
+ * @brief Sends the pending messages to the client,
+ * gathering every ready node (including splitter branches) in a single call
+ *
+ * @note Must be called from the thread owning the client
+ *
+ * @param client_fd The client file descriptor.
+ * @return KEEP_CONNECTION_OPEN to keep the connection open
+ * @return CLOSE_CONNECTION to close the connection (an ESC node was found)
+ * @return CONNECTION_ERROR if an error happened sending the message
+ */
+static ON_MESSAGE_RESULT time_to_send(int client_fd);
+/**
+ * @brief Remove the bytes sent from the messages of a client and decide what it waits for:
+ * the client to take more, a file to produce more, or nothing
+ *
+ * @param client_fd The client file descriptor.
+ * @param sent The bytes sent.
+ * @return KEEP_CONNECTION_OPEN to keep the connection open
+ * @return CLOSE_CONNECTION to close the connection (an ESC node was found)
+ */
+static ON_MESSAGE_RESULT finish_send(int client_fd, size_t sent);
+/**
+ * @brief Send the pending messages of a client, closing it if they end the session
+ *
+ * @param client_fd The client file descriptor.
+ */
+static void flush_socket(int client_fd);
+/**
+ * @brief Close a client if the last send ended the session or failed
+ *
+ * @param client_fd The client file descriptor.
+ * @param result The result of the send.
+ */
+static void end_flush(int client_fd, ON_MESSAGE_RESULT result);
+/**
+ * @brief Wait for the client to take the new messages, unless its handler
+ * is running, as they are flushed together once it returns
+ *
+ * @param client_fd The client file descriptor.
+ */
+static void want_send(int client_fd);
+/**
+ * @brief Collect the messages of a data list that can be sent in order,
+ * producing the streams found on the way
+ *
+ * @param list The DataList of pending messages.
+ * @param client_fd The client file descriptor.
+ * @param iov The vector to fill.
+ * @param capacity The entries of the vector.
+ * @param count The used entries of the vector, updated.
+ * @param budget The bytes that can still be collected, updated.
+ * @return true The whole list was collected
+ * @return false The messages after the last collected one must wait
+ */
+static bool gather_data(DataList *list, int client_fd, struct iovec *iov, int capacity, int *count, size_t *budget);
+/**
+ * @brief Produce the next batch of a stream into its splitter
+ *
+ * @param splitter The splitter of the stream.
+ * @param client_fd The client file descriptor.
+ */
+static void produce_data(Data *splitter, int client_fd);
+/**
+ * @brief Remove the sent bytes from a data list, releasing the nodes
+ * and the finished splitters
+ *
+ * @param list The DataList of pending messages.
+ * @param client_fd The client file descriptor.
+ * @param sent The bytes sent, decreased by the consumed ones.
+ * @return true The list is now empty
+ * @return false Some messages are still pending
+ */
+static bool consume_data(DataList *list, int client_fd, size_t *sent);
+/**
+ * @brief Unlink a splitter from the splitters list of a client
+ *
+ * @param client_fd The client file descriptor.
+ * @param splitter The splitter to unlink, it is not freed.
+ */
+static void remove_splitter(int client_fd, Data *splitter);
+/**
+ * @brief Moves the available content of a file to its client,
+ * with splice when possible so it's never copied to user space
+ *
+ * @note Only the file at the head of the queue is read,
+ * the others wait in their pipes until they can be sent.
+ *
+ * @param file_fd The file descriptor.
+ * @return true Keep reading the file
+ * @return false Close the file and remove it from the poll
+ */
+static bool time_to_read(int file_fd);
+/**
+ * @brief Tell why a splice from a file would block: the file has nothing to read or the client is full
+ *
+ * @param file_fd The file descriptor, usually a pipe.
+ * @return true The file has bytes waiting, so the client is the one full.
+ * @return false The file is empty.
+ */
+static bool file_has_data(int file_fd);
+/**
+ * @brief Gracefully stop a socket connection,
+ * disabling the POLLIN event and appending an ESC node
+ * if the list still contains pending messages
+ *
+ * @param list The DataList of pending messages.
+ * @param client_fd The client file descriptor.
+ * @return true The connection can be closed immediately
+ * @return false The connection must wait until all messages are sent
+ */
+static bool finish_transmition(DataList *list, int client_fd);
+/**
+ * @brief Get a node for the next chunk of a file, with a registered buffer if one is free
+ *
+ * @param buffer_index Where to store the index of the registered buffer, -1 if it has a plain one.
+ * @return Data* The node, with an empty raw buffer of FILE_CHUNK_SIZE, or NULL if memory ran out.
+ */
+static Data *new_chunk(int *buffer_index);
+/**
+ * @brief Get a Data node from the pools of the loop
+ *
+ * @param payload The capacity of the node buffer, 0 for a node without payload.
+ * @return Data* The node, with an empty raw buffer, or NULL if memory ran out.
+ */
+static Data *new_data(size_t payload);
+/**
+ * @brief Return a Data node to its pool, with its payload
+ *
+ * @param data The node, its branch (if it's a splitter) is left untouched.
+ */
+static void free_node(Data *data);
+/**
+ * @brief Deallocate a Data linked list, with the branches of its splitters
+ *
+ * @param data The first node of the linked list
+ */
+static void free_data(Data *data);
+/**
+ * @brief IPv6 to string
+ *
+ * @param str The string to store the address
+ * @param addr The IPv6 address
+ * @return size_t The length of the string
+ */
+static size_t ipv6_to_str_unexpanded(char str[40], const struct in6_addr *addr);
+
+static IO_ENGINE engine = ENGINE_EPOLL;
+
+// The operations of the io_uring engine, it's only used if the kernel has them all
+static const unsigned char uring_opcodes[] = {
+    IORING_OP_POLL_ADD,
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_SENDMSG,
+    IORING_OP_READ,
+    IORING_OP_READ_FIXED,
+    IORING_OP_ASYNC_CANCEL,
+};
+static int workers = 1;
+
+// The ceiling configured for the descriptors, 0 if only RLIMIT_NOFILE applies
+static int max_fds = 0;
+static int fd_limit = 0;
+
+static int backlog = DEFAULT_BACKLOG;
+
+// In seconds, 0 disables them. They can be changed by the manager at any time
+static atomic_uint idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static atomic_uint session_lifetime = 0;
+
+// Listening sockets, registered in their worker when the loops start
+static Server servers[MAX_SERVERS];
+static int servers_count = 0;
+
+// The workers, followed by the loop of the PRIORITY_WORKER if a server needs it
+static EventLoop *loops[MAX_WORKERS + 1];
+static int loops_count = 0;
+
+// The command line of the new process, upgrades are disabled without it
+static char *const *upgrade_argv = NULL;
+// Raised by request_upgrade, handled by the first worker
+static volatile sig_atomic_t upgrade_requested = false;
+// The new process took the servers, the workers exit once their clients are gone
+static atomic_bool retiring = false;
+// The channel to the process of the other side of an upgrade, while it's running
+static int upgrade_fd = -1;
+
+// Raised when a worker fails, so the others stop too
+static atomic_bool stopping = false;
+
+// The event loop running in this thread
+static __thread EventLoop *loop;
+
+bool set_io_engine(const char *name)
+{
+    if (!strcmp(name, "poll"))
+    {
+        engine = ENGINE_POLL;
+        return true;
+    }
+
+    if (!strcmp(name, "epoll"))
+    {
+        engine = ENGINE_EPOLL;
+        return true;
+    }
+
+    if (!strcmp(name, "uring"))
+    {
+        engine = ENGINE_URING;
+        return true;
+    }
+
+    return false;
+}
+
+IO_ENGINE get_io_engine()
+{
+    return engine;
+}
+
+bool set_workers(int count)
+{
+    if (count < 1 || count > MAX_WORKERS)
+    {
+        return false;
+    }
+
+    workers = count;
+    return true;
+}
+
+int get_workers()
+{
+    return workers;
+}
+
+bool set_max_fds(int count)
+{
+    if (count < 1)
+    {
+        return false;
+    }
+
+    max_fds = count;
+    return true;
+}
+
+bool set_backlog(int value)
+{
+    if (value < 1)
+    {
+        return false;
+    }
+
+    backlog = value;
+    return true;
+}
+
+int get_backlog()
+{
+    return backlog;
+}
+
+int get_fd_limit()
+{
+    if (fd_limit)
+    {
+        return fd_limit;
+    }
+
+    long limit = MAX_FD_LIMIT;
+
+    // Take every descriptor the hard limit allows
+    struct rlimit rlim;
+    if (!getrlimit(RLIMIT_NOFILE, &rlim))
+    {
+        if (rlim.rlim_cur < rlim.rlim_max)
+        {
+            rlim_t current = rlim.rlim_cur;
+            rlim.rlim_cur = rlim.rlim_max;
+
+            if (setrlimit(RLIMIT_NOFILE, &rlim))
+            {
+                rlim.rlim_cur = current;
+            }
+        }
+
+        if (rlim.rlim_cur < (rlim_t)limit)
+        {
+            limit = rlim.rlim_cur;
+        }
+    }
+
+    // Past the margin, accept still works so the connection can be rejected cleanly
+    limit -= FD_LIMIT_MARGIN;
+
+    if (max_fds && max_fds < limit)
+    {
+        limit = max_fds;
+    }
+
+    fd_limit = limit > 0 ? limit : 1;
+    return fd_limit;
+}
+
+void set_idle_timeout(unsigned int seconds)
+{
+    atomic_store(&idle_timeout, seconds);
+}
+
+unsigned int get_idle_timeout()
+{
+    return atomic_load(&idle_timeout);
+}
+
+void set_session_lifetime(unsigned int seconds)
+{
+    atomic_store(&session_lifetime, seconds);
+}
+
+unsigned int get_session_lifetime()
+{
+    return atomic_load(&session_lifetime);
+}
+
+int start_server(struct sockaddr_in6 *address)
+{
+    int server_fd;
+    int opt;
+
+    // Create socket file descriptor
+    if ((server_fd = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    {
+        perror("socket failed");
+        return -1;
+    }
+
     // Set the server socket settings
     opt = 0;
     if (setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) < 0)
     {
-        perror("IPV6 setsockopt failed");
-        return -1;
+        perror("IPV6 setsockopt failed");
+        return -1;
+    }
+
+    opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    {
+        perror("The other setsockopt failed");
+        return -1;
+    }
+
+    // Let every worker bind its own socket, the kernel balances the connections
+    if (workers > 1 && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        perror("SO_REUSEPORT setsockopt failed");
+        return -1;
+    }
+
+    // Bind the socket to the specified port
+    if (bind(server_fd, (struct sockaddr *)address, sizeof(*address)) < 0)
+    {
+        perror("bind failed");
+        return -1;
+    }
+
+    // Set the server socket to non-blocking mode
+    if (fcntl(server_fd, F_SETFL, O_NONBLOCK) < 0)
+    {
+        perror("fcntl failed");
+        return -1;
+    }
+
+    // Listen for incoming connections
+    if (listen(server_fd, backlog) < 0)
+    {
+        perror("listen failed");
+        return -1;
+    }
+
+    return server_fd;
+}
+
+void add_server(int server_fd, struct sockaddr_in6 *address, int worker)
+{
+    if (servers_count >= MAX_SERVERS || worker < PRIORITY_WORKER || worker >= workers)
+    {
+        LOG("Server %d ignored, invalid worker %d\n", server_fd, worker);
+        return;
+    }
+
+    servers[servers_count].fd = server_fd;
+    servers[servers_count].address = *address;
+    servers[servers_count].worker = worker;
+    servers_count++;
+}
+
+int inherit_servers(const struct sockaddr_in6 *manager_address, int *manager_fd)
+{
+    const char *value = getenv(UPGRADE_FD_ENV);
+    if (!value)
+    {
+        return 0;
+    }
+
+    int channel = atoi(value);
+    unsetenv(UPGRADE_FD_ENV);
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+    char count;
+    struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+    char control[CMSG_SPACE(MAX_SERVERS * sizeof(int))];
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t received = recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+
+    if (received != sizeof(count) || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        perror("Failed to receive the servers");
+        close(channel);
+        return -1;
+    }
+
+    int fds[MAX_SERVERS];
+    int fds_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), fds_count * sizeof(int));
+
+    int pop_servers = 0;
+
+    for (int i = 0; i < fds_count; i++)
+    {
+        struct sockaddr_in6 address;
+        socklen_t length = sizeof(address);
+
+        if (getsockname(fds[i], (struct sockaddr *)&address, &length) < 0)
+        {
+            perror("getsockname failed");
+            close(fds[i]);
+            continue;
+        }
+
+        // Listening again only updates the backlog
+        if (listen(fds[i], backlog) < 0)
+        {
+            perror("listen failed");
+        }
+
+        if (address.sin6_port == manager_address->sin6_port)
+        {
+            *manager_fd = fds[i];
+            add_server(fds[i], &address, PRIORITY_WORKER);
+        }
+        else
+        {
+            add_server(fds[i], &address, pop_servers++ % workers);
+        }
+    }
+
+    LOG("Took over %d servers\n", fds_count);
+
+    // The old process is told to stop accepting once the loops are ready
+    upgrade_fd = channel;
+    return 1;
+}
+
+void set_upgrade_command(char *const argv[])
+{
+    upgrade_argv = argv;
+}
+
+void request_upgrade()
+{
+    upgrade_requested = true;
+
+    // The first worker may be about to wait, write directly as it may be a signal handler
+    EventLoop *target = loops[0];
+    if (target)
+    {
+        uint64_t value = 1;
+        write(target->wake_fd, &value, sizeof(value));
+    }
+}
+
+static ON_MESSAGE_RESULT keep_alive_noop()
+{
+    return KEEP_CONNECTION_OPEN;
+}
+
+static void noop()
+{
+}
+
+int server_loop(const bool *done, connection_event on_connection, message_event on_message, close_event on_close, statistics_manager *stats)
+{
+    on_connection = on_connection ? on_connection : (connection_event)keep_alive_noop;
+    on_close = on_close ? on_close : (close_event)noop;
+
+    // Seccomp filters and kernels before 5.19 (provided buffer rings) refuse it, every loop must use the same engine
+    if (engine == ENGINE_URING && !uring_available(uring_opcodes, sizeof(uring_opcodes)))
+    {
+        perror("io_uring is not available, falling back to epoll");
+        engine = ENGINE_EPOLL;
+    }
+
+    loops_count = workers;
+
+    for (int i = 0; i < servers_count; i++)
+    {
+        if (servers[i].worker == PRIORITY_WORKER)
+        {
+            loops_count = workers + 1;
+        }
+    }
+
+    for (int i = 0; i < loops_count; i++)
+    {
+        loops[i] = create_loop(i < workers ? i : PRIORITY_WORKER);
+
+        if (!loops[i])
+        {
+            while (i--)
+            {
+                destroy_loop(loops[i]);
+            }
+
+            return EXIT_FAILURE;
+        }
+
+        loops[i]->done = done;
+        loops[i]->on_connection = on_connection;
+        loops[i]->on_message = on_message;
+        loops[i]->on_close = on_close;
+        loops[i]->stats = stats;
+    }
+
+    // The process that handed over the servers can stop accepting
+    if (upgrade_fd >= 0)
+    {
+        write(upgrade_fd, "R", 1);
+        close(upgrade_fd);
+        upgrade_fd = -1;
+    }
+
+    // Signals must be handled by the main thread, so it can wake up the workers
+    sigset_t mask, old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    int started = 1;
+    for (; started < loops_count; started++)
+    {
+        if (pthread_create(&loops[started]->thread, NULL, run_loop, loops[started]))
+        {
+            perror("pthread_create failed");
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    // The main thread is the first worker
+    if (started == loops_count)
+    {
+        run_loop(loops[0]);
+    }
+    else
+    {
+        loops[0]->status = EXIT_FAILURE;
+    }
+
+    int status = loops[0]->status;
+
+    for (int i = 1; i < started; i++)
+    {
+        wake_loop(loops[i]);
+        pthread_join(loops[i]->thread, NULL);
+
+        if (loops[i]->status != EXIT_SUCCESS)
+        {
+            status = loops[i]->status;
+        }
+    }
+
+    for (int i = 0; i < loops_count; i++)
+    {
+        // Unpublished first, a signal handler may be looking for it
+        EventLoop *target = loops[i];
+        loops[i] = NULL;
+        destroy_loop(target);
+    }
+
+    return status;
+}
+
+static EventLoop *create_loop(int id)
+{
+    EventLoop *target = calloc(1, sizeof(EventLoop));
+
+    if (!target)
+    {
+        perror("Failed to allocate the event loop");
+        return NULL;
+    }
+
+    target->id = id;
+    target->epoll_fd = -1;
+    target->ring.fd = -1;
+    target->wake_fd = -1;
+    target->spare_fd = -1;
+    target->dispatching = -1;
+    target->fds_capacity = engine == ENGINE_POLL ? INITIAL_POLL_FDS : 0;
+    target->fds = malloc(target->fds_capacity * sizeof(struct pollfd));
+    target->ready_fds = malloc((engine == ENGINE_EPOLL ? MAX_EPOLL_EVENTS : engine == ENGINE_URING ? MAX_URING_EVENTS : INITIAL_POLL_FDS) * sizeof(int));
+    target->pending = new_fd_table(sizeof(DataHeader), get_fd_limit());
+
+    for (int i = 0; i < DATA_CLASSES; i++)
+    {
+        init_pool(&target->data_pools[i], sizeof(Data) + data_classes[i]);
+    }
+    init_pool(&target->op_pools[0], sizeof(UringOp));
+    init_pool(&target->op_pools[1], sizeof(UringOp) + URING_SEND_IOVECS * sizeof(struct iovec));
+    target->submit_first = -1;
+    target->submit_last = -1;
+    target->now = current_tick();
+    init_timer_wheel(&target->timers, target->now);
+
+    if (!target->ready_fds || !target->pending || (target->fds_capacity && !target->fds))
+    {
+        perror("Failed to allocate the event loop");
+        destroy_loop(target);
+        return NULL;
+    }
+
+    if (engine == ENGINE_EPOLL && (target->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        perror("epoll_create1 failed");
+        destroy_loop(target);
+        return NULL;
+    }
+
+    if (engine == ENGINE_URING && !init_uring(&target->ring, URING_ENTRIES))
+    {
+        perror("io_uring_setup failed");
+        target->ring.fd = -1;
+        destroy_loop(target);
+        return NULL;
+    }
+
+    if (engine == ENGINE_URING && !uring_provide_buffers(&target->ring, &target->recv_buffers, URING_RECV_GROUP, URING_RECV_BUFFERS, URING_RECV_BUFFER_SIZE))
+    {
+        perror("Failed to provide the receive buffers");
+        destroy_loop(target);
+        return NULL;
+    }
+
+    if (engine == ENGINE_URING)
+    {
+        char *slab = mmap(NULL, URING_FILE_BUFFERS * FILE_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        struct iovec iov[URING_FILE_BUFFERS];
+
+        for (int i = 0; i < URING_FILE_BUFFERS; i++)
+        {
+            iov[i].iov_base = slab + i * FILE_CHUNK_SIZE;
+            iov[i].iov_len = FILE_CHUNK_SIZE;
+            target->free_file_buffers[i] = i;
+        }
+
+        // Pinning them counts against RLIMIT_MEMLOCK, without them the files are read into plain buffers
+        if (slab != MAP_FAILED && uring_register_buffers(&target->ring, iov, URING_FILE_BUFFERS))
+        {
+            target->file_buffers = slab;
+            target->free_file_count = URING_FILE_BUFFERS;
+        }
+        else if (slab != MAP_FAILED)
+        {
+            LOG("The file buffers can't be registered, reading into plain buffers\n");
+            munmap(slab, URING_FILE_BUFFERS * FILE_CHUNK_SIZE);
+        }
+    }
+
+    if ((target->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        perror("eventfd failed");
+        destroy_loop(target);
+        return NULL;
+    }
+
+    if ((target->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        perror("Failed to open the spare descriptor");
+        destroy_loop(target);
+        return NULL;
+    }
+
+    // Registration works on the loop of the calling thread
+    EventLoop *previous = loop;
+    loop = target;
+
+    DataHeader *header = fd_table_reserve(loop->pending, loop->wake_fd);
+    bool watched = header && watch_fd(loop->wake_fd, POLLIN);
+
+    if (header)
+    {
+        header->type = FD_WAKE;
+    }
+
+    for (int i = 0; watched && i < servers_count; i++)
+    {
+        if (servers[i].worker != id)
+        {
+            continue;
+        }
+
+        int server_fd = servers[i].fd;
+
+        header = fd_table_reserve(loop->pending, server_fd);
+        if (!header)
+        {
+            watched = false;
+            break;
+        }
+
+        header->type = FD_SERVER;
+        header->server_fd = server_fd;
+
+        watched = watch_fd(server_fd, POLLIN);
+    }
+
+    loop = previous;
+
+    if (!watched)
+    {
+        perror("Failed to watch server");
+        destroy_loop(target);
+        return NULL;
+    }
+
+    return target;
+}
+
+static void destroy_loop(EventLoop *target)
+{
+    EventLoop *previous = loop;
+    loop = target;
+
+    for (int fd = 0; loop->pending && fd < loop->pending->limit; fd++)
+    {
+        DataHeader *header = fd_table_get(loop->pending, fd);
+
+        if (header && header->type == FD_SOCKET)
+        {
+            notify_close(fd, CONNECTION_ERROR);
+            close_socket(fd);
+        }
+
+        // The servers and the wake up descriptor are closed elsewhere, their operations go now
+        if (header && engine == ENGINE_URING)
+        {
+            detach_op(&header->input);
+            detach_op(&header->output);
+        }
+    }
+
+    if (loop->ring.fd >= 0)
+    {
+        drain_ring();
+    }
+
+    if (loop->wake_fd >= 0)
+    {
+        close(loop->wake_fd);
+    }
+
+    if (loop->spare_fd >= 0)
+    {
+        close(loop->spare_fd);
+    }
+
+    if (loop->epoll_fd >= 0)
+    {
+        close(loop->epoll_fd);
+    }
+
+    if (loop->ring.fd >= 0)
+    {
+        uring_release_buffers(&loop->ring, &loop->recv_buffers);
+        destroy_uring(&loop->ring);
+    }
+
+    if (loop->file_buffers)
+    {
+        munmap(loop->file_buffers, URING_FILE_BUFFERS * FILE_CHUNK_SIZE);
+    }
+
+    loop = previous;
+
+    for (int i = 0; i < DATA_CLASSES; i++)
+    {
+        destroy_pool(&target->data_pools[i]);
+    }
+
+    destroy_pool(&target->op_pools[0]);
+    destroy_pool(&target->op_pools[1]);
+
+    free_fd_table(target->pending);
+    free(target->ready_fds);
+    free(target->fds);
+    free(target);
+}
+
+static void wake_loop(EventLoop *target)
+{
+    eventfd_write(target->wake_fd, 1);
+}
+
+static void *run_loop(void *arg)
+{
+    loop = arg;
+    loop->status = EXIT_SUCCESS;
+
+    // Raising the priority needs CAP_SYS_NICE, without it the loop still has its own thread
+    if (loop->id == PRIORITY_WORKER && setpriority(PRIO_PROCESS, gettid(), PRIORITY_NICE) < 0)
+    {
+        LOG("Priority loop running with the default priority\n");
+    }
+
+    while (!*loop->done && !atomic_load(&stopping))
+    {
+        if (loop->id == 0 && upgrade_requested)
+        {
+            upgrade_requested = false;
+            start_upgrade();
+        }
+
+        if (atomic_load(&retiring))
+        {
+            if (!loop->retired)
+            {
+                retire_servers();
+            }
+
+            if (!loop->clients)
+            {
+                break;
+            }
+        }
+
+        // The deferred descriptors are dispatched right away, along with what's ready by now
+        int64_t ticks = loop->deferred ? 0 : timer_wheel_next(&loop->timers);
+        int activity = wait_events(ticks < 0 ? -1 : ticks * TIMER_TICK_MS);
+
+        loop->now = current_tick();
+
+        if (activity < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+            {
+                continue;
+            }
+
+            if (errno == EBADF)
+            {
+                LOG("Bad descriptor detected\n");
+            }
+
+            perror("poll error");
+            loop->status = EXIT_FAILURE;
+            break;
+        }
+
+        uint64_t deadline = current_micros() + DISPATCH_BUDGET_US;
+        int dispatched = 0;
+
+        for (; dispatched < activity; dispatched++)
+        {
+            // Every descriptor gets its turn in order, but the loop must get back to the new events
+            if (dispatched && current_micros() >= deadline)
+            {
+                break;
+            }
+
+            if (engine == ENGINE_URING)
+            {
+                dispatch_completion();
+                continue;
+            }
+
+            int fd = loop->ready_fds[dispatched];
+            DataHeader *header = get_header(fd);
+            short revents = header->revents;
+            header->revents = 0;
+
+            // The descriptor was closed (and maybe reused) by a previous event
+            if (!revents)
+            {
+                continue;
+            }
+
+            dispatch_event(fd, revents);
+        }
+
+        defer_events(dispatched, activity);
+
+        if (loop->status != EXIT_SUCCESS)
+        {
+            break;
+        }
+
+        timer_wheel_advance(&loop->timers, loop->now, handle_timeout);
+    }
+
+    // Whoever fails first takes the other workers down
+    if (loop->status != EXIT_SUCCESS)
+    {
+        atomic_store(&stopping, true);
+
+        for (int i = 0; i < loops_count; i++)
+        {
+            if (loops[i] != loop)
+            {
+                wake_loop(loops[i]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void dispatch_event(int fd, short revents)
+{
+    switch (get_header(fd)->type)
+    {
+    case FD_SERVER:
+        if (!handle_server_event(fd))
+        {
+            loop->status = EXIT_FAILURE;
+        }
+        break;
+
+    case FD_FILE:
+        handle_file_event(fd, revents);
+        break;
+
+    case FD_SOCKET:
+        handle_socket_event(fd, revents);
+        break;
+
+    case FD_WAKE:
+    {
+        eventfd_t value;
+        eventfd_read(fd, &value);
+        break;
+    }
+
+    case FD_UPGRADE:
+        handle_upgrade_event(fd);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static DataHeader *get_header(int fd)
+{
+    return fd_table_get(loop->pending, fd);
+}
+
+static bool watch_fd(int fd, short events)
+{
+    DataHeader *header = get_header(fd);
+
+    header->events = events;
+    header->revents = 0;
+    header->watched = true;
+
+    if (engine == ENGINE_EPOLL)
+    {
+        struct epoll_event event = {.events = events, .data.fd = fd};
+        return !epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    if (engine == ENGINE_URING)
+    {
+        queue_submit(fd);
+        return true;
+    }
+
+    if (loop->nfds == loop->fds_capacity)
+    {
+        int capacity = loop->fds_capacity * 2;
+
+        // Both arrays grow together, as every watched fd may be ready
+        struct pollfd *fds = realloc(loop->fds, capacity * sizeof(struct pollfd));
+        if (fds)
+        {
+            loop->fds = fds;
+        }
+
+        int *ready_fds = fds ? realloc(loop->ready_fds, capacity * sizeof(int)) : NULL;
+        if (!ready_fds)
+        {
+            header->watched = false;
+            return false;
+        }
+
+        loop->ready_fds = ready_fds;
+        loop->fds_capacity = capacity;
+    }
+
+    header->index = loop->nfds;
+
+    loop->fds[loop->nfds].fd = fd;
+    loop->fds[loop->nfds].events = events;
+    loop->fds[loop->nfds].revents = 0;
+    loop->nfds++;
+
+    return true;
+}
+
+static void set_events(int fd, short events)
+{
+    DataHeader *header = get_header(fd);
+
+    if (header->events == events)
+    {
+        return;
+    }
+
+    header->events = events;
+
+    if (engine == ENGINE_EPOLL)
+    {
+        // poll and epoll share the event bits on Linux
+        struct epoll_event event = {.events = events, .data.fd = fd};
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        return;
+    }
+
+    if (engine == ENGINE_URING)
+    {
+        // The receive and the send follow the events before the next wait
+        queue_submit(fd);
+        return;
+    }
+
+    loop->fds[header->index].events = events;
+}
+
+static void unwatch_fd(int fd)
+{
+    DataHeader *header = get_header(fd);
+
+    header->revents = 0;
+    header->watched = false;
+
+    if (engine == ENGINE_EPOLL)
+    {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+
+    if (engine == ENGINE_URING)
+    {
+        detach_op(&header->input);
+        detach_op(&header->output);
+        return;
+    }
+
+    // Move the last descriptor to the freed slot
+    int index = header->index;
+    loop->fds[index] = loop->fds[--loop->nfds];
+    get_header(loop->fds[index].fd)->index = index;
+}
+
+static int wait_events(int timeout)
+{
+    if (engine == ENGINE_EPOLL)
+    {
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+
+        int count = loop->deferred;
+        int ready = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS - count, timeout);
+
+        if (ready < 0)
+        {
+            return -1;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            int fd = events[i].data.fd;
+            DataHeader *header = get_header(fd);
+
+            // A deferred descriptor is already in the list
+            if (!header->revents)
+            {
+                loop->ready_fds[count++] = fd;
+            }
+
+            header->revents |= events[i].events;
+        }
+
+        return count;
+    }
+
+    if (engine == ENGINE_URING)
+    {
+        submit_operations();
+
+        if (uring_wait(&loop->ring, timeout) < 0)
+        {
+            return -1;
+        }
+
+        // The completions are dispatched straight from the ring
+        unsigned ready = uring_ready(&loop->ring);
+        return ready < MAX_URING_EVENTS ? ready : MAX_URING_EVENTS;
+    }
+
+    int activity = poll(loop->fds, loop->nfds, timeout);
+    if (activity < 0)
+    {
+        return activity;
+    }
+
+    int count = loop->deferred;
+    for (int i = 0; i < loop->nfds && activity && count < loop->fds_capacity; i++)
+    {
+        if (loop->fds[i].revents)
+        {
+            DataHeader *header = get_header(loop->fds[i].fd);
+
+            if (!header->revents)
+            {
+                loop->ready_fds[count++] = loop->fds[i].fd;
+            }
+
+            header->revents |= loop->fds[i].revents;
+            activity--;
+        }
+    }
+
+    return count;
+}
+
+static void defer_events(int dispatched, int count)
+{
+    // The completions left in the ring are read on the next iteration
+    if (engine == ENGINE_URING)
+    {
+        return;
+    }
+
+    loop->deferred = count - dispatched;
+    memmove(loop->ready_fds, loop->ready_fds + dispatched, loop->deferred * sizeof(int));
+}
+
+static void dispatch_completion()
+{
+    struct io_uring_cqe *cqe = uring_peek_cqe(&loop->ring);
+    uint64_t data = cqe->user_data;
+    int result = cqe->res;
+    unsigned flags = cqe->flags;
+    uring_cqe_seen(&loop->ring);
+
+    if (data == URING_IGNORED)
+    {
+        return;
+    }
+
+    UringOp *op = (UringOp *)(uintptr_t)data;
+    bool last = !(flags & IORING_CQE_F_MORE);
+
+    // A detached accept still took its connection from the queue, so it's served
+    if (op->fd < 0 && op->type != URING_ACCEPT)
+    {
+        release_op(op, result, flags);
+    }
+    else
+    {
+        // The descriptor gets its next operation before the wait, if it still wants one
+        if (last && op->fd >= 0)
+        {
+            DataHeader *header = get_header(op->fd);
+
+            if (header->input == op)
+            {
+                header->input = NULL;
+            }
+            else if (header->output == op)
+            {
+                header->output = NULL;
+            }
+
+            queue_submit(op->fd);
+        }
+
+        switch (op->type)
+        {
+        case URING_POLL:
+            if (result > 0)
+            {
+                dispatch_event(op->fd, result);
+            }
+            break;
+
+        case URING_ACCEPT:
+            handle_accept(op, result);
+            break;
+
+        case URING_RECV:
+            handle_recv(op, result, flags);
+            break;
+
+        case URING_SEND:
+            handle_send(op, result);
+            break;
+
+        case URING_READ:
+            handle_read(op, result);
+            break;
+        }
+    }
+
+    if (last)
+    {
+        free_op(op);
+    }
+}
+
+static void queue_submit(int fd)
+{
+    DataHeader *header = get_header(fd);
+
+    if (header->submitting)
+    {
+        return;
+    }
+
+    header->submitting = true;
+    header->next_submit = -1;
+
+    if (loop->submit_last >= 0)
+    {
+        get_header(loop->submit_last)->next_submit = fd;
+    }
+    else
+    {
+        loop->submit_first = fd;
+    }
+
+    loop->submit_last = fd;
+}
+
+static void submit_operations()
+{
+    // A descriptor queued again while updating the others is updated in this same pass
+    while (loop->submit_first >= 0)
+    {
+        int fd = loop->submit_first;
+        DataHeader *header = get_header(fd);
+
+        loop->submit_first = header->next_submit;
+        if (loop->submit_first < 0)
+        {
+            loop->submit_last = -1;
+        }
+
+        header->submitting = false;
+        update_operations(fd);
+    }
+}
+
+static void update_operations(int fd)
+{
+    DataHeader *header = get_header(fd);
+    bool queued = true;
+
+    if (!header->watched)
+    {
+        return;
+    }
+
+    switch (header->type)
+    {
+    case FD_SOCKET:
+        // A paused or closed client stops receiving, a completion on its way may still bring data
+        if (header->events & POLLIN)
+        {
+            queued = header->input || submit_recv(fd);
+        }
+        else if (header->input)
+        {
+            cancel_op(header->input);
+        }
+
+        if (queued && header->events & POLLOUT && !header->output)
+        {
+            flush_socket(fd);
+        }
+        break;
+
+    case FD_FILE:
+        queued = header->input || submit_read(fd);
+        break;
+
+    case FD_SERVER:
+        queued = header->input || submit_accept(fd);
+        break;
+
+    case FD_WAKE:
+    case FD_UPGRADE:
+        queued = header->input || submit_poll(fd);
+        break;
+
+    default:
+        return;
+    }
+
+    if (queued)
+    {
+        return;
+    }
+
+    LOG("Failed to queue an operation: fd %d\n", fd);
+
+    // Out of memory, or the submission queue couldn't be flushed
+    if (header->type == FD_SOCKET)
+    {
+        notify_close(fd, CONNECTION_ERROR);
+        close_socket(fd);
+    }
+    else if (header->type == FD_FILE)
+    {
+        close_file(fd);
+    }
+    else
+    {
+        loop->status = EXIT_FAILURE;
+    }
+}
+
+static UringOp *new_op(enum UringOpType type, int fd)
+{
+    UringOp *op = pool_alloc(&loop->op_pools[type == URING_SEND]);
+
+    if (!op)
+    {
+        return NULL;
+    }
+
+    op->type = type;
+    op->fd = fd;
+    op->cancelled = false;
+    memset(&op->orphans, 0, sizeof(op->orphans));
+
+    loop->operations++;
+    return op;
+}
+
+static void free_op(UringOp *op)
+{
+    loop->operations--;
+    pool_free(&loop->op_pools[op->type == URING_SEND], op);
+}
+
+static void cancel_op(UringOp *op)
+{
+    if (op->cancelled)
+    {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (!sqe)
+    {
+        LOG("Failed to cancel an operation: fd %d\n", op->fd);
+        return;
+    }
+
+    op->cancelled = true;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)op;
+    sqe->user_data = URING_IGNORED;
+}
+
+static void detach_op(UringOp **op)
+{
+    if (!*op)
+    {
+        return;
+    }
+
+    // The ring keeps its own reference to the file, only the cancellation lets it go
+    cancel_op(*op);
+    (*op)->fd = -1;
+    *op = NULL;
+}
+
+static bool submit_poll(int fd)
+{
+    DataHeader *header = get_header(fd);
+    UringOp *op = new_op(URING_POLL, fd);
+    struct io_uring_sqe *sqe = op ? uring_get_sqe(&loop->ring) : NULL;
+
+    if (!sqe)
+    {
+        if (op)
+        {
+            free_op(op);
+        }
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = (unsigned short)header->events;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+
+    header->input = op;
+    return true;
+}
+
+static bool submit_accept(int server_fd)
+{
+    UringOp *op = new_op(URING_ACCEPT, server_fd);
+    struct io_uring_sqe *sqe = op ? uring_get_sqe(&loop->ring) : NULL;
+
+    if (!sqe)
+    {
+        if (op)
+        {
+            free_op(op);
+        }
+        return false;
+    }
+
+    op->server_fd = server_fd;
+
+    // Every connection of the queue completes it, until it fails
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+
+    get_header(server_fd)->input = op;
+    return true;
+}
+
+static bool submit_recv(int client_fd)
+{
+    UringOp *op = new_op(URING_RECV, client_fd);
+    struct io_uring_sqe *sqe = op ? uring_get_sqe(&loop->ring) : NULL;
+
+    if (!sqe)
+    {
+        if (op)
+        {
+            free_op(op);
+        }
+        return false;
+    }
+
+    // The kernel picks the buffer once there's data, so an idle client holds none
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client_fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_GROUP;
+    sqe->ioprio = loop->single_recv ? 0 : IORING_RECV_MULTISHOT;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+
+    get_header(client_fd)->input = op;
+    return true;
+}
+
+static bool submit_read(int file_fd)
+{
+    DataHeader *file = get_header(file_fd);
+    Data *chunk = NULL;
+    int index = -1;
+
+    // The last read found nothing (a non-blocking file), this time the file is polled first
+    if (!file->poll_first && !(chunk = new_chunk(&index)))
+    {
+        return false;
+    }
+
+    UringOp *op = new_op(URING_READ, file_fd);
+    struct io_uring_sqe *sqe = op ? uring_get_sqe(&loop->ring) : NULL;
+
+    if (!sqe)
+    {
+        if (op)
+        {
+            free_op(op);
+        }
+        if (chunk)
+        {
+            free_node(chunk);
+        }
+        return false;
+    }
+
+    op->chunk = chunk;
+
+    sqe->fd = file_fd;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+
+    if (!chunk)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+    }
+    else
+    {
+        sqe->opcode = index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->addr = (uint64_t)(uintptr_t)chunk->raw.buffer.write;
+        sqe->len = FILE_CHUNK_SIZE;
+        sqe->buf_index = index >= 0 ? index : 0;
+        // From the current position, pipes have none
+        sqe->off = (uint64_t)-1;
+    }
+
+    file->input = op;
+    return true;
+}
+
+static ON_MESSAGE_RESULT submit_send(int client_fd)
+{
+    DataHeader *header = get_header(client_fd);
+
+    if (header->output)
+    {
+        return KEEP_CONNECTION_OPEN;
+    }
+
+    UringOp *op = new_op(URING_SEND, client_fd);
+    if (!op)
+    {
+        return CONNECTION_ERROR;
+    }
+
+    int count = 0;
+    size_t budget = SEND_BUDGET;
+    gather_data(&header->messages, client_fd, op->iov, URING_SEND_IOVECS, &count, &budget);
+
+    if (!count)
+    {
+        free_op(op);
+        return finish_send(client_fd, 0);
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (!sqe)
+    {
+        free_op(op);
+        return CONNECTION_ERROR;
+    }
+
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = count;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+
+    header->output = op;
+    return KEEP_CONNECTION_OPEN;
+}
+
+static void handle_accept(UringOp *op, int result)
+{
+    if (result >= 0)
+    {
+        struct sockaddr_in6 address;
+        socklen_t addrlen = sizeof(address);
+
+        // A multishot accept has nowhere to store the addresses
+        if (getpeername(result, (struct sockaddr *)&address, &addrlen) < 0)
+        {
+            LOG("Rejected connection: socket fd %d left before being accepted\n", result);
+            close(result);
+            return;
+        }
+
+        accept_client(op->server_fd, result, &address);
+        return;
+    }
+
+    // The server was retired, the new process takes the rest of the queue
+    if (op->fd < 0)
+    {
+        return;
+    }
+
+    switch (-result)
+    {
+    case ECANCELED:
+    case EINTR:
+    case EAGAIN:
+    // The client left before being accepted, or the network failed it
+    case ECONNABORTED:
+    case EPROTO:
+    case EPERM:
+    case ENETDOWN:
+    case ENOPROTOOPT:
+    case EHOSTDOWN:
+    case ENONET:
+    case EHOSTUNREACH:
+    case EOPNOTSUPP:
+    case ENETUNREACH:
+        break;
+    // Out of descriptors or memory, the accept is queued again after shedding one
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+        shed_connection(op->server_fd);
+        break;
+    default:
+        errno = -result;
+        perror("accept");
+        loop->status = EXIT_FAILURE;
+        break;
+    }
+}
+
+static void handle_recv(UringOp *op, int result, unsigned flags)
+{
+    int fd = op->fd;
+    DataHeader *header = get_header(fd);
+    bool buffered = flags & IORING_CQE_F_BUFFER;
+    unsigned short id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    // Out of buffers, paused or interrupted, the receive is queued again if it's still wanted
+    bool retry = result == -ENOBUFS || result == -ECANCELED || result == -EINTR || result == -EAGAIN;
+
+    // Nothing is read once the client is closed or draining, like the other engines
+    if (!header->closed && !header->draining)
+    {
+        if (result > 0)
+        {
+            // The answers to every command of the buffer go out in a single send
+            if (handle_message(fd, uring_buffer(&loop->recv_buffers, id), result) && header->messages.first)
+            {
+                flush_socket(fd);
+            }
+        }
+        else if (result == -EINVAL && !loop->single_recv)
+        {
+            // Multishot receives came with Linux 6.0, the receive is queued again without it
+            LOG("Multishot receives not supported, using one-shot receives\n");
+            loop->single_recv = true;
+        }
+        else if (!retry)
+        {
+            // Connection closed or error
+            LOG("Client disconnected: socket fd %d\n", fd);
+
+            notify_close(fd, CONNECTION_ERROR);
+            close_socket(fd);
+        }
+    }
+
+    if (buffered)
+    {
+        uring_recycle_buffer(&loop->recv_buffers, id);
+    }
+}
+
+static void handle_send(UringOp *op, int result)
+{
+    if (result < 0 && result != -EINTR && result != -EAGAIN)
+    {
+        end_flush(op->fd, CONNECTION_ERROR);
+        return;
+    }
+
+    // The rest is sent before the next wait, the fd was queued with the completion
+    end_flush(op->fd, finish_send(op->fd, result > 0 ? result : 0));
+}
+
+static void handle_read(UringOp *op, int result)
+{
+    int file_fd = op->fd;
+    DataHeader *file = get_header(file_fd);
+    Data *chunk = op->chunk;
+
+    // The file was polled, it's read with the next operation
+    if (!chunk && result > 0)
+    {
+        file->poll_first = false;
+        return;
+    }
+
+    if (result > 0 && chunk)
+    {
+        // The next chunk is read once this one is sent
+        file->watched = false;
+
+        DataHeader *header = get_header(file->client_fd);
+        Data *splitter = header->splitters.first;
+
+        while (splitter && splitter->splitter.fd != file_fd)
+        {
+            splitter = splitter->splitter.next;
+        }
+
+        buffer_write_adv(&chunk->raw.buffer, result);
+
+        DataList *list = &splitter->splitter.messages;
+        if (list->first)
+        {
+            list->last->next = chunk;
+        }
+        else
+        {
+            list->first = chunk;
+        }
+
+        list->last = chunk;
+
+        header->queued += result;
+        update_backpressure(file->client_fd);
+        want_send(file->client_fd);
+        return;
+    }
+
+    if (chunk)
+    {
+        free_node(chunk);
+    }
+
+    if (result == -EAGAIN || result == -EINTR)
+    {
+        file->poll_first = result == -EAGAIN;
+        return;
+    }
+
+    if (result < 0)
+    {
+        LOG("Error on fd %d\n", file_fd);
+    }
+
+    // The splitter is marked as finished by close_file
+    close_file(file_fd);
+}
+
+static void release_op(UringOp *op, int result, unsigned flags)
+{
+    switch (op->type)
+    {
+    case URING_ACCEPT:
+        // Only while the loop is destroyed, nobody would serve it
+        if (result >= 0)
+        {
+            close(result);
+        }
+        break;
+
+    case URING_RECV:
+        if (flags & IORING_CQE_F_BUFFER)
+        {
+            uring_recycle_buffer(&loop->recv_buffers, flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        break;
+
+    case URING_SEND:
+        release_messages(&op->orphans.messages, &op->orphans.splitters);
+        break;
+
+    case URING_READ:
+        if (op->chunk)
+        {
+            free_node(op->chunk);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void drain_ring()
+{
+    while (loop->operations)
+    {
+        if (uring_wait(&loop->ring, URING_DRAIN_TIMEOUT) < 0 || !uring_ready(&loop->ring))
+        {
+            LOG("%d operations did not finish\n", loop->operations);
+            return;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)))
+        {
+            uint64_t data = cqe->user_data;
+            int result = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&loop->ring);
+
+            if (data == URING_IGNORED)
+            {
+                continue;
+            }
+
+            UringOp *op = (UringOp *)(uintptr_t)data;
+            release_op(op, result, flags);
+
+            if (!(flags & IORING_CQE_F_MORE))
+            {
+                free_op(op);
+            }
+        }
+    }
+}
+
+static void start_upgrade()
+{
+    if (!upgrade_argv)
+    {
+        LOG("Upgrade requested, but upgrades are not enabled\n");
+        return;
+    }
+
+    if (upgrade_fd >= 0 || atomic_load(&retiring))
+    {
+        LOG("Upgrade requested, but there is one in progress\n");
+        return;
+    }
+
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) < 0)
+    {
+        perror("socketpair failed");
+        return;
+    }
+
+    // The environment is built beforehand, the child may only exec
+    char variable[sizeof(UPGRADE_FD_ENV) + 16];
+    snprintf(variable, sizeof(variable), UPGRADE_FD_ENV "=%d", channel[1]);
+
+    size_t count = 0;
+    while (environ[count])
+    {
+        count++;
+    }
+
+    char **env = malloc((count + 2) * sizeof(char *));
+    if (!env)
+    {
+        perror("Failed to allocate the environment");
+        close(channel[0]);
+        close(channel[1]);
+        return;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (strncmp(environ[i], UPGRADE_FD_ENV "=", sizeof(UPGRADE_FD_ENV)))
+        {
+            env[length++] = environ[i];
+        }
+    }
+
+    env[length++] = variable;
+    env[length] = NULL;
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        // Nothing but the channel is passed on, the clients stay with this process
+        close_range(STDERR_FILENO + 1, channel[1] - 1, 0);
+        close_range(channel[1] + 1, ~0U, 0);
+        fcntl(channel[1], F_SETFD, 0);
+
+        execve(upgrade_argv[0], upgrade_argv, env);
+        _exit(127);
+    }
+
+    free(env);
+    close(channel[1]);
+
+    if (pid < 0)
+    {
+        perror("fork failed");
+        close(channel[0]);
+        return;
+    }
+
+    DataHeader *header = fd_table_reserve(loop->pending, channel[0]);
+
+    if (!header || !send_servers(channel[0]))
+    {
+        perror("Failed to send the servers");
+        close(channel[0]);
+        return;
+    }
+
+    header->type = FD_UPGRADE;
+
+    if (!watch_fd(channel[0], POLLIN))
+    {
+        perror("Failed to watch the upgrade");
+        header->type = FD_UNUSED;
+        close(channel[0]);
+        return;
+    }
+
+    upgrade_fd = channel[0];
+
+    LOG("Upgrading, process %d is taking over\n", pid);
+}
+
+static bool send_servers(int channel)
+{
+    char count = servers_count;
+    struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+    char control[CMSG_SPACE(MAX_SERVERS * sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(servers_count * sizeof(int)),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(servers_count * sizeof(int));
+
+    int *fds = (int *)CMSG_DATA(cmsg);
+    for (int i = 0; i < servers_count; i++)
+    {
+        fds[i] = servers[i].fd;
+    }
+
+    return sendmsg(channel, &message, MSG_NOSIGNAL) == sizeof(count);
+}
+
+static void handle_upgrade_event(int fd)
+{
+    char ready;
+    ssize_t length = read(fd, &ready, sizeof(ready));
+
+    if (length < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return;
+    }
+
+    unwatch_fd(fd);
+    get_header(fd)->type = FD_UNUSED;
+    close(fd);
+    upgrade_fd = -1;
+
+    if (length <= 0)
+    {
+        LOG("Upgrade failed, the new process exited before taking over\n");
+        return;
+    }
+
+    LOG("Upgrade done, waiting for the clients to leave\n");
+
+    atomic_store(&retiring, true);
+
+    for (int i = 0; i < loops_count; i++)
+    {
+        if (loops[i] != loop)
+        {
+            wake_loop(loops[i]);
+        }
+    }
+}
+
+static void retire_servers()
+{
+    for (int i = 0; i < servers_count; i++)
+    {
+        if (servers[i].worker != loop->id)
+        {
+            continue;
+        }
+
+        // The new process keeps the socket open, with the pending connections
+        unwatch_fd(servers[i].fd);
+        get_header(servers[i].fd)->type = FD_UNUSED;
+        close(servers[i].fd);
+    }
+
+    loop->retired = true;
+}
+
+static bool handle_server_event(int server_fd)
+{
+    for (int i = 0; i < MAX_ACCEPTS_PER_EVENT; i++)
+    {
+        struct sockaddr_in6 address;
+        socklen_t addrlen = sizeof(address);
+
+        // A slow client must never block the loop
+        int new_socket = accept4(server_fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket >= 0)
+        {
+            accept_client(server_fd, new_socket, &address);
+            continue;
+        }
+
+        switch (errno)
+        {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            return true;
+        case EINTR:
+            continue;
+        // The client left before being accepted, or the network failed it
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+        case ENETDOWN:
+        case ENOPROTOOPT:
+        case EHOSTDOWN:
+        case ENONET:
+        case EHOSTUNREACH:
+        case EOPNOTSUPP:
+        case ENETUNREACH:
+            continue;
+        // Out of descriptors or memory, the rest waits for the next event
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            shed_connection(server_fd);
+            return true;
+        default:
+            perror("accept");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void accept_client(int server_fd, int new_socket, struct sockaddr_in6 *address)
+{
+    DataHeader *header = fd_table_reserve(loop->pending, new_socket);
+    if (!header)
+    {
+        LOG("Rejected connection: socket fd %d over the limit of %d descriptors\n", new_socket, loop->pending->limit);
+        close(new_socket);
+        return;
+    }
+
+    header->type = FD_SOCKET;
+    header->fd = new_socket;
+    header->timer.next = NULL;
+    header->timer.prev = NULL;
+    header->started = loop->now;
+    header->active = loop->now;
+    header->closed = false;
+    header->draining = false;
+    header->paused = false;
+    header->queued = 0;
+    header->unreported = 0;
+    ipv6_to_str_unexpanded(header->ip, &address->sin6_addr);
+    header->server_fd = server_fd;
+    header->messages.first = NULL;
+    header->messages.last = NULL;
+    header->splitters.first = NULL;
+    header->splitters.last = NULL;
+
+    LOG("New connection: socket fd %s:%d\n", header->ip, new_socket);
+
+    log_connect(loop->stats, header->ip, header->ip, log_now());
+
+    if (!watch_fd(new_socket, POLLIN))
+    {
+        perror("Failed to watch client");
+        header->type = FD_UNUSED;
+        close(new_socket);
+        return;
+    }
+
+    loop->clients++;
+    schedule_timeout(new_socket);
+
+    loop->dispatching = new_socket;
+    ON_MESSAGE_RESULT result = loop->on_connection(new_socket, *address, server_fd);
+    loop->dispatching = -1;
+
+    if (result != KEEP_CONNECTION_OPEN)
+    {
+        LOG("Rejected connection: socket fd %d\n", new_socket);
+
+        // The handler never took the connection, so on_close is not run, but it was counted as connected
+        header->closed = true;
+        log_disconnect(loop->stats, header->ip, header->ip, log_now());
+
+        if (result == CONNECTION_ERROR)
+        {
+            close_socket(new_socket);
+        }
+        else if (finish_transmition(&header->messages, new_socket))
+        {
+            close_socket(new_socket);
+        }
+        else
+        {
+            flush_socket(new_socket);
+        }
+
+        return;
+    }
+
+    // The greeting goes out without waiting for the next iteration
+    flush_socket(new_socket);
+}
+
+static void shed_connection(int server_fd)
+{
+    LOG("Out of descriptors, shedding a connection of server %d\n", server_fd);
+
+    if (loop->spare_fd < 0)
+    {
+        return;
+    }
+
+    close(loop->spare_fd);
+
+    int new_socket = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (new_socket >= 0)
+    {
+        close(new_socket);
+    }
+
+    // If it can't be taken back, the next shortage leaves the connections queued
+    loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static void handle_file_event(int fd, short revents)
+{
+    if (revents & POLLERR)
+    {
+        LOG("Error on fd %d\n", fd);
+
+        close_file(fd);
+        return;
+    }
+
+    // A hang up still needs a read to find the end of the file
+    if (revents & (POLLIN | POLLHUP))
+    {
+        if (!time_to_read(fd))
+        {
+            close_file(fd);
+        }
+    }
+}
+
+static void handle_socket_event(int fd, short revents)
+{
+    DataHeader *header = get_header(fd);
+    bool dispatched = false;
+
+    if (revents & POLLERR)
+    {
+        LOG("Error on fd %d\n", fd);
+
+        notify_close(fd, CONNECTION_ERROR);
+        close_socket(fd);
+        return;
+    }
+
+    if (revents & (POLLIN | POLLHUP) && header->events & POLLIN)
+    {
+        char buffer[1024];
+        int len = recv(fd, buffer, sizeof(buffer), 0);
+
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+
+        // Connection closed or error, remove from poll
+        if (len <= 0)
+        {
+            LOG("Client disconnected: socket fd %d\n", fd);
+
+            notify_close(fd, CONNECTION_ERROR);
+            close_socket(fd);
+            return;
+        }
+
+        if (!handle_message(fd, buffer, len))
+        {
+            return;
+        }
+
+        dispatched = true;
+    }
+    else if (revents & POLLHUP)
+    {
+        // Nobody is listening to the pending messages anymore
+        LOG("Client hung up: socket fd %d\n", fd);
+
+        notify_close(fd, CONNECTION_ERROR);
+        close_socket(fd);
+        return;
+    }
+
+    // The answers to every command of the packet go out in a single write, pipelined clients included
+    if (revents & POLLOUT || (dispatched && header->messages.first))
+    {
+        flush_socket(fd);
+    }
+}
+
+static bool handle_message(int fd, char *buffer, int length)
+{
+    DataHeader *header = get_header(fd);
+
+    LOG("Received from client %d (%d bytes): %.*s\n", fd, length, length < 512 ? length : 512, buffer);
+
+    header->active = loop->now;
+
+    loop->dispatching = fd;
+    ON_MESSAGE_RESULT result = loop->on_message(fd, buffer, length, header->server_fd, header->ip);
+    loop->dispatching = -1;
+
+    if (result == KEEP_CONNECTION_OPEN)
+    {
+        return true;
+    }
+
+    LOG("Closing connection: socket fd %d\n", fd);
+
+    notify_close(fd, result);
+
+    if (result == CONNECTION_ERROR)
+    {
+        LOG("Error handling message: socket fd %d\n", fd);
+    }
+    else if (!finish_transmition(&header->messages, fd))
+    {
+        LOG("Waiting for transmition to finish: socket fd %d\n", fd);
+        flush_socket(fd);
+        return false;
+    }
+
+    close_socket(fd);
+    return false;
+}
+
+static void flush_socket(int client_fd)
+{
+    end_flush(client_fd, time_to_send(client_fd));
+}
+
+static void end_flush(int client_fd, ON_MESSAGE_RESULT result)
+{
+    if (result != KEEP_CONNECTION_OPEN)
+    {
+        if (result == CONNECTION_ERROR)
+        {
+            LOG("Error sending messages: socket fd %d\n", client_fd);
+        }
+        else
+        {
+            LOG("Finished transmition: socket fd %d\n", client_fd);
+        }
+
+        notify_close(client_fd, result);
+        close_socket(client_fd);
+    }
+}
+
+static void want_send(int client_fd)
+{
+    if (client_fd != loop->dispatching)
+    {
+        set_events(client_fd, get_header(client_fd)->events | POLLOUT);
+    }
+}
+
+static void notify_close(int client_fd, ON_MESSAGE_RESULT status)
+{
+    DataHeader *header = get_header(client_fd);
+
+    if (header->closed)
+    {
+        return;
+    }
+
+    set_events(client_fd, header->events & ~POLLIN);
+    loop->on_close(client_fd, status, header->server_fd);
+
+    log_disconnect(loop->stats, header->ip, header->ip, log_now());
+
+    header->closed = true;
+}
+
+static void close_socket(int client_fd)
+{
+    DataHeader *header = get_header(client_fd);
+
+    Data *splitter = header->splitters.first;
+    while (splitter)
+    {
+        if (splitter->splitter.fd >= 0)
+        {
+            close_file(splitter->splitter.fd);
+        }
+
+        splitter = splitter->splitter.next;
+    }
+
+    // The kernel may be reading the messages of the send in flight, they go with its completion
+    if (header->output)
+    {
+        header->output->orphans.messages = header->messages;
+        header->output->orphans.splitters = header->splitters;
+    }
+    else
+    {
+        release_messages(&header->messages, &header->splitters);
+    }
+
+    header->messages.first = NULL;
+    header->messages.last = NULL;
+    header->splitters.first = NULL;
+    header->splitters.last = NULL;
+
+    timer_wheel_remove(&loop->timers, &header->timer);
+
+    if (header->unreported)
+    {
+        log_bytes_transferred(loop->stats, header->unreported);
+        header->unreported = 0;
+    }
+
+    unwatch_fd(client_fd);
+    header->type = FD_UNUSED;
+    loop->clients--;
+
+    close(client_fd);
+}
+
+static void release_messages(DataList *messages, DataList *splitters)
+{
+    Data *splitter = splitters->first;
+    while (splitter)
+    {
+        Data *next = splitter->splitter.next;
+
+        // The files were closed, only their splitters are left
+        if (splitter->splitter.fd < 0 && splitter->splitter.release)
+        {
+            splitter->splitter.release(splitter->splitter.state);
+        }
+
+        splitter = next;
     }
 
-    opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    free_data(messages->first);
+}
+
+static void close_file(int file_fd)
+{
+    DataHeader *header = get_header(file_fd);
+    int client_fd = header->client_fd;
+
+    Data *splitter = get_header(client_fd)->splitters.first;
+    while (splitter)
     {
-        perror("The other setsockopt failed");
-        return -1;
+        if (splitter->splitter.fd == file_fd)
+        {
+            splitter->splitter.fd = -splitter->splitter.fd;
+            break;
+        }
+
+        splitter = splitter->splitter.next;
     }
 
-    // Bind the socket to the specified port
-    if (bind(server_fd, (struct sockaddr *)address, sizeof(*address)) < 0)
+    if (header->watched)
     {
-        perror("bind failed");
-        return -1;
+        unwatch_fd(file_fd);
     }
 
-    // Set the server socket to non-blocking mode
-    if (fcntl(server_fd, F_SETFL, O_NONBLOCK) < 0)
+    header->type = FD_UNUSED;
+
+    header->read_callback(file_fd);
+
+    // The messages queued after the file may be sent now
+    set_events(client_fd, get_header(client_fd)->events | POLLOUT);
+}
+
+void asend(int client_fd, const char *message, size_t length)
+{
+    iasend(&get_header(client_fd)->messages, client_fd, message, length);
+}
+
+char *areserve(int client_fd, size_t length)
+{
+    return reserve_data(&get_header(client_fd)->messages, length, NULL);
+}
+
+void acommit(int client_fd, size_t length)
+{
+    commit_data(&get_header(client_fd)->messages, client_fd, length);
+}
+
+void abegin(response_builder *builder, int client_fd)
+{
+    builder->client_fd = client_fd;
+    builder->start = NULL;
+    builder->cursor = NULL;
+    builder->end = NULL;
+}
+
+void aappend(response_builder *builder, const char *token, size_t length)
+{
+    if (!response_room(builder, length))
     {
-        perror("fcntl failed");
-        return -1;
+        return;
     }
 
-    // Listen for incoming connections
-    if (listen(server_fd, MAX_PENDING_CLIENTS) < 0)
+    memcpy(builder->cursor, token, length);
+    builder->cursor += length;
+}
+
+void aappend_number(response_builder *builder, uint64_t number)
+{
+    static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    if (!response_room(builder, MAX_NUMBER_DIGITS))
     {
-        perror("listen failed");
-        return -1;
+        return;
     }
 
-    return server_fd;
+    // Written backwards, two digits at a time
+    char digits[MAX_NUMBER_DIGITS];
+    char *first = digits + sizeof(digits);
+
+    while (number >= 100)
+    {
+        first -= 2;
+        memcpy(first, digit_pairs + number % 100 * 2, 2);
+        number /= 100;
+    }
+
+    if (number >= 10)
+    {
+        first -= 2;
+        memcpy(first, digit_pairs + number * 2, 2);
+    }
+    else
+    {
+        *--first = '0' + number;
+    }
+
+    size_t length = digits + sizeof(digits) - first;
+    memcpy(builder->cursor, first, length);
+    builder->cursor += length;
+}
+
+void aend(response_builder *builder)
+{
+    if (builder->start)
+    {
+        commit_data(&get_header(builder->client_fd)->messages, builder->client_fd, builder->cursor - builder->start);
+    }
+
+    abegin(builder, builder->client_fd);
 }
 
-void add_server(int server_fd, struct sockaddr_in6 *address)
+static ON_MESSAGE_RESULT time_to_send(int client_fd)
 {
-    sem_wait(&fds_mutex);
+    if (engine == ENGINE_URING)
+    {
+        return submit_send(client_fd);
+    }
 
-    fds[nfds].fd = server_fd;
-    fds[nfds].events = POLLIN;
-    nfds++;
+    DataHeader *header = get_header(client_fd);
 
-    pending[server_fd].type = FD_SOCKET;
-    pending[server_fd].ip = address->sin6_addr;
-    pending[server_fd].server_fd = server_fd;
+    struct iovec iov[MAX_SEND_IOVECS];
+    int count = 0;
+    size_t budget = SEND_BUDGET;
+    gather_data(&header->messages, client_fd, iov, MAX_SEND_IOVECS, &count, &budget);
 
-    servers_count++;
+    size_t sent = 0;
+
+    if (count)
+    {
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = count,
+        };
 
-    sem_post(&fds_mutex);
+        ssize_t result = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
+        if (result < 0)
+        {
+            // The socket buffer is full, wait for the next POLLOUT
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                set_events(client_fd, header->events | POLLOUT);
+                return KEEP_CONNECTION_OPEN;
+            }
+
+            return CONNECTION_ERROR;
+        }
+
+        sent = result;
+    }
+
+    return finish_send(client_fd, sent);
 }
 
-static ON_MESSAGE_RESULT keep_alive_noop()
+static ON_MESSAGE_RESULT finish_send(int client_fd, size_t sent)
 {
+    DataHeader *header = get_header(client_fd);
+
+    if (sent)
+    {
+        header->active = loop->now;
+        header->queued -= sent;
+        update_backpressure(client_fd);
+        count_bytes(header, sent);
+    }
+
+    // Finished splitters are released even if nothing was sent
+    consume_data(&header->messages, client_fd, &sent);
+
+    Data *head = header->messages.first;
+    while (head && head->type == MESSAGE_SPLITTER && head->splitter.messages.first)
+    {
+        head = head->splitter.messages.first;
+    }
+
+    if (!head)
+    {
+        set_events(client_fd, header->events & ~POLLOUT);
+    }
+    else if (head->type == ESC)
+    {
+        free_data(header->messages.first);
+        header->messages.first = NULL;
+        header->messages.last = NULL;
+        return CLOSE_CONNECTION;
+    }
+    else if (head->type == MESSAGE_SPLITTER && head->splitter.fd >= 0)
+    {
+        // The head file is only read when there's nothing before it
+        if (!get_header(head->splitter.fd)->watched)
+        {
+            watch_fd(head->splitter.fd, POLLIN);
+        }
+
+        // Nothing else can be sent until the file produces more messages
+        set_events(client_fd, header->events & ~POLLOUT);
+    }
+    else
+    {
+        // The socket took part of it, or more than a single call can gather
+        set_events(client_fd, header->events | POLLOUT);
+    }
+
     return KEEP_CONNECTION_OPEN;
 }
 
-static void noop()
+static bool gather_data(DataList *list, int client_fd, struct iovec *iov, int capacity, int *count, size_t *budget)
+{
+    for (Data *data = list->first; data; data = data->next)
+    {
+        if (data->type == ESC || *count == capacity || !*budget)
+        {
+            return false;
+        }
+
+        if (data->type == MESSAGE_SPLITTER)
+        {
+            // Streams are only produced once they can be sent
+            if (data->splitter.produce && !data->splitter.messages.first)
+            {
+                produce_data(data, client_fd);
+            }
+
+            // The messages after an open file or stream must wait for it
+            if (!gather_data(&data->splitter.messages, client_fd, iov, capacity, count, budget) || data->splitter.fd >= 0 || data->splitter.produce)
+            {
+                return false;
+            }
+
+            continue;
+        }
+
+        iov[*count].iov_base = buffer_read_ptr(&data->raw.buffer, &iov[*count].iov_len);
+
+        // The message is finished in the next turns
+        if (iov[*count].iov_len > *budget)
+        {
+            iov[*count].iov_len = *budget;
+        }
+
+        *budget -= iov[*count].iov_len;
+        (*count)++;
+    }
+
+    return true;
+}
+
+static bool consume_data(DataList *list, int client_fd, size_t *sent)
+{
+    Data *data;
+    while ((data = list->first))
+    {
+        if (data->type == ESC)
+        {
+            return false;
+        }
+
+        if (data->type == MESSAGE_SPLITTER)
+        {
+            if (!consume_data(&data->splitter.messages, client_fd, sent) || data->splitter.fd >= 0 || data->splitter.produce)
+            {
+                return false;
+            }
+
+            list->first = data->next;
+            remove_splitter(client_fd, data);
+
+            if (data->splitter.release)
+            {
+                data->splitter.release(data->splitter.state);
+            }
+
+            free_node(data);
+            continue;
+        }
+
+        size_t length;
+        buffer_read_ptr(&data->raw.buffer, &length);
+
+        if (*sent < length)
+        {
+            buffer_read_adv(&data->raw.buffer, *sent);
+            *sent = 0;
+            return false;
+        }
+
+        *sent -= length;
+        list->first = data->next;
+
+        free_node(data);
+    }
+
+    list->last = NULL;
+    return true;
+}
+
+static void produce_data(Data *splitter, int client_fd)
+{
+    DataList *list = &splitter->splitter.messages;
+    size_t produced = 0;
+
+    while (produced < STREAM_BATCH_SIZE)
+    {
+        Data *data = new_data(0);
+
+        if (!data)
+        {
+            break;
+        }
+
+        const char *segment;
+        size_t length = splitter->splitter.produce(splitter->splitter.state, &segment);
+
+        if (!length)
+        {
+            // The stream is released once its segments are sent
+            free_node(data);
+            splitter->splitter.produce = NULL;
+            break;
+        }
+
+        // The segment belongs to the stream, nothing to free
+        buffer_init(&data->raw.buffer, length, (uint8_t *)segment);
+        buffer_write_adv(&data->raw.buffer, length);
+
+        if (list->first)
+        {
+            list->last->next = data;
+        }
+        else
+        {
+            list->first = data;
+        }
+
+        list->last = data;
+
+        produced += length;
+        get_header(client_fd)->queued += length;
+    }
+
+    update_backpressure(client_fd);
+}
+
+static void remove_splitter(int client_fd, Data *splitter)
+{
+    DataList *splitters = &get_header(client_fd)->splitters;
+
+    Data *current = splitters->first;
+    Data *prev = NULL;
+
+    while (current && current != splitter)
+    {
+        prev = current;
+        current = current->splitter.next;
+    }
+
+    if (!current)
+    {
+        return;
+    }
+
+    if (prev)
+    {
+        prev->splitter.next = current->splitter.next;
+    }
+    else
+    {
+        splitters->first = current->splitter.next;
+    }
+
+    if (current == splitters->last)
+    {
+        splitters->last = prev;
+    }
+}
+
+bool fasend(int client_fd, int file_fd, read_event callback)
+{
+    Data *splitter = new_data(0);
+
+    if (!splitter)
+    {
+        return false;
+    }
+
+    DataHeader *header = get_header(client_fd);
+    bool empty = !header->messages.first;
+
+    DataHeader *file = fd_table_reserve(loop->pending, file_fd);
+    if (!file)
+    {
+        free_node(splitter);
+        return false;
+    }
+
+    file->type = FD_FILE;
+    file->read_callback = callback;
+    file->client_fd = client_fd;
+    file->buffered = false;
+    file->poll_first = false;
+
+    // Otherwise it's watched once the messages before it are sent
+    if (empty && !watch_fd(file_fd, POLLIN))
+    {
+        file->type = FD_UNUSED;
+        free_node(splitter);
+        return false;
+    }
+
+    splitter->type = MESSAGE_SPLITTER;
+    splitter->next = NULL;
+
+    splitter->splitter.fd = file_fd;
+    splitter->splitter.produce = NULL;
+    splitter->splitter.release = NULL;
+    splitter->splitter.messages.first = NULL;
+    splitter->splitter.messages.last = NULL;
+    splitter->splitter.next = NULL;
+
+    if (empty)
+    {
+        header->messages.first = splitter;
+    }
+    else
+    {
+        header->messages.last->next = splitter;
+    }
+
+    header->messages.last = splitter;
+
+    bool empty_splitters = !header->splitters.first;
+
+    if (empty_splitters)
+    {
+        header->splitters.first = splitter;
+    }
+    else
+    {
+        header->splitters.last->splitter.next = splitter;
+    }
+
+    header->splitters.last = splitter;
+
+    return true;
+}
+
+bool pasend(int client_fd, produce_event produce, release_event release, void *state)
 {
-}
+    Data *splitter = new_data(0);
 
-int server_loop(const bool *done, connection_event on_connection, message_event on_message, close_event on_close, statistics_manager *stats)
-{
-    struct sockaddr_in6 address;
-    int new_socket, addrlen = sizeof(address);
+    if (!splitter)
+    {
+        return false;
+    }
 
-    on_connection = on_connection ? on_connection : (connection_event)keep_alive_noop;
-    on_close = on_close ? on_close : (close_event)noop;
+    splitter->type = MESSAGE_SPLITTER;
+    splitter->next = NULL;
 
-    while (!*done)
-    {
-        int activity = poll(fds, nfds, -1);
-        if (activity < 0)
-        {
-            if (errno == EINTR || errno == EAGAIN)
-            {
-                continue;
-            }
+    // Not a file, so it is never watched nor closed
+    splitter->splitter.fd = -1;
+    splitter->splitter.produce = produce;
+    splitter->splitter.release = release;
+    splitter->splitter.state = state;
+    splitter->splitter.messages.first = NULL;
+    splitter->splitter.messages.last = NULL;
+    splitter->splitter.next = NULL;
 
-            if (errno == EBADF)
-            {
-                LOG("Bad descriptor detected\n");
-            }
+    DataHeader *header = get_header(client_fd);
 
-            perror("poll error");
-            return EXIT_FAILURE;
-        }
+    if (header->messages.first)
+    {
+        header->messages.last->next = splitter;
+    }
+    else
+    {
+        header->messages.first = splitter;
+    }
 
-        sem_wait(&fds_mutex);
+    header->messages.last = splitter;
 
-        for (int i = 0; i < servers_count; i++)
-        {
-            int server_fd = fds[i].fd;
+    if (header->splitters.first)
+    {
+        header->splitters.last->splitter.next = splitter;
+    }
+    else
+    {
+        header->splitters.first = splitter;
+    }
 
-            // Check for new connections on the server socket
-            if (fds[i].revents & POLLIN)
-            {
-                if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
-                {
-                    perror("accept");
-                    return EXIT_FAILURE;
-                }
+    header->splitters.last = splitter;
 
-                pending[new_socket].type = FD_SOCKET;
-                pending[new_socket].closed = false;
-                pending[new_socket].ip = address.sin6_addr;
-                pending[new_socket].server_fd = server_fd;
-                pending[new_socket].messages.first = NULL;
-                pending[new_socket].messages.last = NULL;
+    // The stream is produced when the client can take it
+    want_send(client_fd);
 
-                char ip_str[40];
-                ipv6_to_str_unexpanded(ip_str, &address.sin6_addr);
+    return true;
+}
 
-                LOG("New connection: socket fd %s:%d\n", ip_str, new_socket);
+static bool time_to_read(int file_fd)
+{
+    DataHeader *file = get_header(file_fd);
+    int client_fd = file->client_fd;
+    DataHeader *header = get_header(client_fd);
 
-                log_connect(stats, ip_str, ip_str, log_now());
+    Data *splitter = header->messages.first;
 
-                // Add new socket to fds array
-                fds[nfds].fd = new_socket;
-                fds[nfds].events = POLLIN;
-                fds[nfds].revents = 0;
-                nfds++;
+    // The file is watched again when it reaches the head
+    if (!splitter || splitter->type != MESSAGE_SPLITTER || splitter->splitter.fd != file_fd || splitter->splitter.messages.first)
+    {
+        unwatch_fd(file_fd);
+        return true;
+    }
 
-                ON_MESSAGE_RESULT result = on_connection(new_socket, address, server_fd);
+    ssize_t length = -1;
+    ssize_t sent = 0;
 
-                if (result != KEEP_CONNECTION_OPEN)
-                {
-                    LOG("Rejected connection: socket fd %d\n", new_socket);
-
-                    if (result == CONNECTION_ERROR)
-                    {
-                        // TODO: Real stats
-                        LOG("Error handling message\n");
-
-                        close(new_socket);
-                        nfds--;
-                    }
-                    else if (finish_transmition(&pending[new_socket].messages, new_socket, nfds - 1))
-                    {
-                        close(new_socket);
-                        nfds--;
-                    }
-                }
-            }
-        }
+    if (!file->buffered)
+    {
+        length = splice(file_fd, NULL, client_fd, NULL, FILE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 
-        // Check each fd for activity
-        for (int i = servers_count; i < nfds; i++)
+        if (length < 0 && (errno == EINVAL || errno == ENOSYS))
         {
-            int fd = fds[i].fd;
+            file->buffered = true;
+        }
 
-            if (fds[i].revents & POLLERR)
-            {
-                LOG("Error on fd %d\n", fd);
+        sent = length;
+    }
 
-                if (pending[fd].type == FD_FILE)
-                {
-                    pending[fd].read_callback(pending[fd].file);
-                    fds[i--] = fds[--nfds];
-
-                    Data *splitters = pending[pending[fd].client_fd].splitters.first;
-                    while (splitters)
-                    {
-                        if (splitters->splitter.fd == fd)
-                        {
-                            splitters->splitter.fd = -splitters->splitter.fd;
-                            break;
-                        }
-
-                        splitters = splitters->splitter.next;
-                    }
-
-                    continue;
-                }
+    if (file->buffered)
+    {
+        length = read(file_fd, loop->file_buffer, FILE_CHUNK_SIZE);
+        sent = 0;
 
-                NOTIFY_CLOSE(fds, pending, fd, on_close, CONNECTION_ERROR);
-                CLOSE_SOCKET(fds, nfds, i);
-            }
+        if (length > 0)
+        {
+            sent = send(client_fd, loop->file_buffer, length, MSG_NOSIGNAL);
 
-            if (fds[i].revents & POLLIN)
+            if (sent < 0)
             {
-                if (pending[fd].type == FD_FILE)
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
                 {
-                    bool finished = !time_to_read(pending[fd].client_fd, pending[fd].file);
-
-                    if (finished)
-                    {
-                        pending[fd].read_callback(pending[fd].file);
-                        fds[i--] = fds[--nfds];
-                        continue;
-                    }
+                    return false;
                 }
 
-                if (pending[fd].type == FD_SOCKET)
-                {
-                    char buffer[1024] = {0};
-                    int len = recv(fd, buffer, sizeof(buffer), 0);
-
-                    // Connection closed or error, remove from poll
-                    if (len <= 0)
-                    {
-                        LOG("Client disconnected: socket fd %d\n", fd);
-
-                        Data *splitter = pending[fd].splitters.first;
-                        while (splitter)
-                        {
-                            if (splitter->splitter.fd >= 0)
-                            {
-                                pending[fd].read_callback(pending[fd].file);
-                                fds[i--] = fds[--nfds];
-                            }
-
-                            splitter = splitter->splitter.next;
-                        }
-
-                        free_data(pending[fd].messages.first);
-
-                        NOTIFY_CLOSE(fds, pending, fd, on_close, CONNECTION_ERROR);
-                        CLOSE_SOCKET(fds, nfds, i);
-                        continue;
-                    }
-
-                    LOG("Received from client %d (%d bytes): %.512s\n", fd, len, buffer);
-
-                    char ip[40];
-                    ipv6_to_str_unexpanded(ip, &pending[fd].ip);
-
-                    ON_MESSAGE_RESULT result = on_message(fd, buffer, len, pending[fd].server_fd, ip);
-
-                    if (result != KEEP_CONNECTION_OPEN)
-                    {
-                        LOG("Closing connection: socket fd %d\n", fd);
-
-                        NOTIFY_CLOSE(fds, pending, fd, on_close, result);
-
-                        if (result == CONNECTION_ERROR)
-                        {
-                            // TODO: Real stats
-                            LOG("Error handling message\n");
-                        }
-                        else if (!finish_transmition(&pending[fd].messages, fd, i))
-                        {
-                            LOG("Waiting for transmition to finish: socket fd %d\n", fd);
-                            continue;
-                        }
-
-                        CLOSE_SOCKET(fds, nfds, i);
-                        continue;
-                    }
-                }
+                sent = 0;
             }
 
-            if (fds[i].revents & POLLOUT)
+            // The rest waits in the splitter, the file is watched again once it's sent
+            if (sent < length)
             {
-                DataHeader *header = pending + fd;
-
-                if (header->type != FD_SOCKET)
-                {
-                    fds[i].events &= ~POLLOUT;
-                    continue;
-                }
-
-                ON_MESSAGE_RESULT result = time_to_send(&header->messages, fd, i, NULL, stats);
-
-                if (result != KEEP_CONNECTION_OPEN)
-                {
-                    if (result == CONNECTION_ERROR)
-                    {
-                        // TODO: Real stats
-                        LOG("Error handling message\n");
-                    }
-                    else
-                    {
-                        LOG("Finished transmition: socket fd %d\n", fd);
-                    }
-
-                    NOTIFY_CLOSE(fds, pending, fd, on_close, result);
-                    CLOSE_SOCKET(fds, nfds, i);
-                }
+                unwatch_fd(file_fd);
+                iasend(&splitter->splitter.messages, client_fd, loop->file_buffer + sent, length - sent);
             }
         }
-
-        sem_post(&fds_mutex);
     }
 
-    return EXIT_SUCCESS;
-}
-
-void asend(int client_fd, const char *message, size_t length)
-{
-    iasend(&pending[client_fd].messages, client_fd, message, length);
-}
+    if (length < 0)
+    {
+        if (errno == EINTR)
+        {
+            return true;
+        }
 
-static ON_MESSAGE_RESULT time_to_send(DataList *list, int client_fd, int fds_index, bool *empty_node, statistics_manager *stats)
-{
-    Data *data = list->first;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            return false;
+        }
 
-    if (!data)
-    {
-        if (!empty_node)
+        // The pipe is empty, it stays watched until the transformer writes more
+        if (file->buffered || !file_has_data(file_fd))
         {
-            fds[fds_index].events &= ~POLLOUT;
-            return KEEP_CONNECTION_OPEN;
+            return true;
         }
 
-        *empty_node = true;
-        return KEEP_CONNECTION_OPEN;
+        // The socket is full, wait until the client can take more
+        unwatch_fd(file_fd);
+        set_events(client_fd, header->events | POLLOUT);
+        return true;
     }
 
-    if (data->type == ESC)
+    if (sent > 0)
     {
-        free_data(data);
-        list->first = NULL;
-        list->last = NULL;
-        return CLOSE_CONNECTION;
+        header->active = loop->now;
+        count_bytes(header, sent);
     }
 
-    if (data->type == MESSAGE_SPLITTER)
-    {
-        bool empty_splitter = false;
-        ON_MESSAGE_RESULT result = time_to_send(&data->splitter.messages, client_fd, fds_index, &empty_splitter, stats);
+    // The splitter is marked as finished by close_file
+    return length > 0;
+}
 
-        if (empty_splitter && data->splitter.fd < 0)
-        {
-            list->first = data->next;
+static bool file_has_data(int file_fd)
+{
+    int available;
 
-            Data *splitters = pending[client_fd].splitters.first;
-            Data *prev = NULL;
+    // If it can't be told, the client is waited for, a wakeup too many at worst
+    return ioctl(file_fd, FIONREAD, &available) < 0 || available > 0;
+}
 
-            while (splitters)
-            {
-                if (splitters->splitter.fd == data->splitter.fd)
-                {
-                    if (prev)
-                    {
-                        prev->splitter.next = splitters->splitter.next;
-                    }
-                    else
-                    {
-                        pending[client_fd].splitters.first = splitters->splitter.next;
-                    }
-
-                    if (splitters == pending[client_fd].splitters.last)
-                    {
-                        pending[client_fd].splitters.last = prev;
-                    }
-
-                    break;
-                }
+static void iasend(DataList *list, int client_fd, const char *message, size_t length)
+{
+    char *space = reserve_data(list, length, NULL);
 
-                prev = splitters;
-                splitters = splitters->splitter.next;
-            }
+    if (!space)
+    {
+        return;
+    }
 
-            free(data);
+    memcpy(space, message, length);
+    commit_data(list, client_fd, length);
+}
 
-            if (list->first)
-            {
-                return time_to_send(list, client_fd, fds_index, empty_node, stats);
-            }
+static char *reserve_data(DataList *list, size_t length, size_t *capacity)
+{
+    Data *last = list->last;
+    bool buffered = last && last->type == RAW_DATA;
 
-            list->last = NULL;
+    loop->reserved = NULL;
+    loop->reserved_space = NULL;
 
-            if (!empty_node)
-            {
-                fds[fds_index].events &= ~POLLOUT;
-            }
-            else
+    if (buffered)
+    {
+        size_t available;
+        uint8_t *space = buffer_write_ptr(&last->raw.buffer, &available);
+
+        if (length <= available)
+        {
+            if (capacity)
             {
-                *empty_node = true;
+                *capacity = available;
             }
-        }
-        else if (empty_splitter && !empty_node)
-        {
-            // Disable POLLOUT if no more messages in splitter but it's still open
-            fds[fds_index].events &= ~POLLOUT;
-        }
 
-        return result;
+            loop->reserved_space = (char *)space;
+            return loop->reserved_space;
+        }
     }
 
-    char *message = data->raw.data;
-    size_t length = data->raw.length;
+    // A long response is chained in full size buffers
+    size_t payload = (buffered || capacity) && length < OUTPUT_BUFFER_SIZE ? OUTPUT_BUFFER_SIZE : length;
+    Data *data = new_data(payload);
 
-    ssize_t sent = send(client_fd, message, length, 0);
-    if (sent < 0)
+    if (!data)
     {
-        free_data(data);
-        list->first = NULL;
-        list->last = NULL;
-        return CONNECTION_ERROR;
+        return NULL;
     }
 
-    char ip[40];
-    ipv6_to_str_unexpanded(ip, &pending[client_fd].ip);
-    log_bytes_transferred(stats, ip, ip, sent, log_now());
-
-    if (sent < length)
+    if (capacity)
     {
-        data->raw.data = message + sent;
-        data->raw.length = length - sent;
-        return KEEP_CONNECTION_OPEN;
+        *capacity = payload;
     }
 
-    free(data->raw.ptr);
+    loop->reserved = data;
+    loop->reserved_space = (char *)data->raw.buffer.write;
+    return loop->reserved_space;
+}
 
-    Data *next = data->next;
+static void commit_data(DataList *list, int client_fd, size_t length)
+{
+    Data *data = loop->reserved;
 
-    free(data);
+    if (!loop->reserved_space)
+    {
+        return;
+    }
 
-    list->first = next;
+    loop->reserved = NULL;
+    loop->reserved_space = NULL;
 
-    if (!next)
+    if (!length)
     {
-        list->last = NULL;
+        if (data)
+        {
+            free_node(data);
+        }
+        return;
+    }
 
-        if (!empty_node)
+    bool empty = !list->first;
+
+    if (data)
+    {
+        if (empty)
         {
-            fds[fds_index].events &= ~POLLOUT;
+            list->first = data;
         }
         else
         {
-            *empty_node = true;
+            list->last->next = data;
         }
-    }
-
-    return KEEP_CONNECTION_OPEN;
-}
-
-bool fasend(int client_fd, FILE *file, read_event callback)
-{
-    Data *splitter = malloc(sizeof(Data));
 
-    if (!splitter)
-    {
-        return false;
+        list->last = data;
     }
 
-    int file_fd = fileno_unlocked(file);
-
-    pending[file_fd].type = FD_FILE;
-    pending[file_fd].read_callback = callback;
-    pending[file_fd].client_fd = client_fd;
-    pending[file_fd].file = file;
-
-    fds[nfds].fd = file_fd;
-    fds[nfds].events = POLLIN;
-    fds[nfds].revents = 0;
-    nfds++;
-
-    splitter->type = MESSAGE_SPLITTER;
-    splitter->next = NULL;
-
-    splitter->splitter.fd = file_fd;
-    splitter->splitter.messages.first = NULL;
-    splitter->splitter.messages.last = NULL;
-    splitter->splitter.next = NULL;
+    buffer_write_adv(&list->last->raw.buffer, length);
 
-    DataHeader *header = pending + client_fd;
-    bool empty = !header->messages.first;
+    get_header(client_fd)->queued += length;
+    update_backpressure(client_fd);
 
     if (empty)
     {
-        header->messages.first = splitter;
+        want_send(client_fd);
     }
-    else
+}
+
+static bool response_room(response_builder *builder, size_t length)
+{
+    if ((size_t)(builder->end - builder->cursor) >= length)
     {
-        header->messages.last->next = splitter;
+        return true;
     }
 
-    header->messages.last = splitter;
-
-    bool empty_splitters = !header->splitters.first;
+    DataList *list = &get_header(builder->client_fd)->messages;
 
-    if (empty_splitters)
+    if (builder->start)
     {
-        header->splitters.first = splitter;
+        commit_data(list, builder->client_fd, builder->cursor - builder->start);
     }
-    else
+
+    size_t capacity;
+    builder->start = reserve_data(list, length, &capacity);
+
+    if (!builder->start)
     {
-        header->splitters.last->splitter.next = splitter;
+        builder->cursor = NULL;
+        builder->end = NULL;
+        return false;
     }
 
-    header->splitters.last = splitter;
+    builder->cursor = builder->start;
+    builder->end = builder->start + capacity;
 
     return true;
 }
 
-static bool time_to_read(int client_fd, FILE *file)
+static bool schedule_timeout(int client_fd)
 {
-    int file_fd = fileno_unlocked(file);
-    Data *splitter = pending[client_fd].splitters.first;
-    while (splitter && splitter->splitter.fd != file_fd)
-    {
-        splitter = splitter->splitter.next;
-    }
+    DataHeader *header = get_header(client_fd);
 
-    if (!splitter)
+    uint64_t idle = atomic_load(&idle_timeout) * 1000ULL / TIMER_TICK_MS;
+    uint64_t lifetime = atomic_load(&session_lifetime) * 1000ULL / TIMER_TICK_MS;
+
+    if (!idle && !lifetime)
     {
-        return false;
+        timer_wheel_remove(&loop->timers, &header->timer);
+        return true;
     }
 
-    char message[512];
-    size_t length = fread(message, sizeof(char), sizeof(message), file);
+    uint64_t deadline = idle ? header->active + idle : UINT64_MAX;
 
-    if (length)
+    if (lifetime && header->started + lifetime < deadline)
     {
-        iasend(&splitter->splitter.messages, client_fd, message, length);
+        deadline = header->started + lifetime;
     }
 
-    if (feof_unlocked(file) || ferror_unlocked(file))
+    if (deadline <= loop->now)
     {
-        splitter->splitter.fd = -splitter->splitter.fd;
         return false;
     }
 
+    timer_wheel_add(&loop->timers, &header->timer, deadline);
     return true;
 }
 
-static void iasend(DataList *list, int client_fd, const char *message, size_t length)
+static void handle_timeout(timer_node *timer)
 {
-    Data *data = malloc(sizeof(Data));
+    DataHeader *header = (DataHeader *)((char *)timer - offsetof(DataHeader, timer));
+    int fd = header->fd;
 
-    if (!data)
+    // The activity is not tracked by the timer, so it may not be due yet
+    if (schedule_timeout(fd))
     {
         return;
     }
 
-    data->type = RAW_DATA;
-    data->raw.ptr = malloc(length);
-    data->next = NULL;
+    LOG("Autologout: socket fd %d\n", fd);
+
+    // Like an error, the session must not enter the UPDATE state
+    notify_close(fd, CONNECTION_ERROR);
+    close_socket(fd);
+}
+
+static uint64_t current_tick()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    if (!data->raw.ptr)
+    return ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+static uint64_t current_micros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void update_backpressure(int client_fd)
+{
+    DataHeader *header = get_header(client_fd);
+
+    bool pause = !header->paused && header->queued >= MAX_QUEUED_BYTES;
+    bool resume = header->paused && header->queued <= MAX_QUEUED_BYTES / 2;
+
+    if (!pause && !resume)
     {
-        free(data);
         return;
     }
 
-    memcpy(data->raw.ptr, message, length);
-
-    data->raw.data = data->raw.ptr;
-    data->raw.length = length;
-
-    bool empty = !list->first;
+    header->paused = pause;
 
-    if (empty)
+    // New commands would only queue more messages
+    if (pause)
     {
-        list->first = data;
+        set_events(client_fd, header->events & ~POLLIN);
     }
-    else
+    else if (!header->closed && !header->draining)
     {
-        list->last->next = data;
+        set_events(client_fd, header->events | POLLIN);
     }
+}
 
-    list->last = data;
+static void count_bytes(DataHeader *header, size_t bytes)
+{
+    header->unreported += bytes;
 
-    if (empty)
+    if (header->unreported >= STATS_BATCH_SIZE)
     {
-        for (size_t i = 1; i < nfds; i++)
-        {
-            if (fds[i].fd == client_fd)
-            {
-                fds[i].events |= POLLOUT;
-                break;
-            }
-        }
+        log_bytes_transferred(loop->stats, header->unreported);
+        header->unreported = 0;
     }
 }
 
-static bool finish_transmition(DataList *list, int client_fd, int fds_index)
+static bool finish_transmition(DataList *list, int client_fd)
 {
-    fds[fds_index].events &= ~POLLIN;
+    get_header(client_fd)->draining = true;
+    set_events(client_fd, get_header(client_fd)->events & ~POLLIN);
 
     bool empty = !list->first;
 
@@ -785,7 +4100,7 @@ static bool finish_transmition(DataList *list, int client_fd, int fds_index)
         return true;
     }
 
-    Data *data = malloc(sizeof(Data));
+    Data *data = new_data(0);
 
     if (!data)
     {
@@ -802,28 +4117,104 @@ static bool finish_transmition(DataList *list, int client_fd, int fds_index)
     return false;
 }
 
-static void free_data(Data *data)
+static Data *new_chunk(int *buffer_index)
 {
+    *buffer_index = -1;
+
+    if (!loop->free_file_count)
+    {
+        return new_data(FILE_CHUNK_SIZE);
+    }
+
+    Data *data = new_data(0);
     if (!data)
     {
-        return;
+        return NULL;
+    }
+
+    *buffer_index = loop->free_file_buffers[--loop->free_file_count];
+    data->data_class = FILE_BUFFER_CLASS;
+    buffer_init(&data->raw.buffer, FILE_CHUNK_SIZE, (uint8_t *)loop->file_buffers + *buffer_index * FILE_CHUNK_SIZE);
+
+    return data;
+}
+
+static Data *new_data(size_t payload)
+{
+    int data_class = 0;
+    while (data_class < DATA_CLASSES - 1 && data_classes[data_class] < payload)
+    {
+        data_class++;
+    }
+
+    // Too big to be inline, it goes apart
+    bool apart = payload > data_classes[data_class];
+    if (apart)
+    {
+        data_class = 0;
+    }
+
+    Data *data = pool_alloc(&loop->data_pools[data_class]);
+    if (!data)
+    {
+        return NULL;
     }
 
-    if (data->next)
+    data->type = RAW_DATA;
+    data->data_class = data_class;
+    data->next = NULL;
+    data->raw.ptr = NULL;
+
+    if (apart && !(data->raw.ptr = malloc(payload)))
     {
-        free_data(data->next);
+        pool_free(&loop->data_pools[0], data);
+        return NULL;
     }
 
+    buffer_init(&data->raw.buffer, payload, apart ? data->raw.ptr : (uint8_t *)(data + 1));
+
+    return data;
+}
+
+static void free_node(Data *data)
+{
     if (data->type == RAW_DATA)
     {
         free(data->raw.ptr);
     }
-    else if (data->type == MESSAGE_SPLITTER)
+
+    // The registered buffer is free for the next chunk, the node goes back to the first pool
+    if (data->data_class == FILE_BUFFER_CLASS)
     {
-        free_data(data->splitter.messages.first);
+        loop->free_file_buffers[loop->free_file_count++] = ((char *)data->raw.buffer.data - loop->file_buffers) / FILE_CHUNK_SIZE;
+        data->data_class = 0;
     }
 
-    free(data);
+    pool_free(&loop->data_pools[data->data_class], data);
+}
+
+static void free_data(Data *data)
+{
+    while (data)
+    {
+        Data *next = data->next;
+
+        // The branch is freed before the rest of the list, without recursion
+        if (data->type == MESSAGE_SPLITTER && data->splitter.messages.first)
+        {
+            Data *last = data->splitter.messages.first;
+            while (last->next)
+            {
+                last = last->next;
+            }
+
+            last->next = next;
+            next = data->splitter.messages.first;
+        }
+
+        free_node(data);
+        data = next;
+    }
 }
 
 static size_t ipv6_to_str_unexpanded(char str[40], const struct in6_addr *addr)
@@ -0,0 +1,91 @@
+#include <pool.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Every object keeps the alignment malloc would give it
+#define ALIGNMENT alignof(max_align_t)
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/**
+ * @brief Allocate a slab and add its objects to the free list
+ *
+ * @param target
+ * @return true The pool has free objects.
+ * @return false Memory ran out.
+ */
+static bool grow_pool(pool *target);
+
+void init_pool(pool *target, size_t object_size)
+{
+    target->object_size = ALIGN(object_size < sizeof(void *) ? sizeof(void *) : object_size);
+    target->slab_objects = (POOL_SLAB_SIZE - ALIGN(sizeof(pool_slab))) / target->object_size;
+
+    if (!target->slab_objects)
+    {
+        target->slab_objects = 1;
+    }
+
+    target->free = NULL;
+    target->slabs = NULL;
+}
+
+void *pool_alloc(pool *target)
+{
+    if (!target->free && !grow_pool(target))
+    {
+        return NULL;
+    }
+
+    void *object = target->free;
+    target->free = *(void **)object;
+
+    return object;
+}
+
+void pool_free(pool *target, void *object)
+{
+    if (!object)
+    {
+        return;
+    }
+
+    *(void **)object = target->free;
+    target->free = object;
+}
+
+void destroy_pool(pool *target)
+{
+    pool_slab *slab = target->slabs;
+
+    while (slab)
+    {
+        pool_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    target->free = NULL;
+    target->slabs = NULL;
+}
+
+static bool grow_pool(pool *target)
+{
+    pool_slab *slab = malloc(ALIGN(sizeof(pool_slab)) + target->slab_objects * target->object_size);
+    if (!slab)
+    {
+        return false;
+    }
+
+    slab->next = target->slabs;
+    target->slabs = slab;
+
+    // Linked backwards, so the objects are handed out in address order
+    char *objects = (char *)slab + ALIGN(sizeof(pool_slab));
+    for (size_t i = target->slab_objects; i > 0; i--)
+    {
+        pool_free(target, objects + (i - 1) * target->object_size);
+    }
+
+    return true;
+}
@@ -1,18 +1,29 @@
 #include <pop.h>
 
+#include <closed_hashing.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fd_table.h>
+#include <limits.h>
 #include <log_reader.h>
 #include <logger.h>
-#include <magic.h>
+#include <mail_cache.h>
+#include <mail_index.h>
 #include <management_config.h>
 #include <math.h>
 #include <pthread.h>
 #include <pop_config.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -30,29 +41,61 @@
 
 #define POP_MIN(x) fmin((x), MAX_POP3_RESPONSE_LENGTH)
 
+// Append a string literal to a response
+#define APPEND(builder, s) aappend((builder), (s), sizeof(s) - 1)
+
 #define MAX_CLIENT_MAILS 0x1000
 
+// RFC 1939 caps the unique IDs to 70 characters
+#define MAX_UID_LENGTH 70
+
+#define MAIL_BIT(i) ((uint64_t)1 << ((i) % 64))
+
 #define MAX_ADMIN_CONNECTIONS 10
 
+// The first four bytes of a command verb as an integer, a 3 letter verb ends with 0
+#define VERB(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+#define CASE_FOLD_MASK 0xDFDFDFDFu
+
+// The transformer that leaves the mails untouched, served without processes
+#define IDENTITY_TRANSFORMER "cat"
+
 /**
- * @brief The mail information for a client connection.
+ * @brief The mails of a client connection, a snapshot of the mailbox listing.
+ * @note The listing may be shared with the mailbox cache and is never modified,
+ * the deletions of the session are kept apart in its own bitmap.
  */
-typedef struct Mailfile
+typedef struct Mailbox
 {
     /**
-     * @brief The mail unique ID and filename
+     * @brief The listing the arrays below belong to, NULL if the mails are not loaded
      */
-    char uid[256];
+    mail_listing *listing;
+    size_t count;
     /**
-     * @brief If the mail is marked for deletion by the client
-     * @note The mails are not deleted until the client enters the UPDATE state
+     * @brief The size of all the mails, deleted or not
      */
-    bool deleted;
+    size_t total_size;
     /**
-     * @brief The mail size in bytes
+     * @brief The number of mails not marked for deletion
+     * @note Kept up to date by DELE and RSET, so STAT doesn't walk the mails
      */
-    size_t size;
-} Mailfile;
+    size_t live_count;
+    /**
+     * @brief The size of the mails not marked for deletion
+     */
+    size_t live_size;
+    const uint64_t *sizes;
+    /**
+     * @brief One bit per mail, set if it's marked for deletion by the client
+     * @note The mails are not deleted until the client enters the UPDATE state
+     */
+    uint64_t *deleted;
+    const uint32_t *name_offsets;
+    const uint8_t *name_lengths;
+    const uint8_t *uid_lengths;
+    const char *names;
+} Mailbox;
 
 /**
  * @brief The client connection information.
@@ -61,8 +104,13 @@ typedef struct Connection
 {
     /**
      * @brief The client buffer for incomplete commands
+     * @note Only the commands split between two messages are copied here.
      */
     char buffer[CONNECTION_BUFFER_SIZE];
+    /**
+     * @brief The bytes of the incomplete command in the buffer
+     */
+    size_t buffered;
     /**
      * @brief The client username
      * @note This fields MUST ALWAYS contain safe usernames (see safe_username())
@@ -80,14 +128,50 @@ typedef struct Connection
     /**
      * @brief The client mails (loaded after the AUTHORIZATION state)
      */
-    Mailfile *mails;
+    Mailbox mailbox;
+} Connection;
+
+/**
+ * @brief A mail being byte-stuffed straight from its mapped file.
+ * @note Reading a mapped page past the end of the file raises SIGBUS. Maildir
+ * mails are never rewritten in place (they are delivered through tmp/, then
+ * only renamed or unlinked), but another tool may break the rule, so the
+ * mail is only read with the fault guarded (see mail_fault).
+ */
+typedef struct StuffedMail
+{
     /**
-     * @brief The number of mails in the client mails array
+     * @brief The mail content, NULL if the mail is empty
      */
-    size_t mail_count;
-} Connection;
+    const char *map;
+    size_t map_size;
+    /**
+     * @brief The bytes to produce, lowered if the file is truncated
+     */
+    size_t size;
+    /**
+     * @brief The next byte to produce
+     */
+    size_t offset;
+    /**
+     * @brief If the next byte starts a line (and may need a dot)
+     */
+    bool line_start;
+    /**
+     * @brief If a CRLF replaces the LF that was just skipped
+     */
+    bool crlf;
+} StuffedMail;
 
-static Connection *connections[MAGIC_NUMBER] = {NULL};
+/**
+ * @brief The client connections, indexed by file descriptor.
+ * @note The connections live in the table, so they are reused with their
+ * descriptor instead of being allocated for each client.
+ * @note Each slot is only touched by the worker that owns the descriptor,
+ * and a descriptor number can't be reused until its connection is closed
+ * and the socket too, so the workers never share a slot.
+ */
+static fd_table *connections = NULL;
 
 /**
  * @brief The path to the bytestuffer program.
@@ -105,46 +189,103 @@ static statistics_manager *_stats;
 static char *success_login_log = "Logged in";
 static char *failed_login_log = "Failed loggin";
 
-static int active_managers = 0;
+static atomic_int active_managers = 0;
+
+/**
+ * @brief Where the worker jumps back to if the mail it's reading is truncated, NULL when it's not reading one.
+ */
+static __thread sigjmp_buf *mail_fault = NULL;
+
+/**
+ * @brief Recover from a truncated mail, or crash as usual for any other bus error.
+ *
+ * @param signal SIGBUS.
+ */
+static void handle_mail_fault(int signal)
+{
+    if (mail_fault)
+    {
+        siglongjmp(*mail_fault, 1);
+    }
+
+    // The faulting access is retried without the handler
+    sigaction(signal, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+}
 
 void pop_init(const char *bytestuffer, const int manager_fd, statistics_manager *stats)
 {
     stuffer = bytestuffer ? bytestuffer : "./dist/bytestuff";
     manager_server_fd = manager_fd;
     _stats = stats;
+    connections = new_fd_table(sizeof(Connection), get_fd_limit());
+
+    // The handler is left by jumping, so the signal must not stay blocked
+    struct sigaction action = {.sa_handler = handle_mail_fault, .sa_flags = SA_NODEFER};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
 }
 
 void pop_stop()
 {
+    free_fd_table(connections);
+    connections = NULL;
+    destroy_mail_cache();
     shutdown_pop_configs();
 }
 
 /**
- * @brief Parses a POP3 input, replacing spaces with null terminators.
- * Changes the POP3 command to UPPER CASE. Stops at a null terminator.
+ * @brief Recognize the verb of a POP3 input, from its first four bytes folded to upper case.
+ *
+ * @param cmd The input command.
+ * @param length The input length.
+ * @return uint32_t The verb, comparable with VERB(), or 0 if the first word is longer than 4 letters.
+ */
+static uint32_t parse_verb(const char *cmd, size_t length)
+{
+    if (length > 4 && cmd[3] != ' ' && cmd[4] != ' ')
+    {
+        return 0;
+    }
+
+    uint32_t verb = 0;
+    memcpy(&verb, cmd, length < 4 ? length : 4);
+
+    // Clearing the 0x20 bits folds the letters and turns the space after a 3 letter verb into 0
+    return le32toh(verb) & CASE_FOLD_MASK;
+}
+
+/**
+ * @brief Split the arguments after a verb, replacing spaces with null terminators.
  *
  * @note The input command is modified in place.
  *
- * @param cmd The input command.
+ * @param cmd The input command (NULL terminated).
+ * @param verb The verb returned by parse_verb.
+ * @param args Where to store the first argument.
  * @return int The number of arguments in the input (excluding the POP3 command).
  */
-static int parse_pop_cmd(char *cmd)
+static int split_args(char *cmd, uint32_t verb, char **args)
 {
-    int argc = 0;
-    while (*cmd)
+    // The last byte of a 3 letter verb is the folded space
+    size_t verb_length = verb >> 24 ? 4 : 3;
+
+    // Shorter words have no arguments, and their terminator may be before cmd[verb_length]
+    if (!(verb >> 16 & 0xFF) || cmd[verb_length] != ' ')
     {
-        if (*cmd == ' ')
-        {
-            argc++;
-            *cmd = 0;
-        }
+        *args = cmd + strlen(cmd);
+        return 0;
+    }
 
-        if (!argc)
+    *args = cmd + verb_length + 1;
+
+    int argc = 1;
+    for (char *c = *args; *c; c++)
+    {
+        if (*c == ' ')
         {
-            *cmd = toupper(*cmd);
+            argc++;
+            *c = 0;
         }
-
-        cmd++;
     }
 
     return argc;
@@ -159,7 +300,10 @@ static int parse_pop_cmd(char *cmd)
  */
 static bool user_exists(const char *username)
 {
-    return get_user(username) != NULL;
+    lock_users();
+    bool exists = get_user(username) != NULL;
+    unlock_users();
+    return exists;
 }
 
 /**
@@ -183,8 +327,11 @@ static bool admin_exists(const char *username)
  */
 static bool user_locked(const char *username)
 {
+    lock_users();
     User *user = get_user(username);
-    return user && user->locked;
+    bool locked = user && user->locked;
+    unlock_users();
+    return locked;
 }
 
 /**
@@ -221,22 +368,23 @@ static bool remove_lock(const char *username)
  */
 static bool pass_valid(const char *username, const char *pass)
 {
+    lock_users();
+
     User *user = get_user(username);
 
     if (!user)
     {
+        unlock_users();
         return false;
     }
 
     size_t pass_len = strlen(pass);
     size_t input_len = strlen(user->password);
 
-    if (pass_len != input_len)
-    {
-        return false;
-    }
+    bool valid = pass_len == input_len && !strcmp(user->password, pass);
 
-    return !strcmp(user->password, pass);
+    unlock_users();
+    return valid;
 }
 
 /**
@@ -268,26 +416,251 @@ static bool admin_pass_valid(const char *username, const char *pass)
 }
 
 /**
- * @brief Set the user emails in the client connection.
+ * @brief Give a session its snapshot of a listing, with no mail marked for deletion
  *
- * @param username The username (NULL terminated).
- * @param client The client connection.
- * @return true The mails were successfully loaded.
- * @return false The mails could not be loaded.
+ * @param mailbox The empty mailbox.
+ * @param listing The listing, its reference is taken by the mailbox.
+ * @return true The mails are loaded.
+ * @return false Memory ran out, the reference is dropped.
  */
-static bool set_user_mails(const char *username, Connection *client)
+static bool attach_listing(Mailbox *mailbox, mail_listing *listing)
 {
-    char *maildir = get_maildir();
+    uint64_t *deleted = calloc((listing->count + 63) / 64 + 1, sizeof(uint64_t));
+    if (!deleted)
+    {
+        release_mail_listing(listing);
+        return false;
+    }
 
-    char new_path[strlen(maildir) + sizeof("/") + MAX_USERNAME_LENGTH + sizeof("/new")];
-    snprintf(new_path, sizeof(new_path), "%s/%s/new", maildir, username);
+    mailbox->listing = listing;
+    mailbox->count = listing->count;
+    mailbox->total_size = listing->total_size;
+    mailbox->live_count = listing->count;
+    mailbox->live_size = listing->total_size;
+    mailbox->sizes = listing->sizes;
+    mailbox->deleted = deleted;
+    mailbox->name_offsets = listing->name_offsets;
+    mailbox->name_lengths = listing->name_lengths;
+    mailbox->uid_lengths = listing->uid_lengths;
+    mailbox->names = listing->names;
 
-    char cur_path[strlen(maildir) + sizeof("/") + MAX_USERNAME_LENGTH + sizeof("/cur")];
-    snprintf(cur_path, sizeof(cur_path), "%s/%s/cur", maildir, username);
+    return true;
+}
 
-    DIR *new_dir = opendir(new_path);
+/**
+ * @brief Release the snapshot of a mailbox, leaving it empty
+ *
+ * @param mailbox The mailbox, it may be empty.
+ */
+static void free_mailbox(Mailbox *mailbox)
+{
+    release_mail_listing(mailbox->listing);
+    free(mailbox->deleted);
+    memset(mailbox, 0, sizeof(Mailbox));
+}
+
+/**
+ * @brief Get the filename of a mail
+ *
+ * @param mailbox The mailbox.
+ * @param i The mail index (0-indexed).
+ * @return const char* The filename (NULL terminated).
+ */
+static inline const char *mail_name(const Mailbox *mailbox, size_t i)
+{
+    return mailbox->names + mailbox->name_offsets[i];
+}
+
+/**
+ * @brief If a mail is marked for deletion
+ *
+ * @param mailbox The mailbox.
+ * @param i The mail index (0-indexed).
+ * @return bool
+ */
+static inline bool mail_deleted(const Mailbox *mailbox, size_t i)
+{
+    return mailbox->deleted[i / 64] & MAIL_BIT(i);
+}
+
+/**
+ * @brief Get the size of a mail from the ",S=<size>" field of its Maildir filename
+ *
+ * @param name The filename.
+ * @param length The filename length.
+ * @param size Where to store the size.
+ * @return true The filename has a valid size field.
+ * @return false The size must be read from the file.
+ */
+static bool size_hint(const char *name, size_t length, size_t *size)
+{
+    // The fields are between the unique name and the flags
+    const char *flags = memchr(name, ':', length);
+    const char *end = flags ? flags : name + length;
+
+    const char *field = memmem(name, end - name, ",S=", sizeof(",S=") - 1);
+    if (!field)
+    {
+        return false;
+    }
+
+    const char *digit = field + sizeof(",S=") - 1;
+    if (digit == end || !isdigit(*digit))
+    {
+        return false;
+    }
+
+    size_t value = 0;
+    for (; digit < end && isdigit(*digit); digit++)
+    {
+        if (value > (SIZE_MAX - 9) / 10)
+        {
+            return false;
+        }
+
+        value = value * 10 + (*digit - '0');
+    }
+
+    if (digit != end && *digit != ',')
+    {
+        return false;
+    }
+
+    *size = value;
+    return true;
+}
+
+/**
+ * @brief A mail of the index, looked up by filename while cur/ is listed again
+ */
+typedef struct IndexedMail
+{
+    const char *name;
+    uint64_t size;
+} IndexedMail;
+
+static uint64_t hash_indexed_mail(const void *element)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = (const unsigned char *)((const IndexedMail *)element)->name; *c; c++)
+    {
+        hash = (hash ^ *c) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static char equal_indexed_mails(const void *a, const void *b)
+{
+    return !strcmp(((const IndexedMail *)a)->name, ((const IndexedMail *)b)->name);
+}
+
+static void keep_indexed_mail(void *element)
+{
+    // The mails belong to an array, freed all at once
+    (void)element;
+}
+
+/**
+ * @brief The mails moved from new/ to cur/ by a login
+ */
+typedef struct MovedMails
+{
+    size_t count;
+    /**
+     * @brief Their filenames in cur/, NULL terminated one after the other
+     */
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    /**
+     * @brief If a filename couldn't be kept, cur/ must be listed instead
+     */
+    bool lost;
+} MovedMails;
+
+/**
+ * @brief Keep the filename of a mail moved to cur/
+ *
+ * @param moved The moved mails.
+ * @param name The filename in cur/ (NULL terminated).
+ * @return true The filename was kept.
+ * @return false Memory ran out.
+ */
+static bool add_moved_mail(MovedMails *moved, const char *name)
+{
+    size_t size = strlen(name) + 1;
+
+    if (moved->names_size + size > moved->names_capacity)
+    {
+        size_t capacity = moved->names_capacity ? moved->names_capacity * 2 : 1024;
+        while (capacity < moved->names_size + size)
+        {
+            capacity *= 2;
+        }
+
+        char *names = realloc(moved->names, capacity);
+        if (!names)
+        {
+            return false;
+        }
+
+        moved->names = names;
+        moved->names_capacity = capacity;
+    }
+
+    memcpy(moved->names + moved->names_size, name, size);
+    moved->names_size += size;
+    moved->count++;
+
+    return true;
+}
+
+/**
+ * @brief Move the mails in new/ to cur/, marking them as seen
+ * @note new/ is only listed if it changed since it was indexed.
+ *
+ * @param user_fd The mailbox directory.
+ * @param cur_fd The cur/ directory.
+ * @param index The current index, NULL if there is none.
+ * @param stamp Where to stamp new/, before it's listed.
+ * @param clean Where to store if new/ didn't change since it was indexed.
+ * @param moved Where to keep the filenames of the moved mails, if it isn't NULL.
+ * @return true The new mails are in cur/.
+ * @return false new/ couldn't be read or a mail couldn't be moved.
+ */
+static bool move_new_mails(int user_fd, int cur_fd, const mail_index *index, mail_index_stamp *stamp, bool *clean, MovedMails *moved)
+{
+    *clean = false;
+
+    int new_fd = openat(user_fd, "new", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (new_fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(new_fd, &st) < 0)
+    {
+        close(new_fd);
+        return false;
+    }
+
+    // Stamped before listing it, a mail delivered meanwhile changes it again
+    stamp_mail_dir(stamp, &st);
+
+    if (index && mail_dir_matches(&index->header->new_dir, &st))
+    {
+        *clean = true;
+        close(new_fd);
+        return true;
+    }
+
+    DIR *new_dir = fdopendir(new_fd);
     if (!new_dir)
     {
+        close(new_fd);
         return false;
     }
 
@@ -299,72 +672,366 @@ static bool set_user_mails(const char *username, Connection *client)
             continue;
         }
 
-        char new_filepath[strlen(new_path) + sizeof("/") + sizeof(entry->d_name)];
-        snprintf(new_filepath, sizeof(new_filepath), "%s/%s", new_path, entry->d_name);
+        char cur_name[sizeof(entry->d_name) + sizeof(":2,S")];
+        snprintf(cur_name, sizeof(cur_name), "%s:2,S", entry->d_name);
 
-        char cur_filepath[strlen(cur_path) + sizeof("/") + sizeof(entry->d_name) + sizeof(":2,S")];
-        snprintf(cur_filepath, sizeof(cur_filepath), "%s/%s:2,S", cur_path, entry->d_name);
-
-        if (rename(new_filepath, cur_filepath))
+        if (renameat(new_fd, entry->d_name, cur_fd, cur_name))
         {
             closedir(new_dir);
             return false;
         }
+
+        if (moved && !moved->lost && !add_moved_mail(moved, cur_name))
+        {
+            moved->lost = true;
+        }
     }
 
     closedir(new_dir);
 
-    DIR *dir = opendir(cur_path);
+    return true;
+}
+
+/**
+ * @brief Load the mails of a mailbox from its index, without listing cur/
+ *
+ * @param index The index, up to date with cur/ before the new mails were moved.
+ * @param cur_fd The cur/ directory.
+ * @param moved The mails moved to cur/ since, they go after the indexed ones.
+ * @return mail_listing* The listing, or NULL if a moved mail is gone or memory ran out.
+ */
+static mail_listing *load_indexed_mails(const mail_index *index, int cur_fd, const MovedMails *moved)
+{
+    size_t indexed_count = index->header->count;
+    size_t indexed_size = index->header->names_size;
+
+    mail_listing *listing = new_mail_listing(indexed_count + moved->count, indexed_size + moved->names_size);
+    if (!listing)
+    {
+        return NULL;
+    }
+
+    memcpy(listing->sizes, index->sizes, indexed_count * sizeof(uint64_t));
+    memcpy(listing->name_lengths, index->name_lengths, indexed_count * sizeof(uint8_t));
+    memcpy(listing->names, index->names, indexed_size);
+
+    // Only the moved mails are looked at, like scan_mails would with a new mail
+    const char *moved_name = moved->names;
+    for (size_t i = indexed_count; i < indexed_count + moved->count; i++)
+    {
+        size_t length = strlen(moved_name);
+
+        size_t size;
+        struct stat buf;
+        if (!size_hint(moved_name, length, &size))
+        {
+            if (fstatat(cur_fd, moved_name, &buf, 0) < 0)
+            {
+                release_mail_listing(listing);
+                return NULL;
+            }
+
+            size = buf.st_size;
+        }
+
+        listing->sizes[i] = size;
+        listing->name_lengths[i] = length;
+
+        moved_name += length + 1;
+    }
+
+    if (moved->count)
+    {
+        memcpy(listing->names + indexed_size, moved->names, moved->names_size);
+    }
+
+    // The filenames follow each other, checked by open_mail_index or just moved
+    size_t offset = 0;
+    for (size_t i = 0; i < indexed_count + moved->count; i++)
+    {
+        const char *name = listing->names + offset;
+        size_t length = listing->name_lengths[i];
+
+        const char *splitter = memchr(name, ':', length);
+        size_t uid_length = splitter ? (size_t)(splitter - name) : 0;
+
+        listing->name_offsets[i] = offset;
+        listing->uid_lengths[i] = uid_length < MAX_UID_LENGTH ? uid_length : MAX_UID_LENGTH;
+        listing->total_size += listing->sizes[i];
+
+        offset += length + 1;
+    }
+
+    listing->count = indexed_count + moved->count;
+
+    return listing;
+}
+
+/**
+ * @brief List cur/ to load the mails of a mailbox
+ * @note The sizes are taken from the filenames or the index when possible,
+ * only the mails that are in neither are stat'ed.
+ *
+ * @param cur_fd The cur/ directory.
+ * @param index The last index, NULL if there is none.
+ * @return mail_listing* The listing, or NULL if cur/ couldn't be read or memory ran out.
+ */
+static mail_listing *scan_mails(int cur_fd, const mail_index *index)
+{
+    // Its own descriptor, closedir takes it
+    int dir_fd = openat(cur_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+    {
+        return NULL;
+    }
+
+    DIR *dir = fdopendir(dir_fd);
     if (!dir)
     {
-        return false;
+        close(dir_fd);
+        return NULL;
     }
 
-    size_t allocated = 4;
-    client->mail_count = 0;
-    client->mails = malloc(allocated * sizeof(Mailfile));
+    // A first pass to size the mailbox, the filenames are copied on the second one
+    size_t count = 0;
+    size_t names_size = 0;
 
-    while ((entry = readdir(dir)))
+    struct dirent *entry;
+    while (count < MAX_CLIENT_MAILS && (entry = readdir(dir)))
     {
         if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
         {
             continue;
         }
 
-        size_t i = client->mail_count;
+        names_size += strlen(entry->d_name) + 1;
+        count++;
+    }
 
-        memcpy(client->mails[i].uid, entry->d_name, sizeof(client->mails[i].uid));
-        client->mails[i].uid[sizeof(client->mails[i].uid) - 1] = 0;
+    mail_listing *listing = new_mail_listing(count, names_size);
+    if (!listing)
+    {
+        closedir(dir);
+        return NULL;
+    }
 
-        client->mails[i].deleted = false;
+    // The mails already indexed keep their sizes, only the new ones are looked at
+    IndexedMail *indexed = NULL;
+    hashset *known = NULL;
+    size_t indexed_count = index ? index->header->count : 0;
 
-        char filepath[strlen(cur_path) + sizeof("/") + sizeof(client->mails[i].uid)];
-        snprintf(filepath, sizeof(filepath), "%s/%s", cur_path, client->mails[i].uid);
+    if (indexed_count && (indexed = malloc(indexed_count * sizeof(IndexedMail))))
+    {
+        known = new_hashset(hash_indexed_mail, equal_indexed_mails, keep_indexed_mail, indexed_count * 2 + 1);
 
-        struct stat buf;
-        if (stat(filepath, &buf) < 0)
+        const char *name = index->names;
+        for (size_t i = 0; i < indexed_count; i++)
         {
-            closedir(dir);
-            return false;
+            indexed[i].name = name;
+            indexed[i].size = index->sizes[i];
+            hashset_add(known, indexed + i);
+
+            name += index->name_lengths[i] + 1;
         }
+    }
 
-        client->mails[i].size = buf.st_size;
+    rewinddir(dir);
 
-        if (++client->mail_count >= MAX_CLIENT_MAILS)
+    size_t used = 0;
+    bool loaded = true;
+
+    // The directory may have changed in between, whatever doesn't fit is left out
+    while (listing->count < count && (entry = readdir(dir)))
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+        {
+            continue;
+        }
+
+        size_t length = strlen(entry->d_name);
+        if (used + length + 1 > names_size)
         {
             break;
         }
 
-        if (client->mail_count >= allocated)
+        char *name = listing->names + used;
+        memcpy(name, entry->d_name, length + 1);
+
+        // The size written in the filename by the delivery agent saves the stat
+        size_t size;
+        if (!size_hint(name, length, &size))
         {
-            allocated *= 2;
-            client->mails = realloc(client->mails, allocated * sizeof(Mailfile));
+            IndexedMail key = {.name = name};
+            IndexedMail *mail = known ? hashset_get(known, &key) : NULL;
+
+            struct stat buf;
+            if (mail)
+            {
+                size = mail->size;
+            }
+            else if (fstatat(cur_fd, name, &buf, 0) < 0)
+            {
+                loaded = false;
+                break;
+            }
+            else
+            {
+                size = buf.st_size;
+            }
         }
+
+        size_t i = listing->count++;
+
+        listing->sizes[i] = size;
+        listing->total_size += size;
+        listing->name_offsets[i] = used;
+        listing->name_lengths[i] = length;
+
+        char *splitter = memchr(name, ':', length);
+        size_t uid_length = splitter ? (size_t)(splitter - name) : 0;
+        listing->uid_lengths[i] = uid_length < MAX_UID_LENGTH ? uid_length : MAX_UID_LENGTH;
+
+        used += length + 1;
     }
 
     closedir(dir);
 
-    return true;
+    if (known)
+    {
+        free_hashset(known);
+    }
+    free(indexed);
+
+    if (!loaded)
+    {
+        release_mail_listing(listing);
+        return NULL;
+    }
+
+    return listing;
+}
+
+/**
+ * @brief Load the listing of a mailbox from its directories
+ * @note The mailbox index spares listing and stat'ing the mails when cur/
+ * didn't change since the last session, the new mails are just added to it.
+ * It's refreshed otherwise.
+ *
+ * @param user_path The directory of the mailbox, locked by the session.
+ * @return mail_listing* The listing, or NULL if the mails could not be loaded.
+ */
+static mail_listing *load_user_mails(const char *user_path)
+{
+    // The mails are resolved relative to their directories, not walking the whole path each time
+    int user_fd = open(user_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (user_fd < 0)
+    {
+        return NULL;
+    }
+
+    int cur_fd = openat(user_fd, "cur", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cur_fd < 0)
+    {
+        close(user_fd);
+        return NULL;
+    }
+
+    mail_index index;
+    bool indexed = open_mail_index(&index, user_fd);
+
+    mail_index_header header;
+    memset(&header, 0, sizeof(header));
+
+    mail_listing *listing = NULL;
+
+    MovedMails moved;
+    memset(&moved, 0, sizeof(moved));
+
+    bool new_clean;
+    bool up_to_date = false;
+
+    // cur/ as it was indexed, before the new mails join it
+    struct stat cur_st;
+    bool cur_clean = indexed && !fstat(cur_fd, &cur_st) && index.header->count <= MAX_CLIENT_MAILS && mail_dir_matches(&index.header->cur_dir, &cur_st);
+
+    if (move_new_mails(user_fd, cur_fd, indexed ? &index : NULL, &header.new_dir, &new_clean, cur_clean ? &moved : NULL) && !fstat(cur_fd, &cur_st))
+    {
+        if (cur_clean && !moved.lost && (moved.count || mail_dir_matches(&index.header->cur_dir, &cur_st)) && index.header->count + moved.count <= MAX_CLIENT_MAILS)
+        {
+            // Only this session changed cur/ since, so the stamp after the moves holds
+            settle_mail_dir(&header.cur_dir, &cur_st);
+
+            up_to_date = !moved.count;
+            listing = load_indexed_mails(&index, cur_fd, &moved);
+        }
+
+        if (!listing)
+        {
+            // Stamped before listing it, like new/
+            stamp_mail_dir(&header.cur_dir, &cur_st);
+
+            up_to_date = false;
+            listing = scan_mails(cur_fd, indexed ? &index : NULL);
+        }
+    }
+
+    free(moved.names);
+
+    if (indexed)
+    {
+        close_mail_index(&index);
+    }
+
+    // Only the stamp of new/ may be outdated if nothing was listed
+    if (listing && !(up_to_date && new_clean))
+    {
+        header.count = listing->count;
+        header.names_size = listing->count ? listing->name_offsets[listing->count - 1] + listing->name_lengths[listing->count - 1] + 1 : 0;
+
+        if (!write_mail_index(user_fd, &header, listing->sizes, listing->name_lengths, listing->names))
+        {
+            LOG("Failed to write the index of %s\n", user_path);
+        }
+    }
+
+    close(cur_fd);
+    close(user_fd);
+
+    return listing;
+}
+
+/**
+ * @brief Set the user emails in the client connection.
+ * @note The listings are shared through the mailbox cache, the mailbox is
+ * only loaded again after it changes.
+ *
+ * @param username The username (NULL terminated).
+ * @param client The client connection.
+ * @return true The mails were successfully loaded.
+ * @return false The mails could not be loaded.
+ */
+static bool set_user_mails(const char *username, Connection *client)
+{
+    char *maildir = get_maildir();
+
+    char user_path[strlen(maildir) + sizeof("/") + MAX_USERNAME_LENGTH];
+    snprintf(user_path, sizeof(user_path), "%s/%s", maildir, username);
+
+    uint64_t ticket;
+    mail_listing *listing = mail_cache_get(user_path, &ticket);
+
+    if (!listing)
+    {
+        listing = load_user_mails(user_path);
+        if (!listing)
+        {
+            return false;
+        }
+
+        mail_cache_put(user_path, listing, ticket);
+    }
+
+    return attach_listing(&client->mailbox, listing);
 }
 
 /**
@@ -456,69 +1123,77 @@ static size_t handle_noop(char **response)
 }
 
 /**
- * @brief Handles a STAT command.
- *
- * @note The response must be freed by the caller.
+ * @brief Handles a CAPA command (RFC 2449).
+ * @note PIPELINING is advertised as the commands of a packet are
+ * all handled, and answered in a single write, when it arrives.
  *
- * @param client The client connection.
  * @param response The response to send back to the client.
  * @return size_t The length of the response.
  */
-static size_t handle_stat(Connection *client, char **response)
+static size_t handle_capa(char **response)
 {
-    size_t size = 0;
-    size_t count = 0;
+    *response = OK_RESPONSE(" Capability list follows") "USER" POP3_ENTER "UIDL" POP3_ENTER "PIPELINING" POP3_ENTER "." POP3_ENTER;
+    return sizeof(OK_RESPONSE(" Capability list follows") "USER" POP3_ENTER "UIDL" POP3_ENTER "PIPELINING" POP3_ENTER "." POP3_ENTER) - 1;
+}
 
-    for (size_t i = 0; i < client->mail_count; i++)
-    {
-        Mailfile mail = client->mails[i];
+/**
+ * @brief Handles a STAT command.
+ *
+ * @param client The client connection.
+ * @param client_fd The client file descriptor.
+ * @return KEEP_CONNECTION_OPEN always.
+ */
+static ON_MESSAGE_RESULT handle_stat(Connection *client, int client_fd)
+{
+    const Mailbox *mailbox = &client->mailbox;
 
-        if (!mail.deleted)
-        {
-            size += mail.size;
-            count++;
-        }
-    }
+    response_builder builder;
+    abegin(&builder, client_fd);
+
+    APPEND(&builder, POP3_OK " ");
+    aappend_number(&builder, mailbox->live_count);
+    APPEND(&builder, " ");
+    aappend_number(&builder, mailbox->live_size);
+    APPEND(&builder, POP3_ENTER);
 
-    char buffer[MAX_POP3_RESPONSE_LENGTH + 1];
-    size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, OK_RESPONSE(" %zu %zu"), count, size);
+    aend(&builder);
 
-    *response = strdup(buffer);
-    return POP_MIN(len);
+    return KEEP_CONNECTION_OPEN;
 }
 
 /**
  * @brief Handles a LIST command with arguments.
  *
  * @note Doesn't validate the message number is in range.
- * @note The response must be freed by the caller.
  *
  * @param client The client connection.
  * @param msg The message number to list (1-indexed).
- * @param response The response to send back to the client.
- * @return size_t The length of the response.
+ * @param client_fd The client file descriptor.
+ * @return KEEP_CONNECTION_OPEN always.
  */
-static size_t handle_list(Connection *client, size_t msg, char **response)
+static ON_MESSAGE_RESULT handle_list(Connection *client, size_t msg, int client_fd)
 {
-    Mailfile *mail = client->mails + (msg - 1);
+    const Mailbox *mailbox = &client->mailbox;
 
-    if (!mail->uid[0])
+    if (mail_deleted(mailbox, msg - 1))
     {
-        *response = ERR_RESPONSE(" No such message");
-        return sizeof(ERR_RESPONSE(" No such message")) - 1;
-    }
-
-    if (mail->deleted)
-    {
-        *response = ERR_RESPONSE(" Message already deleted");
-        return sizeof(ERR_RESPONSE(" Message already deleted")) - 1;
+        char response[] = ERR_RESPONSE(" Message already deleted");
+        asend(client_fd, response, sizeof(response) - 1);
+        return KEEP_CONNECTION_OPEN;
     }
 
-    char buffer[MAX_POP3_RESPONSE_LENGTH + 1];
-    size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, OK_RESPONSE(" %zu %zu"), msg, mail->size);
+    response_builder builder;
+    abegin(&builder, client_fd);
+
+    APPEND(&builder, POP3_OK " ");
+    aappend_number(&builder, msg);
+    APPEND(&builder, " ");
+    aappend_number(&builder, mailbox->sizes[msg - 1]);
+    APPEND(&builder, POP3_ENTER);
+
+    aend(&builder);
 
-    *response = strdup(buffer);
-    return POP_MIN(len);
+    return KEEP_CONNECTION_OPEN;
 }
 
 /**
@@ -532,41 +1207,33 @@ static size_t handle_list(Connection *client, size_t msg, char **response)
  */
 static ON_MESSAGE_RESULT handle_list_all(Connection *client, int client_fd)
 {
-    size_t size = 0;
-    size_t count = 0;
-
-    for (size_t i = 0; i < client->mail_count; i++)
-    {
-        Mailfile mail = client->mails[i];
+    const Mailbox *mailbox = &client->mailbox;
 
-        if (!mail.deleted)
-        {
-            size += mail.size;
-            count++;
-        }
-    }
-
-    char buffer[MAX_POP3_RESPONSE_LENGTH + 1];
-    size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, OK_RESPONSE(" %zu messages (%zu octets)"), count, size);
+    // The whole listing is formatted straight into the output, in one pass
+    response_builder builder;
+    abegin(&builder, client_fd);
 
-    asend(client_fd, buffer, POP_MIN(len));
+    APPEND(&builder, POP3_OK " ");
+    aappend_number(&builder, mailbox->live_count);
+    APPEND(&builder, " messages (");
+    aappend_number(&builder, mailbox->live_size);
+    APPEND(&builder, " octets)" POP3_ENTER);
 
-    for (size_t j = 0; j < client->mail_count; j++)
+    for (size_t i = 0; i < mailbox->count; i++)
     {
-        Mailfile mail = client->mails[j];
-
-        if (mail.deleted)
+        if (mail_deleted(mailbox, i))
         {
             continue;
         }
 
-        char buffer[MAX_POP3_RESPONSE_LENGTH + 1];
-        size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, "%zu %zu" POP3_ENTER, j + 1, mail.size);
-
-        asend(client_fd, buffer, POP_MIN(len));
+        aappend_number(&builder, i + 1);
+        APPEND(&builder, " ");
+        aappend_number(&builder, mailbox->sizes[i]);
+        APPEND(&builder, POP3_ENTER);
     }
 
-    asend(client_fd, "." POP3_ENTER, sizeof("." POP3_ENTER) - 1);
+    APPEND(&builder, "." POP3_ENTER);
+    aend(&builder);
 
     return KEEP_CONNECTION_OPEN;
 }
@@ -576,15 +1243,16 @@ static ON_MESSAGE_RESULT handle_list_all(Connection *client, int client_fd)
  *
  * @note I recommend reading this method from the bottom up
  *
- * @param filename The filename to retrieve.
+ * @param mail_fd The mail to retrieve, it's left open.
  * @return int The file descriptor to read the transformed file.
  */
-static int handle_retr_plumbing(char *filename)
+static int handle_retr_plumbing(int mail_fd)
 {
     char *transformer = get_transformer();
 
+    // Close on exec, so the RETRs of other workers don't keep the pipes open
     int output_pipes[2];
-    if (pipe(output_pipes))
+    if (pipe2(output_pipes, O_CLOEXEC))
     {
         return -1;
     }
@@ -600,7 +1268,7 @@ static int handle_retr_plumbing(char *filename)
         close(output_pipes[0]);
 
         int stuffer_pipes[2];
-        if (pipe(stuffer_pipes))
+        if (pipe2(stuffer_pipes, O_CLOEXEC))
         {
             _exit(EXIT_FAILURE);
         }
@@ -622,17 +1290,11 @@ static int handle_retr_plumbing(char *filename)
             _exit(EXIT_FAILURE);
         }
 
-        int fd = open(filename, O_RDONLY);
-
-        if (fd < 0)
-        {
-            _exit(EXIT_FAILURE);
-        }
-
         close(stuffer_pipes[0]);
         close(output_pipes[1]);
 
-        dup2(fd, STDIN_FILENO);
+        // The copy doesn't inherit close on exec
+        dup2(mail_fd, STDIN_FILENO);
         dup2(stuffer_pipes[1], STDOUT_FILENO);
 
         execlp(transformer, transformer, NULL);
@@ -643,6 +1305,177 @@ static int handle_retr_plumbing(char *filename)
     return output_pipes[0];
 }
 
+/**
+ * @brief Map a mail to byte-stuff it without the transformer processes.
+ *
+ * @param fd The mail file, it's closed.
+ * @return StuffedMail* The mapped mail, or NULL if it couldn't be read.
+ */
+static StuffedMail *open_stuffed_mail(int fd)
+{
+    struct stat st;
+    StuffedMail *mail = fstat(fd, &st) ? NULL : malloc(sizeof(StuffedMail));
+    if (!mail)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    mail->map = NULL;
+    mail->map_size = st.st_size;
+    mail->size = st.st_size;
+    mail->offset = 0;
+    mail->line_start = true;
+    mail->crlf = false;
+
+    // Empty files can't be mapped
+    if (mail->map_size)
+    {
+        void *map = mmap(NULL, mail->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            free(mail);
+            return NULL;
+        }
+
+        madvise(map, mail->map_size, MADV_SEQUENTIAL);
+        mail->map = map;
+    }
+
+    close(fd);
+    return mail;
+}
+
+/**
+ * @brief Cut the next segment of a mapped mail.
+ * @note The mail is only updated after the bytes of the segment are read,
+ * so a fault while reading them leaves it as it was.
+ *
+ * @param mail The mail.
+ * @param segment Where to store the segment start.
+ * @return size_t The segment length, 0 once the mail is finished.
+ */
+static size_t next_stuffed_segment(StuffedMail *mail, const char **segment)
+{
+    if (mail->crlf)
+    {
+        mail->crlf = false;
+        *segment = POP3_ENTER;
+        return sizeof(POP3_ENTER) - 1;
+    }
+
+    if (mail->offset == mail->size)
+    {
+        return 0;
+    }
+
+    const char *start = mail->map + mail->offset;
+    const char *end = mail->map + mail->size;
+
+    if (mail->line_start && *start == '.')
+    {
+        mail->line_start = false;
+        *segment = ".";
+        return 1;
+    }
+
+    const char *cursor = start;
+    while (cursor < end)
+    {
+        const char *lf = memchr(cursor, '\n', end - cursor);
+
+        // The last line has no ending
+        if (!lf)
+        {
+            cursor = end;
+            break;
+        }
+
+        // A bare LF, the segment stops before it and a CRLF follows
+        if (lf == start || lf[-1] != '\r')
+        {
+            mail->offset = lf + 1 - mail->map;
+            mail->line_start = true;
+
+            if (lf == start)
+            {
+                *segment = POP3_ENTER;
+                return sizeof(POP3_ENTER) - 1;
+            }
+
+            mail->crlf = true;
+            *segment = start;
+            return lf - start;
+        }
+
+        cursor = lf + 1;
+
+        if (cursor < end && *cursor == '.')
+        {
+            break;
+        }
+    }
+
+    mail->offset = cursor - mail->map;
+    mail->line_start = cursor[-1] == '\n';
+
+    *segment = start;
+    return cursor - start;
+}
+
+/**
+ * @brief Produce the next segment of a mapped mail, with the same output as the bytestuffer:
+ * the lines end with CRLF and the ones starting with a dot get another one.
+ * @note Implementation of produce_event handler.
+ * @note The segments point to the mapped file (or constants), the lines that
+ * are already compliant are produced together.
+ * @note If the file is truncated, the mail ends where it was left (the
+ * segments already produced from the lost pages fail the send instead).
+ *
+ * @param state The StuffedMail.
+ * @param segment Where to store the segment start.
+ * @return size_t The segment length, 0 once the mail is finished.
+ */
+static size_t produce_stuffed_mail(void *state, const char **segment)
+{
+    StuffedMail *mail = state;
+
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 0))
+    {
+        mail_fault = NULL;
+        LOG("Mail truncated while it was retrieved\n");
+
+        mail->size = mail->offset;
+        return 0;
+    }
+
+    mail_fault = &fault;
+    size_t length = next_stuffed_segment(mail, segment);
+    mail_fault = NULL;
+
+    return length;
+}
+
+/**
+ * @brief Unmap a stuffed mail.
+ * @note Implementation of release_event handler.
+ *
+ * @param state The StuffedMail.
+ */
+static void release_stuffed_mail(void *state)
+{
+    StuffedMail *mail = state;
+
+    if (mail->map)
+    {
+        munmap((void *)mail->map, mail->map_size);
+    }
+
+    free(mail);
+}
+
 /**
  * @brief Handles a RETR command.
  *
@@ -657,55 +1490,75 @@ static ON_MESSAGE_RESULT handle_retr(Connection *client, size_t msg, int client_
 {
     char *maildir = get_maildir();
 
-    Mailfile *mail = client->mails + (msg - 1);
-
-    if (!mail->uid[0])
-    {
-        char response[] = ERR_RESPONSE(" No such message");
-        asend(client_fd, response, sizeof(response) - 1);
-        return KEEP_CONNECTION_OPEN;
-    }
+    const Mailbox *mailbox = &client->mailbox;
 
-    if (mail->deleted)
+    if (mail_deleted(mailbox, msg - 1))
     {
         char response[] = ERR_RESPONSE(" Message already deleted");
         asend(client_fd, response, sizeof(response) - 1);
         return KEEP_CONNECTION_OPEN;
     }
 
-    char path[strlen(maildir) + sizeof("/") + MAX_USERNAME_LENGTH + sizeof("/cur/") + sizeof(mail->uid)];
-    snprintf(path, sizeof(path), "%s/%s/cur/%s", maildir, client->username, mail->uid);
+    char path[strlen(maildir) + sizeof("/") + MAX_USERNAME_LENGTH + sizeof("/cur/") + mailbox->name_lengths[msg - 1]];
+    snprintf(path, sizeof(path), "%s/%s/cur/%s", maildir, client->username, mail_name(mailbox, msg - 1));
 
-    if (access(path, F_OK))
+    // Opened once for whoever reads it, so it can't be swapped after being checked
+    int mail_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (mail_fd < 0)
     {
+        if (errno == ENOENT)
+        {
+            char response[] = ERR_RESPONSE(" No such message");
+            asend(client_fd, response, sizeof(response) - 1);
+            return KEEP_CONNECTION_OPEN;
+        }
+
         char response[] = ERR_RESPONSE(" Failed to read message");
         asend(client_fd, response, sizeof(response) - 1);
         return KEEP_CONNECTION_OPEN;
     }
 
-    int pipe = handle_retr_plumbing(path);
-    if (pipe < 0)
+    // Nothing to transform, the mail is stuffed without the plumbing
+    if (!strcmp(get_transformer(), IDENTITY_TRANSFORMER))
     {
-        char response[] = ERR_RESPONSE(" Internal error");
-        asend(client_fd, response, sizeof(response) - 1);
+        StuffedMail *stuffed = open_stuffed_mail(mail_fd);
+        if (!stuffed)
+        {
+            char response[] = ERR_RESPONSE(" Failed to read message");
+            asend(client_fd, response, sizeof(response) - 1);
+            return KEEP_CONNECTION_OPEN;
+        }
+
+        char buffer[] = OK_RESPONSE();
+        asend(client_fd, buffer, sizeof(buffer) - 1);
+
+        if (!pasend(client_fd, produce_stuffed_mail, release_stuffed_mail, stuffed))
+        {
+            release_stuffed_mail(stuffed);
+        }
+
+        asend(client_fd, POP3_ENTER "." POP3_ENTER, sizeof(POP3_ENTER "." POP3_ENTER) - 1);
+
         return KEEP_CONNECTION_OPEN;
     }
 
-    FILE *transformed = fdopen(pipe, "r");
-    if (!transformed)
+    int pipe = handle_retr_plumbing(mail_fd);
+    close(mail_fd);
+
+    if (pipe < 0)
     {
-        close(pipe);
         char response[] = ERR_RESPONSE(" Internal error");
         asend(client_fd, response, sizeof(response) - 1);
         return KEEP_CONNECTION_OPEN;
     }
 
-    setvbuf(transformed, NULL, _IONBF, 0);
-
     char buffer[] = OK_RESPONSE();
     asend(client_fd, buffer, sizeof(buffer) - 1);
 
-    fasend(client_fd, transformed, fclose);
+    if (!fasend(client_fd, pipe, close))
+    {
+        close(pipe);
+    }
     asend(client_fd, POP3_ENTER "." POP3_ENTER, sizeof(POP3_ENTER "." POP3_ENTER) - 1);
 
     return KEEP_CONNECTION_OPEN;
@@ -721,21 +1574,17 @@ static ON_MESSAGE_RESULT handle_retr(Connection *client, size_t msg, int client_
  */
 static size_t handle_dele(Connection *client, size_t msg, char **response)
 {
-    Mailfile *mail = client->mails + (msg - 1);
-
-    if (!mail->uid[0])
-    {
-        *response = ERR_RESPONSE(" No such message");
-        return sizeof(ERR_RESPONSE(" No such message")) - 1;
-    }
+    Mailbox *mailbox = &client->mailbox;
 
-    if (mail->deleted)
+    if (mail_deleted(mailbox, msg - 1))
     {
         *response = ERR_RESPONSE(" Message already deleted");
         return sizeof(ERR_RESPONSE(" Message already deleted")) - 1;
     }
 
-    mail->deleted = true;
+    mailbox->deleted[(msg - 1) / 64] |= MAIL_BIT(msg - 1);
+    mailbox->live_count--;
+    mailbox->live_size -= mailbox->sizes[msg - 1];
 
     *response = OK_RESPONSE(" Message deleted");
     return sizeof(OK_RESPONSE(" Message deleted")) - 1;
@@ -750,10 +1599,11 @@ static size_t handle_dele(Connection *client, size_t msg, char **response)
  */
 static size_t handle_rset(Connection *client, char **response)
 {
-    for (size_t i = 0; i < client->mail_count; i++)
-    {
-        client->mails[i].deleted = false;
-    }
+    Mailbox *mailbox = &client->mailbox;
+
+    memset(mailbox->deleted, 0, (mailbox->count + 63) / 64 * sizeof(uint64_t));
+    mailbox->live_count = mailbox->count;
+    mailbox->live_size = mailbox->total_size;
 
     *response = OK_RESPONSE(" Reversed deletes");
     return sizeof(OK_RESPONSE(" Reversed deletes")) - 1;
@@ -763,95 +1613,83 @@ static size_t handle_rset(Connection *client, char **response)
  * @brief Handles a UIDL command with arguments.
  *
  * @note Doesn't validate the message number is in range.
- * @note The response must be freed by the caller.
  *
  * @param client The client connection.
  * @param msg The message number to retrieve (1-indexed).
- * @param response The response to send back to the client.
- * @return size_t The length of the response.
+ * @param client_fd The client file descriptor.
+ * @return KEEP_CONNECTION_OPEN always.
  */
-static size_t handle_uidl(Connection *client, size_t msg, char **response)
+static ON_MESSAGE_RESULT handle_uidl(Connection *client, size_t msg, int client_fd)
 {
-    Mailfile mail = client->mails[msg - 1];
-
-    if (!mail.uid[0])
-    {
-        *response = ERR_RESPONSE(" No such message");
-        return sizeof(ERR_RESPONSE(" No such message")) - 1;
-    }
+    const Mailbox *mailbox = &client->mailbox;
 
-    if (mail.deleted)
+    if (mail_deleted(mailbox, msg - 1))
     {
-        *response = ERR_RESPONSE(" Message already deleted");
-        return sizeof(ERR_RESPONSE(" Message already deleted")) - 1;
+        char response[] = ERR_RESPONSE(" Message already deleted");
+        asend(client_fd, response, sizeof(response) - 1);
+        return KEEP_CONNECTION_OPEN;
     }
 
-    char *splitter = strchr(mail.uid, ':');
-
-    if (!splitter || mail.uid == splitter)
+    if (!mailbox->uid_lengths[msg - 1])
     {
-        *response = ERR_RESPONSE(" Internal error");
-        return sizeof(ERR_RESPONSE(" Internal error")) - 1;
+        char response[] = ERR_RESPONSE(" Internal error");
+        asend(client_fd, response, sizeof(response) - 1);
+        return KEEP_CONNECTION_OPEN;
     }
 
-    size_t index = splitter - mail.uid;
-
-    char *uid = strdup(mail.uid);
-    uid[index] = 0;
+    response_builder builder;
+    abegin(&builder, client_fd);
 
-    char *buffer = malloc(MAX_POP3_RESPONSE_LENGTH + 1);
-    size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, OK_RESPONSE(" %zu %.70s"), msg, uid);
+    APPEND(&builder, POP3_OK " ");
+    aappend_number(&builder, msg);
+    APPEND(&builder, " ");
+    aappend(&builder, mail_name(mailbox, msg - 1), mailbox->uid_lengths[msg - 1]);
+    APPEND(&builder, POP3_ENTER);
 
-    free(uid);
+    aend(&builder);
 
-    *response = buffer;
-    return POP_MIN(len);
+    return KEEP_CONNECTION_OPEN;
 }
 
 /**
- * @brief Handles a UIDL command with arguments.
+ * @brief Handles a UIDL command without arguments.
  *
  * @note Multi-line response, handles the sends internally.
  *
  * @param client The client connection.
- * @param response The response to send back to the client.
- * @return size_t The length of the response.
+ * @param client_fd The client file descriptor.
+ * @return KEEP_CONNECTION_OPEN always.
  */
 static ON_MESSAGE_RESULT handle_uidl_all(Connection *client, int client_fd)
 {
-    asend(client_fd, OK_RESPONSE(), sizeof(OK_RESPONSE()) - 1);
+    const Mailbox *mailbox = &client->mailbox;
 
-    for (size_t i = 0; i < client->mail_count; i++)
-    {
-        Mailfile mail = client->mails[i];
+    response_builder builder;
+    abegin(&builder, client_fd);
+
+    APPEND(&builder, OK_RESPONSE());
 
-        if (mail.deleted)
+    for (size_t i = 0; i < mailbox->count; i++)
+    {
+        if (mail_deleted(mailbox, i))
         {
             continue;
         }
 
-        char *splitter = strchr(mail.uid, ':');
-
-        if (!splitter || mail.uid == splitter)
+        if (!mailbox->uid_lengths[i])
         {
-            LOG("Unexpected filename format: %s", mail.uid);
+            LOG("Unexpected filename format: %s", mail_name(mailbox, i));
             continue;
         }
 
-        size_t index = splitter - mail.uid;
-
-        char *uid = strdup(mail.uid);
-        uid[index] = 0;
-
-        char buffer[MAX_POP3_RESPONSE_LENGTH + 1];
-        size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, "%zu %.70s" POP3_ENTER, i + 1, uid);
-
-        free(uid);
-
-        asend(client_fd, buffer, POP_MIN(len));
+        aappend_number(&builder, i + 1);
+        APPEND(&builder, " ");
+        aappend(&builder, mail_name(mailbox, i), mailbox->uid_lengths[i]);
+        APPEND(&builder, POP3_ENTER);
     }
 
-    asend(client_fd, "." POP3_ENTER, sizeof("." POP3_ENTER) - 1);
+    APPEND(&builder, "." POP3_ENTER);
+    aend(&builder);
 
     return KEEP_CONNECTION_OPEN;
 }
@@ -869,25 +1707,29 @@ static ON_MESSAGE_RESULT handle_uidl_all(Connection *client, int client_fd)
  */
 static ON_MESSAGE_RESULT handle_pop_authorization_state(Connection *client, int client_fd, char *body, size_t length, bool is_manager, const char *ip)
 {
-    char cmds[length + 1];
-    memcpy(cmds, body, length);
-    cmds[length] = 0;
-
-    int argc = parse_pop_cmd(cmds);
+    uint32_t verb = parse_verb(body, length);
 
     char *buffer;
 
-    if (!strcmp(cmds, "QUIT"))
+    if (verb == VERB('Q', 'U', 'I', 'T'))
     {
         // The "bye" message will be sent by the on_close event
         return CLOSE_CONNECTION;
     }
 
+    // Allowed between USER and PASS too
+    if (!is_manager && verb == VERB('C', 'A', 'P', 'A'))
+    {
+        size_t len = handle_capa(&buffer);
+        asend(client_fd, buffer, len);
+        return KEEP_CONNECTION_OPEN;
+    }
+
     if (client->username[0])
     {
-        if (!strcmp(cmds, "PASS"))
+        if (verb == VERB('P', 'A', 'S', 'S'))
         {
-            if (argc < 1)
+            if (body[4] != ' ')
             {
                 char response[] = ERR_RESPONSE(" Invalid number of arguments");
                 asend(client_fd, response, sizeof(response) - 1);
@@ -897,7 +1739,7 @@ static ON_MESSAGE_RESULT handle_pop_authorization_state(Connection *client, int
             bool before = client->authenticated;
             char username[MAX_USERNAME_LENGTH + 1];
             memcpy(username, client->username, sizeof(username));
-            // Spaces are accepted as part of the password, so don't use the parsed args
+            // Spaces are accepted as part of the password, so the arguments aren't split
             size_t len = handle_pass(client, body + 5, &buffer, is_manager);
             bool after = client->authenticated;
 
@@ -922,16 +1764,17 @@ static ON_MESSAGE_RESULT handle_pop_authorization_state(Connection *client, int
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "USER"))
+    if (verb == VERB('U', 'S', 'E', 'R'))
     {
-        if (argc != 1)
+        char *args;
+        if (split_args(body, verb, &args) != 1)
         {
             char response[] = ERR_RESPONSE(" Invalid number of arguments");
             asend(client_fd, response, sizeof(response) - 1);
             return KEEP_CONNECTION_OPEN;
         }
 
-        size_t len = handle_user(client, cmds + sizeof("USER"), &buffer);
+        size_t len = handle_user(client, args, &buffer);
         asend(client_fd, buffer, len);
         return KEEP_CONNECTION_OPEN;
     }
@@ -952,43 +1795,48 @@ static ON_MESSAGE_RESULT handle_pop_authorization_state(Connection *client, int
  */
 static ON_MESSAGE_RESULT handle_pop_transaction_state(Connection *client, int client_fd, char *body, size_t length)
 {
-    char cmds[length + 1];
-    strncpy(cmds, body, length);
-    cmds[length] = 0;
+    uint32_t verb = parse_verb(body, length);
 
-    int argc = parse_pop_cmd(cmds);
+    char *args;
+    int argc = split_args(body, verb, &args);
 
     char *buffer;
 
-    if (!strcmp(cmds, "QUIT"))
+    switch (verb)
+    {
+    case VERB('Q', 'U', 'I', 'T'):
     {
         client->update = true;
         return CLOSE_CONNECTION;
     }
 
-    if (!strcmp(cmds, "NOOP"))
+    case VERB('N', 'O', 'O', 'P'):
     {
         size_t len = handle_noop(&buffer);
         asend(client_fd, buffer, len);
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "STAT"))
+    case VERB('C', 'A', 'P', 'A'):
     {
-        size_t len = handle_stat(client, &buffer);
+        size_t len = handle_capa(&buffer);
         asend(client_fd, buffer, len);
-        free(buffer);
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "RSET"))
+    case VERB('S', 'T', 'A', 'T'):
+    {
+        return handle_stat(client, client_fd);
+    }
+
+    case VERB('R', 'S', 'E', 'T'):
     {
         size_t len = handle_rset(client, &buffer);
         asend(client_fd, buffer, len);
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "DELE"))
+    case VERB('D', 'E', 'L', 'E'):
     {
         if (argc != 1)
         {
@@ -997,12 +1845,12 @@ static ON_MESSAGE_RESULT handle_pop_transaction_state(Connection *client, int cl
             return KEEP_CONNECTION_OPEN;
         }
 
-        char *num = cmds + sizeof("DELE");
+        char *num = args;
 
         char *err;
         size_t msg = strtoull(num, &err, 10);
 
-        if (*err || !(0 < msg && msg <= client->mail_count) || !isdigit(*num))
+        if (*err || !(0 < msg && msg <= client->mailbox.count) || !isdigit(*num))
         {
             char response[] = ERR_RESPONSE(" Invalid message number");
             asend(client_fd, response, sizeof(response) - 1);
@@ -1014,7 +1862,7 @@ static ON_MESSAGE_RESULT handle_pop_transaction_state(Connection *client, int cl
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "LIST"))
+    case VERB('L', 'I', 'S', 'T'):
     {
         if (argc > 1)
         {
@@ -1028,25 +1876,22 @@ static ON_MESSAGE_RESULT handle_pop_transaction_state(Connection *client, int cl
             return handle_list_all(client, client_fd);
         }
 
-        char *num = cmds + sizeof("LIST");
+        char *num = args;
 
         char *err;
         size_t msg = strtoull(num, &err, 10);
 
-        if (*err || !(0 < msg && msg <= client->mail_count) || !isdigit(*num))
+        if (*err || !(0 < msg && msg <= client->mailbox.count) || !isdigit(*num))
         {
             char response[] = ERR_RESPONSE(" Invalid message number");
             asend(client_fd, response, sizeof(response) - 1);
             return KEEP_CONNECTION_OPEN;
         }
 
-        size_t len = handle_list(client, msg, &buffer);
-        asend(client_fd, buffer, len);
-        free(buffer);
-        return KEEP_CONNECTION_OPEN;
+        return handle_list(client, msg, client_fd);
     }
 
-    if (!strcmp(cmds, "RETR"))
+    case VERB('R', 'E', 'T', 'R'):
     {
         if (argc != 1)
         {
@@ -1055,12 +1900,12 @@ static ON_MESSAGE_RESULT handle_pop_transaction_state(Connection *client, int cl
             return KEEP_CONNECTION_OPEN;
         }
 
-        char *num = cmds + sizeof("RETR");
+        char *num = args;
 
         char *err;
         size_t msg = strtoull(num, &err, 10);
 
-        if (*err || !(0 < msg && msg <= client->mail_count) || !isdigit(*num))
+        if (*err || !(0 < msg && msg <= client->mailbox.count) || !isdigit(*num))
         {
             char response[] = ERR_RESPONSE(" Invalid message number");
             asend(client_fd, response, sizeof(response) - 1);
@@ -1070,7 +1915,7 @@ static ON_MESSAGE_RESULT handle_pop_transaction_state(Connection *client, int cl
         return handle_retr(client, msg, client_fd);
     }
 
-    if (!strcmp(cmds, "UIDL"))
+    case VERB('U', 'I', 'D', 'L'):
     {
         if (argc > 1)
         {
@@ -1084,22 +1929,23 @@ static ON_MESSAGE_RESULT handle_pop_transaction_state(Connection *client, int cl
             return handle_uidl_all(client, client_fd);
         }
 
-        char *num = cmds + sizeof("LIST");
+        char *num = args;
 
         char *err;
         size_t msg = strtoull(num, &err, 10);
 
-        if (*err || !(0 < msg && msg <= client->mail_count) || !isdigit(*num))
+        if (*err || !(0 < msg && msg <= client->mailbox.count) || !isdigit(*num))
         {
             char response[] = ERR_RESPONSE(" Invalid message number");
             asend(client_fd, response, sizeof(response) - 1);
             return KEEP_CONNECTION_OPEN;
         }
 
-        size_t len = handle_uidl(client, msg, &buffer);
-        asend(client_fd, buffer, len);
-        free(buffer);
-        return KEEP_CONNECTION_OPEN;
+        return handle_uidl(client, msg, client_fd);
+    }
+
+    default:
+        break;
     }
 
     char response[] = ERR_RESPONSE(" Invalid command");
@@ -1126,18 +1972,19 @@ static char *data_to_string(void *data)
  */
 static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd, char *body, size_t length)
 {
-    char cmds[length + 1];
-    strncpy(cmds, body, length);
-    cmds[length] = 0;
+    uint32_t verb = parse_verb(body, length);
 
-    int argc = parse_pop_cmd(cmds);
+    char *args;
+    int argc = split_args(body, verb, &args);
 
-    if (!strcmp(cmds, "QUIT"))
+    switch (verb)
+    {
+    case VERB('Q', 'U', 'I', 'T'):
     {
         return CLOSE_CONNECTION;
     }
 
-    if (!strcmp(cmds, "GET"))
+    case VERB('G', 'E', 'T', 0):
     {
         if (argc != 1)
         {
@@ -1146,7 +1993,7 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
             return KEEP_CONNECTION_OPEN;
         }
 
-        char *key = cmds + sizeof("GET");
+        char *key = args;
 
         if (!strcmp(key, "maildir"))
         {
@@ -1165,9 +2012,22 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
             asend(client_fd, buffer, len);
             return KEEP_CONNECTION_OPEN;
         }
+
+        if (!strcmp(key, "timeout") || !strcmp(key, "lifetime"))
+        {
+            unsigned int seconds = key[0] == 't' ? get_idle_timeout() : get_session_lifetime();
+
+            char buffer[MAX_POP3_RESPONSE_LENGTH + 1];
+            size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, OK_RESPONSE(" %u"), seconds);
+
+            asend(client_fd, buffer, len);
+            return KEEP_CONNECTION_OPEN;
+        }
+
+        break;
     }
 
-    if (!strcmp(cmds, "SET"))
+    case VERB('S', 'E', 'T', 0):
     {
         if (argc != 2)
         {
@@ -1176,7 +2036,7 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
             return KEEP_CONNECTION_OPEN;
         }
 
-        char *key = cmds + sizeof("SET");
+        char *key = args;
         char *value = key + strlen(key) + 1;
 
         if (!strcmp(key, "maildir"))
@@ -1196,9 +2056,38 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
             asend(client_fd, response, sizeof(response) - 1);
             return KEEP_CONNECTION_OPEN;
         }
+
+        if (!strcmp(key, "timeout") || !strcmp(key, "lifetime"))
+        {
+            // In seconds, 0 disables it
+            char *end;
+            unsigned long seconds = strtoul(value, &end, 10);
+
+            if (!isdigit(value[0]) || *end || seconds > UINT_MAX)
+            {
+                char response[] = ERR_RESPONSE(" Invalid number of seconds");
+                asend(client_fd, response, sizeof(response) - 1);
+                return KEEP_CONNECTION_OPEN;
+            }
+
+            if (key[0] == 't')
+            {
+                set_idle_timeout(seconds);
+            }
+            else
+            {
+                set_session_lifetime(seconds);
+            }
+
+            char response[] = OK_RESPONSE(" Timeout set");
+            asend(client_fd, response, sizeof(response) - 1);
+            return KEEP_CONNECTION_OPEN;
+        }
+
+        break;
     }
 
-    if (!strcmp(cmds, "ADD"))
+    case VERB('A', 'D', 'D', 0):
     {
         if (argc != 2)
         {
@@ -1207,10 +2096,10 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
             return KEEP_CONNECTION_OPEN;
         }
 
-        char *username = cmds + sizeof("ADD");
+        char *username = args;
         char *password = username + strlen(username) + 1;
 
-        bool edited = !!get_user(username);
+        bool edited = user_exists(username);
 
         if (set_user(username, password))
         {
@@ -1231,7 +2120,7 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "DELE"))
+    case VERB('D', 'E', 'L', 'E'):
     {
         if (argc != 1)
         {
@@ -1240,7 +2129,7 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
             return KEEP_CONNECTION_OPEN;
         }
 
-        char *username = cmds + sizeof("DELE");
+        char *username = args;
 
         if (delete_user(username))
         {
@@ -1254,7 +2143,7 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "LIST"))
+    case VERB('L', 'I', 'S', 'T'):
     {
         if (argc > 1)
         {
@@ -1265,61 +2154,69 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
 
         if (argc == 1)
         {
-            char *username = cmds + sizeof("LIST");
+            char *username = args;
 
-            User *user = get_user(username);
-            if (!user)
+            if (!user_exists(username))
             {
                 char response[] = ERR_RESPONSE(" User not found");
                 asend(client_fd, response, sizeof(response) - 1);
                 return KEEP_CONNECTION_OPEN;
             }
 
-            size_t count = get_user_logs_count(_stats, user->username);
+            response_builder builder;
+            abegin(&builder, client_fd);
 
-            char buffer[MAX_POP3_RESPONSE_LENGTH + 1];
-            size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, OK_RESPONSE(" %s %zu"), user->username, count);
+            APPEND(&builder, POP3_OK " ");
+            aappend(&builder, username, strlen(username));
+            APPEND(&builder, " ");
+            aappend_number(&builder, get_user_logs_count(_stats, username));
+            APPEND(&builder, POP3_ENTER);
 
-            asend(client_fd, buffer, len);
+            aend(&builder);
             return KEEP_CONNECTION_OPEN;
         }
 
+        response_builder builder;
+        abegin(&builder, client_fd);
+
+        APPEND(&builder, OK_RESPONSE());
+
+        lock_users();
+
         const User *users;
         size_t count = get_users_arr(&users);
 
-        asend(client_fd, OK_RESPONSE(), sizeof(OK_RESPONSE()) - 1);
-
         for (size_t i = 0; i < count; i++)
         {
-            char buffer[MAX_POP3_RESPONSE_LENGTH + 1];
-            size_t len = snprintf(buffer, MAX_POP3_RESPONSE_LENGTH, "%s" POP3_ENTER, users[i].username);
-            asend(client_fd, buffer, len);
+            aappend(&builder, users[i].username, strlen(users[i].username));
+            APPEND(&builder, POP3_ENTER);
         }
 
-        asend(client_fd, "." POP3_ENTER, sizeof("." POP3_ENTER) - 1);
+        unlock_users();
+
+        APPEND(&builder, "." POP3_ENTER);
+        aend(&builder);
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "STAT"))
+    case VERB('S', 'T', 'A', 'T'):
     {
-        char response[] = OK_RESPONSE();
-        asend(client_fd, response, sizeof(response) - 1);
+        response_builder builder;
+        abegin(&builder, client_fd);
 
-        char buffer[2048];
-        size_t len = snprintf(
-            buffer,
-            sizeof(buffer),
-            "Total connections:\t\t%zu" POP3_ENTER "Historical maximum traffic:\t%zu" POP3_ENTER "Total transferred bytes:\t%zu" POP3_ENTER,
-            read_historic_connections(_stats),
-            read_max_current_connections(_stats),
-            read_bytes_transferred(_stats));
+        APPEND(&builder, OK_RESPONSE() "Total connections:\t\t");
+        aappend_number(&builder, read_historic_connections(_stats));
+        APPEND(&builder, POP3_ENTER "Historical maximum traffic:\t");
+        aappend_number(&builder, read_max_current_connections(_stats));
+        APPEND(&builder, POP3_ENTER "Total transferred bytes:\t");
+        aappend_number(&builder, read_bytes_transferred(_stats));
+        APPEND(&builder, POP3_ENTER "." POP3_ENTER);
 
-        asend(client_fd, buffer, len);
-        asend(client_fd, "." POP3_ENTER, sizeof("." POP3_ENTER) - 1);
+        aend(&builder);
         return KEEP_CONNECTION_OPEN;
     }
 
-    if (!strcmp(cmds, "LOGS"))
+    case VERB('L', 'O', 'G', 'S'):
     {
         if (argc != 1)
         {
@@ -1328,44 +2225,51 @@ static ON_MESSAGE_RESULT handle_manager_state(Connection *client, int client_fd,
             return KEEP_CONNECTION_OPEN;
         }
 
-        char *username = cmds + sizeof("LOGS");
+        char *username = args;
 
-        User *user = get_user(username);
-        if (!user)
+        if (!user_exists(username))
         {
             char response[] = ERR_RESPONSE(" User not found");
             asend(client_fd, response, sizeof(response) - 1);
             return KEEP_CONNECTION_OPEN;
         }
 
-        char buffer[] = OK_RESPONSE();
-        asend(client_fd, buffer, sizeof(buffer) - 1);
+        response_builder builder;
+        abegin(&builder, client_fd);
 
+        APPEND(&builder, OK_RESPONSE());
+
+        // Every log of the user, from the oldest, a page at a time
         pop_log logs_buffer[64];
-        size_t count = get_user_logs_count(_stats, user->username);
-        do
+        size_t count = get_user_logs_count(_stats, username);
+
+        for (size_t start = 0; start < count; start += 64)
         {
-            memset(logs_buffer, 0, sizeof(logs_buffer));
-            get_user_logs(_stats, user->username, logs_buffer, 64);
+            size_t got = get_user_logs_range(_stats, username, logs_buffer, start, start + 64);
 
-            for (size_t j = 0; j < 64 && logs_buffer[j].username; j++)
+            for (size_t j = 0; j < got; j++)
             {
                 char *str = parse_log(logs_buffer[j], data_to_string);
-                asend(client_fd, str, strlen(str));
-                asend(client_fd, POP3_ENTER, sizeof(POP3_ENTER) - 1);
+                aappend(&builder, str, strlen(str));
+                APPEND(&builder, POP3_ENTER);
                 free(str);
             }
 
-            if (count > 64)
+            if (!got)
             {
-                count -= 64;
+                break;
             }
-        } while (count > 64);
+        }
 
-        asend(client_fd, "." POP3_ENTER, sizeof("." POP3_ENTER) - 1);
+        APPEND(&builder, "." POP3_ENTER);
+        aend(&builder);
         return KEEP_CONNECTION_OPEN;
     }
 
+    default:
+        break;
+    }
+
     char response[] = ERR_RESPONSE(" Invalid command");
     asend(client_fd, response, sizeof(response) - 1);
     return KEEP_CONNECTION_OPEN;
@@ -1405,21 +2309,36 @@ static ON_MESSAGE_RESULT handle_pop_single_cmd(Connection *client, int client_fd
 
 ON_MESSAGE_RESULT handle_pop_connect(int client_fd, struct sockaddr_in6 address, const int server_fd)
 {
-    if (server_fd == manager_server_fd && active_managers >= MAX_ADMIN_CONNECTIONS)
+    bool is_manager = server_fd == manager_server_fd;
+
+    // Reserve the slot first, so two workers can't take the last one
+    if (is_manager && atomic_fetch_add(&active_managers, 1) >= MAX_ADMIN_CONNECTIONS)
     {
+        atomic_fetch_sub(&active_managers, 1);
         return CONNECTION_ERROR;
     }
 
-    connections[client_fd] = calloc(1, sizeof(Connection));
+    Connection *client = connections ? fd_table_reserve(connections, client_fd) : NULL;
 
-    if (!connections[client_fd])
+    if (!client)
     {
+        if (is_manager)
+        {
+            atomic_fetch_sub(&active_managers, 1);
+        }
+
         return CONNECTION_ERROR;
     }
 
-    if (server_fd == manager_server_fd)
+    // The slot may have belonged to a previous client
+    client->buffered = 0;
+    client->username[0] = 0;
+    client->authenticated = false;
+    client->update = false;
+    memset(&client->mailbox, 0, sizeof(Mailbox));
+
+    if (is_manager)
     {
-        active_managers++;
         char response[] = OK_RESPONSE(" MSMP ready");
         asend(client_fd, response, sizeof(response) - 1);
         return KEEP_CONNECTION_OPEN;
@@ -1430,78 +2349,85 @@ ON_MESSAGE_RESULT handle_pop_connect(int client_fd, struct sockaddr_in6 address,
     return KEEP_CONNECTION_OPEN;
 }
 
-ON_MESSAGE_RESULT handle_pop_message(int client_fd, const char *body, size_t length, const int server_fd, const char *ip)
+ON_MESSAGE_RESULT handle_pop_message(int client_fd, char *body, size_t length, const int server_fd, const char *ip)
 {
     bool is_manager = server_fd == manager_server_fd;
 
-    Connection *client = connections[client_fd];
+    Connection *client = fd_table_get(connections, client_fd);
 
-    char buffer[length];
-    strncpy(buffer, body, length);
+    char *end = body + length;
+    // The start of the command being framed, and where the search for its end continues
+    char *line = body;
+    char *scan = body;
+    char *lf;
 
-    char *start_cmd = buffer;
-    for (size_t i = 0; i < length; i++)
+    while ((lf = memchr(scan, '\n', end - scan)))
     {
-        if (buffer + i != start_cmd && buffer[i - 1] == '\r' && buffer[i] == '\n')
-        {
-            buffer[i - 1] = 0;
+        scan = lf + 1;
 
-            char *data = start_cmd;
-            if (client->buffer[0])
-            {
-                // If the buffer is full, drop the connection
-                if (sizeof(client->buffer) - strlen(client->buffer) - 1 < length - (start_cmd - buffer))
-                {
-                    return CONNECTION_ERROR;
-                }
-
-                strncat(client->buffer, start_cmd, sizeof(client->buffer) - strlen(client->buffer) - 1);
-                data = client->buffer;
-            }
+        // The command started in a previous message if something is buffered
+        bool split = line == body && client->buffered;
+
+        // A lone LF is part of the command, only CRLF ends it
+        char before = lf > line ? lf[-1] : split ? client->buffer[client->buffered - 1] : 0;
+        if (before != '\r')
+        {
+            continue;
+        }
 
-            ON_MESSAGE_RESULT result = handle_pop_single_cmd(client, client_fd, data, strlen(data), is_manager, ip);
+        char *cmd = line;
+        size_t cmd_length = lf - line - 1;
 
-            client->buffer[0] = 0;
+        if (split)
+        {
+            size_t part = lf - body;
 
-            if (result != KEEP_CONNECTION_OPEN)
+            // If the buffer is full, drop the connection
+            if (client->buffered + part > sizeof(client->buffer))
             {
-                return result;
+                return CONNECTION_ERROR;
             }
 
-            start_cmd = buffer + i + 1;
+            memcpy(client->buffer + client->buffered, body, part);
+            cmd = client->buffer;
+            cmd_length = client->buffered + part - 1;
+            client->buffered = 0;
         }
-    }
 
-    // If there is a command left in the body, store it for the next message
-    if (start_cmd != buffer + length)
-    {
-        size_t before_len = strlen(client->buffer);
-        size_t remaining_len = length - (start_cmd - buffer);
+        // The CR is replaced, so the command is terminated where it was received
+        cmd[cmd_length] = 0;
+        line = scan;
 
-        // If the buffer is full, drop the connection
-        if (sizeof(client->buffer) - before_len - 1 < remaining_len)
+        ON_MESSAGE_RESULT result = handle_pop_single_cmd(client, client_fd, cmd, cmd_length, is_manager, ip);
+
+        if (result != KEEP_CONNECTION_OPEN)
         {
-            return CONNECTION_ERROR;
+            return result;
         }
-
-        strncpy(client->buffer + before_len, start_cmd, remaining_len);
-        client->buffer[before_len + remaining_len] = 0;
     }
-    else
+
+    // If there is a command left in the body, store it for the next message
+    size_t remaining = end - line;
+
+    // If the buffer is full, drop the connection
+    if (client->buffered + remaining >= sizeof(client->buffer))
     {
-        client->buffer[0] = 0;
+        return CONNECTION_ERROR;
     }
 
+    memcpy(client->buffer + client->buffered, line, remaining);
+    client->buffered += remaining;
+
     return KEEP_CONNECTION_OPEN;
 }
 
 void handle_pop_close(int client_fd, ON_MESSAGE_RESULT result, const int server_fd)
 {
-    Connection *client = connections[client_fd];
+    Connection *client = fd_table_get(connections, client_fd);
 
     if (server_fd == manager_server_fd)
     {
-        active_managers--;
+        atomic_fetch_sub(&active_managers, 1);
         goto COMMON_CONNECTIONS_CLOSE;
     }
 
@@ -1514,21 +2440,21 @@ void handle_pop_close(int client_fd, ON_MESSAGE_RESULT result, const int server_
     {
         char *maildir = get_maildir();
 
-        for (size_t i = 0; i < client->mail_count; i++)
-        {
-            Mailfile mail = client->mails[i];
+        const Mailbox *mailbox = &client->mailbox;
 
-            if (!mail.deleted)
+        for (size_t i = 0; i < mailbox->count; i++)
+        {
+            if (!mail_deleted(mailbox, i))
             {
                 continue;
             }
 
-            char path[strlen(maildir) + sizeof("/") + MAX_USERNAME_LENGTH + sizeof("/cur/") + sizeof(mail.uid)];
-            snprintf(path, sizeof(path), "%s/%s/cur/%s", maildir, client->username, mail.uid);
+            char path[strlen(maildir) + sizeof("/") + MAX_USERNAME_LENGTH + sizeof("/cur/") + mailbox->name_lengths[i]];
+            snprintf(path, sizeof(path), "%s/%s/cur/%s", maildir, client->username, mail_name(mailbox, i));
 
             if (remove(path) < 0)
             {
-                LOG("Failed to remove mail %s\n", mail.uid);
+                LOG("Failed to remove mail %s\n", mail_name(mailbox, i));
             }
         }
     }
@@ -1538,17 +2464,12 @@ void handle_pop_close(int client_fd, ON_MESSAGE_RESULT result, const int server_
         LOG("Failed to remove lock for %s\n", client->username);
     }
 
-    if (client->mails)
-    {
-        free(client->mails);
-    }
+    free_mailbox(&client->mailbox);
 
 COMMON_CONNECTIONS_CLOSE:
     // Privacy friendly
     memset(client->username, 0, sizeof(client->username));
 
-    free(client);
-
     if (result != CONNECTION_ERROR)
     {
         asend(client_fd, OK_RESPONSE(" Bye!"), sizeof(OK_RESPONSE(" Bye!")) - 1);
@@ -1,10 +1,15 @@
 #include <pop_config.h>
 #include <dirent.h>
 #include <common_config.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 static char *const _default_mail_dir = "./dist/mail";
 static char *_mail_dir = _default_mail_dir;
@@ -15,6 +20,43 @@ static char *_transformer = _default_transformer;
 static unsigned int _user_count = 0;
 static User _users[MAX_USERS] = {0};
 
+/**
+ * @brief Guards the users array and their lock flags
+ */
+static pthread_mutex_t _users_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Guards the maildir and transformer setters
+ */
+static pthread_mutex_t _config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Replaced configuration strings.
+ * @note Other workers may still be using them, so they are only freed on shutdown.
+ */
+typedef struct Retired
+{
+    char *value;
+    struct Retired *next;
+} Retired;
+
+static Retired *_retired = NULL;
+
+static void retire(char *value)
+{
+    Retired *node = malloc(sizeof(Retired));
+
+    // Leaking is better than a use after free
+    if (!node)
+    {
+        return;
+    }
+
+    node->value = value;
+    node->next = _retired;
+    _retired = node;
+}
+
 static struct sockaddr_in6 _pop_addr = {
     .sin6_family = AF_INET6,
     .sin6_port = POP_DEFAULT_PORT,
@@ -63,6 +105,16 @@ static void create_user_maildir(const char *base_maildir, const char *username)
 
 /**PUBLIC FUNCTIONS */
 
+void lock_users()
+{
+    pthread_mutex_lock(&_users_mutex);
+}
+
+void unlock_users()
+{
+    pthread_mutex_unlock(&_users_mutex);
+}
+
 char *get_maildir()
 {
     return _mail_dir;
@@ -123,22 +175,28 @@ void set_maildir(const char *new_maildir)
         return;
     }
 
+    pthread_mutex_lock(&_config_mutex);
+
     if (access(new_maildir, F_OK) == -1)
     {
         mkdir(new_maildir, S_IRWXU);
     }
 
+    pthread_mutex_lock(&_users_mutex);
     for (size_t i = 0; i < _user_count; i++)
     {
         create_user_maildir(new_maildir, _users[i].username);
     }
+    pthread_mutex_unlock(&_users_mutex);
 
     if (_mail_dir && _mail_dir != _default_mail_dir)
     {
-        free(_mail_dir);
+        retire(_mail_dir);
     }
 
     _mail_dir = strdup(new_maildir);
+
+    pthread_mutex_unlock(&_config_mutex);
 }
 
 void set_transformer(const char *transformer)
@@ -148,12 +206,16 @@ void set_transformer(const char *transformer)
         return;
     }
 
+    pthread_mutex_lock(&_config_mutex);
+
     if (_transformer && _transformer != _default_transformer)
     {
-        free(_transformer);
+        retire(_transformer);
     }
 
     _transformer = strdup(transformer);
+
+    pthread_mutex_unlock(&_config_mutex);
 }
 
 char set_user(const char *username, const char *password)
@@ -163,6 +225,8 @@ char set_user(const char *username, const char *password)
         return 1;
     }
 
+    pthread_mutex_lock(&_users_mutex);
+
     size_t i = 0;
     for (; i < _user_count; i++)
     {
@@ -178,6 +242,7 @@ char set_user(const char *username, const char *password)
     else if (_user_count < MAX_USERS)
     {
         _users[_user_count].locked = false;
+        _users[_user_count].lock_fd = -1;
         strncpy(_users[_user_count].password, password, MAX_PASSWORD_LENGTH);
         strncpy(_users[_user_count].username, username, MAX_USERNAME_LENGTH);
 
@@ -187,59 +252,115 @@ char set_user(const char *username, const char *password)
     }
     else
     {
+        pthread_mutex_unlock(&_users_mutex);
         return 2;
     }
+
+    pthread_mutex_unlock(&_users_mutex);
     return 0;
 }
 
 char delete_user(const char *username)
 {
+    pthread_mutex_lock(&_users_mutex);
+
     User *user = get_user(username);
     if (user == NULL)
     {
+        pthread_mutex_unlock(&_users_mutex);
         return 1;
     }
 
     if (user->locked)
     {
+        pthread_mutex_unlock(&_users_mutex);
         return 2; // The user is logged in so it can't be deleted
     }
 
     user->locked = _users[_user_count - 1].locked;
+    user->lock_fd = _users[_user_count - 1].lock_fd;
     strcpy(user->password, _users[_user_count - 1].password);
     strcpy(user->username, _users[_user_count - 1].username);
     _user_count--;
+
+    pthread_mutex_unlock(&_users_mutex);
     return 0;
 }
 
 char set_user_lock(const char *username)
 {
+    pthread_mutex_lock(&_users_mutex);
+
     User *user = get_user(username);
 
     if (user == NULL || user->locked)
     {
+        pthread_mutex_unlock(&_users_mutex);
         return 1;
     }
 
+    char path[strlen(_mail_dir) + sizeof("/") + MAX_USERNAME_LENGTH + sizeof("/lock")];
+    snprintf(path, sizeof(path), "%s/%s/lock", _mail_dir, username);
+
+    // Without a lock file the mailbox is only locked for this process
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        int error = errno;
+        close(fd);
+
+        // Another process has it
+        if (error == EWOULDBLOCK)
+        {
+            pthread_mutex_unlock(&_users_mutex);
+            return 1;
+        }
+
+        fd = -1;
+    }
+
     user->locked = true;
+    user->lock_fd = fd;
+
+    pthread_mutex_unlock(&_users_mutex);
     return 0;
 }
 
 char unset_user_lock(const char *username)
 {
+    pthread_mutex_lock(&_users_mutex);
+
     User *user = get_user(username);
 
     if (user == NULL)
     {
+        pthread_mutex_unlock(&_users_mutex);
         return 1;
     }
 
     user->locked = false;
+
+    if (user->lock_fd >= 0)
+    {
+        close(user->lock_fd);
+        user->lock_fd = -1;
+    }
+
+    pthread_mutex_unlock(&_users_mutex);
     return 0;
 }
 
 void shutdown_pop_configs()
 {
+    while (_retired)
+    {
+        Retired *next = _retired->next;
+        free(_retired->value);
+        free(_retired);
+        _retired = next;
+    }
+
     if (_mail_dir && _mail_dir != _default_mail_dir)
     {
         free(_mail_dir);
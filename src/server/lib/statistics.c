@@ -78,6 +78,7 @@ statistics_manager *create_statistics_manager()
     sm->logs_array = malloc(sizeof(pop_log) * BLOCK);
     sm->logs_array_dim = BLOCK;
     sm->logs_array_size = 0;
+    pthread_mutex_init(&sm->mutex, NULL);
     return sm;
 }
 
@@ -106,6 +107,7 @@ pop_log *new_log(char *username, char *ip, timestamp time, void *data, log_t typ
 
 void destroy_statistics_manager(statistics_manager *sm)
 {
+    pthread_mutex_destroy(&sm->mutex);
     free_hashset(sm->user_logs);
     free(sm);
 }
@@ -113,16 +115,18 @@ void destroy_statistics_manager(statistics_manager *sm)
 timestamp log_now()
 {
     time_t rawtime;
-    struct tm *timeinfo;
+    timestamp timeinfo;
 
     time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    return *timeinfo;
+    localtime_r(&rawtime, &timeinfo);
+    return timeinfo;
 }
 
 char *readable_time(timestamp t)
 {
-    char *s = asctime(&t);
+    // Each worker gets its own buffer, as asctime would share one
+    static __thread char s[32];
+    asctime_r(&t, s);
     *strstr(s, "\n") = 0;
     return s;
 }
@@ -143,51 +147,68 @@ void add_log_to_hashset(statistics_manager *sm, pop_log *l)
     sm->logs_array[sm->logs_array_size++] = l;
 }
 
-void log_bytes_transferred(statistics_manager *sm, char *username, char *ip, uint64_t bytes, timestamp time)
+void log_bytes_transferred(statistics_manager *sm, uint64_t bytes)
 {
+    pthread_mutex_lock(&sm->mutex);
     sm->transferred_bytes += bytes;
+    pthread_mutex_unlock(&sm->mutex);
 }
 void log_connect(statistics_manager *sm, char *username, char *ip, timestamp time)
 {
+    pop_log *l = new_log(username, ip, time, NULL, CONNECTION);
+    pthread_mutex_lock(&sm->mutex);
     sm->historic_connections++;
     sm->current_connections++;
     sm->max_current_connections = sm->max_current_connections < sm->current_connections ? sm->current_connections : sm->max_current_connections;
-    add_log_to_hashset(sm, new_log(username, ip, time, NULL, CONNECTION));
+    add_log_to_hashset(sm, l);
+    pthread_mutex_unlock(&sm->mutex);
 }
 void log_disconnect(statistics_manager *sm, char *username, char *ip, timestamp time)
 {
+    pop_log *l = new_log(username, ip, time, NULL, DISCONNECTION);
+    pthread_mutex_lock(&sm->mutex);
     sm->current_connections--;
-    add_log_to_hashset(sm, new_log(username, ip, time, NULL, DISCONNECTION));
+    add_log_to_hashset(sm, l);
+    pthread_mutex_unlock(&sm->mutex);
 }
 void log_other(statistics_manager *sm, char *username, char *ip, timestamp time, void *data)
 {
-    add_log_to_hashset(sm, new_log(username, ip, time, data, OTHER));
+    pop_log *l = new_log(username, ip, time, data, OTHER);
+    pthread_mutex_lock(&sm->mutex);
+    add_log_to_hashset(sm, l);
+    pthread_mutex_unlock(&sm->mutex);
 }
 
 uint64_t get_all_logs_count(statistics_manager *sm)
 {
-    return sm->logs_array_size;
+    pthread_mutex_lock(&sm->mutex);
+    uint64_t count = sm->logs_array_size;
+    pthread_mutex_unlock(&sm->mutex);
+    return count;
 }
 uint64_t get_user_logs_count(statistics_manager *sm, char *username)
 {
     user_logs dummy;
     dummy.username = username;
 
+    pthread_mutex_lock(&sm->mutex);
     user_logs *u_log = U_LOG(hashset_get(sm->user_logs, &dummy));
-    if (u_log == NULL)
-        return 0;
-    return u_log->logs_size;
+    uint64_t count = u_log == NULL ? 0 : u_log->logs_size;
+    pthread_mutex_unlock(&sm->mutex);
+    return count;
 }
 
 uint64_t get_all_logs_range(statistics_manager *sm, pop_log *log_buffer, uint64_t range_start, uint64_t range_end)
 {
-    uint64_t index = 0, aux = get_all_logs_count(sm);
-    if (range_end > aux)
-        range_end = aux;
+    uint64_t index = 0;
+    pthread_mutex_lock(&sm->mutex);
+    if (range_end > sm->logs_array_size)
+        range_end = sm->logs_array_size;
     for (uint64_t i = range_start; i < range_end; i++)
     {
-        log_buffer[i] = *(sm->logs_array[i]);
+        log_buffer[index++] = *(sm->logs_array[i]);
     }
+    pthread_mutex_unlock(&sm->mutex);
     return index;
 }
 uint64_t get_user_logs_range(statistics_manager *sm, char *username, pop_log *log_buffer, uint64_t range_start, uint64_t range_end)
@@ -195,17 +216,22 @@ uint64_t get_user_logs_range(statistics_manager *sm, char *username, pop_log *lo
     user_logs dummy;
     dummy.username = username;
 
+    pthread_mutex_lock(&sm->mutex);
     user_logs *u_log = U_LOG(hashset_get(sm->user_logs, &dummy));
     if (u_log == NULL)
+    {
+        pthread_mutex_unlock(&sm->mutex);
         return 0;
-    uint64_t i;
+    }
+    uint64_t index = 0;
     if (range_end > u_log->logs_size)
         range_end = u_log->logs_size;
-    for (i = range_start; i < u_log->logs_size && i < range_end; i++)
+    for (uint64_t i = range_start; i < range_end; i++)
     {
-        log_buffer[i] = *(u_log->logs[i]);
+        log_buffer[index++] = *(u_log->logs[i]);
     }
-    return i;
+    pthread_mutex_unlock(&sm->mutex);
+    return index;
 }
 
 uint64_t get_all_logs(statistics_manager *sm, pop_log *log_buffer, uint64_t log_buffer_size)
@@ -224,20 +250,32 @@ uint64_t get_user_logs(statistics_manager *sm, char *username, pop_log *log_buff
 
 uint64_t read_bytes_transferred(statistics_manager *sm)
 {
-    return sm->transferred_bytes;
+    pthread_mutex_lock(&sm->mutex);
+    uint64_t value = sm->transferred_bytes;
+    pthread_mutex_unlock(&sm->mutex);
+    return value;
 }
 
 uint64_t read_historic_connections(statistics_manager *sm)
 {
-    return sm->historic_connections;
+    pthread_mutex_lock(&sm->mutex);
+    uint64_t value = sm->historic_connections;
+    pthread_mutex_unlock(&sm->mutex);
+    return value;
 }
 
 uint64_t read_current_connections(statistics_manager *sm)
 {
-    return sm->current_connections;
+    pthread_mutex_lock(&sm->mutex);
+    uint64_t value = sm->current_connections;
+    pthread_mutex_unlock(&sm->mutex);
+    return value;
 }
 
 uint64_t read_max_current_connections(statistics_manager *sm)
 {
-    return sm->max_current_connections;
+    pthread_mutex_lock(&sm->mutex);
+    uint64_t value = sm->max_current_connections;
+    pthread_mutex_unlock(&sm->mutex);
+    return value;
 }
@@ -0,0 +1,196 @@
+#include <timer_wheel.h>
+#include <stddef.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define MAX_DELTA (((uint64_t)1 << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+/**
+ * @brief Put a timer in the slot matching its distance to the current tick
+ *
+ * @param wheel
+ * @param timer A timer that is not in the wheel, expiring at the current tick or later.
+ */
+static void link_timer(timer_wheel *wheel, timer_node *timer);
+/**
+ * @brief Take a timer out of its slot
+ *
+ * @param timer A timer in the wheel.
+ */
+static void unlink_timer(timer_node *timer);
+/**
+ * @brief Move the timers of a slot to the lower levels
+ *
+ * @param wheel
+ * @param level The level of the slot, at least 1.
+ * @param slot
+ */
+static void cascade(timer_wheel *wheel, int level, int slot);
+
+void init_timer_wheel(timer_wheel *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+        {
+            timer_node *head = &wheel->slots[level][slot];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+void timer_wheel_add(timer_wheel *wheel, timer_node *timer, uint64_t expires)
+{
+    if (timer_pending(timer))
+    {
+        unlink_timer(timer);
+    }
+    else
+    {
+        wheel->count++;
+    }
+
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    link_timer(wheel, timer);
+}
+
+void timer_wheel_remove(timer_wheel *wheel, timer_node *timer)
+{
+    if (!timer_pending(timer))
+    {
+        return;
+    }
+
+    unlink_timer(timer);
+    wheel->count--;
+}
+
+bool timer_pending(const timer_node *timer)
+{
+    return timer->next != NULL;
+}
+
+void timer_wheel_advance(timer_wheel *wheel, uint64_t now, timer_event expire)
+{
+    while (wheel->count && wheel->now < now)
+    {
+        uint64_t tick = ++wheel->now;
+
+        // When a level wraps, the current slot of the next one is due
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if (tick & (((uint64_t)1 << LEVEL_SHIFT(level)) - 1))
+            {
+                break;
+            }
+
+            cascade(wheel, level, (tick >> LEVEL_SHIFT(level)) & SLOT_MASK);
+        }
+
+        timer_node *head = &wheel->slots[0][tick & SLOT_MASK];
+
+        // The handler may add timers, but never to the current slot
+        while (head->next != head)
+        {
+            timer_node *timer = head->next;
+
+            unlink_timer(timer);
+            wheel->count--;
+
+            expire(timer);
+        }
+    }
+
+    // Nothing to expire, the wheel can jump to the current tick
+    if (wheel->now < now)
+    {
+        wheel->now = now;
+    }
+}
+
+int64_t timer_wheel_next(const timer_wheel *wheel)
+{
+    if (!wheel->count)
+    {
+        return -1;
+    }
+
+    for (int i = 1; i < TIMER_WHEEL_SLOTS; i++)
+    {
+        const timer_node *head = &wheel->slots[0][(wheel->now + i) & SLOT_MASK];
+
+        if (head->next != head)
+        {
+            return i;
+        }
+    }
+
+    // The timers are in the upper levels, wake up for the next cascade
+    return TIMER_WHEEL_SLOTS - (wheel->now & SLOT_MASK);
+}
+
+static void link_timer(timer_wheel *wheel, timer_node *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+
+    // The tick that picks the slot, timer->expires is never changed
+    uint64_t slot_tick = timer->expires;
+
+    // Too far away, it waits in the furthest slot of the last level.
+    // Each cascade places it again from its real expiry, until it's in range.
+    if (delta > MAX_DELTA)
+    {
+        delta = MAX_DELTA;
+        slot_tick = wheel->now + MAX_DELTA;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >> LEVEL_SHIFT(level + 1))
+    {
+        level++;
+    }
+
+    timer_node *head = &wheel->slots[level][(slot_tick >> LEVEL_SHIFT(level)) & SLOT_MASK];
+
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void unlink_timer(timer_node *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+static void cascade(timer_wheel *wheel, int level, int slot)
+{
+    timer_node *head = &wheel->slots[level][slot];
+
+    if (head->next == head)
+    {
+        return;
+    }
+
+    // Detach the list first, as the timers may be linked to this same slot again
+    timer_node *timer = head->next;
+    head->prev->next = NULL;
+    head->next = head;
+    head->prev = head;
+
+    while (timer)
+    {
+        timer_node *next = timer->next;
+
+        link_timer(wheel, timer);
+
+        timer = next;
+    }
+}
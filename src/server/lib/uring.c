@@ -0,0 +1,336 @@
+#include <uring.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The rings are shared with the kernel, their indexes are read and written atomically
+#define LOAD_ACQUIRE(p) atomic_load_explicit((_Atomic unsigned *)(p), memory_order_acquire)
+#define STORE_RELEASE(p, v) atomic_store_explicit((_Atomic unsigned *)(p), (v), memory_order_release)
+
+/**
+ * @brief Publish the entries got since the last submission
+ *
+ * @param ring
+ * @return unsigned The entries the kernel has not consumed yet.
+ */
+static unsigned publish_sqes(uring *ring);
+/**
+ * @brief Check that the kernel supports some operations (IORING_REGISTER_PROBE, Linux 5.6)
+ *
+ * @param ring
+ * @param opcodes The IORING_OP_* operations.
+ * @param count The number of operations.
+ * @return true Every operation is supported.
+ * @return false One isn't, or the kernel can't tell (errno is set).
+ */
+static bool supports_opcodes(uring *ring, const unsigned char *opcodes, size_t count);
+/**
+ * @brief Add a buffer at the tail of a provided buffer ring, without publishing it
+ *
+ * @param buffers
+ * @param id The buffer id.
+ * @param offset The position from the current tail.
+ */
+static void add_buffer(uring_buffers *buffers, unsigned short id, unsigned offset);
+
+bool init_uring(uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(uring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return false;
+    }
+
+    // Without it there is no way of waiting with a timeout that doesn't outlive the wait
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        close(ring->fd);
+        ring->fd = -1;
+        errno = ENOSYS;
+        return false;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map && ring->cq_map_size > ring->sq_map_size)
+    {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single_map ? ring->sq_map : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        int error = errno;
+        destroy_uring(ring);
+        errno = error;
+        return false;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_pending = *ring->sq_tail;
+
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // The entries are used in order, so each slot of the array always points to the same one
+    for (unsigned i = 0; i < ring->entries; i++)
+    {
+        ring->sq_array[i] = i;
+    }
+
+    return true;
+}
+
+bool uring_available(const unsigned char *opcodes, size_t count)
+{
+    uring ring;
+    uring_buffers buffers;
+
+    if (!init_uring(&ring, 2))
+    {
+        return false;
+    }
+
+    bool available = supports_opcodes(&ring, opcodes, count) && uring_provide_buffers(&ring, &buffers, 0, 1, 64);
+
+    if (available)
+    {
+        uring_release_buffers(&ring, &buffers);
+    }
+
+    destroy_uring(&ring);
+    return available;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *ring)
+{
+    if (ring->sq_pending - LOAD_ACQUIRE(ring->sq_head) == ring->entries)
+    {
+        unsigned queued = publish_sqes(ring);
+
+        if (syscall(__NR_io_uring_enter, ring->fd, queued, 0, 0, NULL, 0) < 0 || ring->sq_pending - LOAD_ACQUIRE(ring->sq_head) == ring->entries)
+        {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_pending & *ring->sq_mask];
+    ring->sq_pending++;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int uring_wait(uring *ring, int timeout)
+{
+    unsigned queued = publish_sqes(ring);
+
+    struct __kernel_timespec ts = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+        .ts = timeout < 0 ? 0 : (uint64_t)(uintptr_t)&ts,
+    };
+
+    // EBUSY: the completions that overflowed must be read before submitting more
+    if (syscall(__NR_io_uring_enter, ring->fd, queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0)
+    {
+        return errno == ETIME || errno == EBUSY ? 0 : -1;
+    }
+
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == LOAD_ACQUIRE(ring->cq_tail))
+    {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring *ring)
+{
+    STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
+
+unsigned uring_ready(uring *ring)
+{
+    return LOAD_ACQUIRE(ring->cq_tail) - *ring->cq_head;
+}
+
+bool uring_provide_buffers(uring *ring, uring_buffers *buffers, unsigned short group, unsigned count, size_t size)
+{
+    memset(buffers, 0, sizeof(uring_buffers));
+
+    // The ring must be page aligned, and the slab is only backed once the kernel writes to it
+    buffers->ring_size = count * sizeof(struct io_uring_buf);
+    buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffers->slab_size = count * size;
+    buffers->slab = mmap(NULL, buffers->slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (buffers->ring == MAP_FAILED || buffers->slab == MAP_FAILED)
+    {
+        int error = errno;
+        uring_release_buffers(NULL, buffers);
+        errno = error;
+        return false;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)buffers->ring,
+        .ring_entries = count,
+        .bgid = group,
+    };
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int error = errno;
+        uring_release_buffers(NULL, buffers);
+        errno = error;
+        return false;
+    }
+
+    buffers->buffer_size = size;
+    buffers->count = count;
+    buffers->group = group;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        add_buffer(buffers, i, i);
+    }
+
+    atomic_store_explicit((_Atomic unsigned short *)&buffers->ring->tail, count, memory_order_release);
+    return true;
+}
+
+char *uring_buffer(uring_buffers *buffers, unsigned short id)
+{
+    return buffers->slab + id * buffers->buffer_size;
+}
+
+void uring_recycle_buffer(uring_buffers *buffers, unsigned short id)
+{
+    add_buffer(buffers, id, 0);
+
+    // Only this thread moves the tail, the kernel reads it
+    atomic_store_explicit((_Atomic unsigned short *)&buffers->ring->tail, buffers->ring->tail + 1, memory_order_release);
+}
+
+void uring_release_buffers(uring *ring, uring_buffers *buffers)
+{
+    // Without a ring the group was never registered
+    if (ring && buffers->count)
+    {
+        struct io_uring_buf_reg reg = {.bgid = buffers->group};
+        syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+
+    if (buffers->ring && buffers->ring != MAP_FAILED)
+    {
+        munmap(buffers->ring, buffers->ring_size);
+    }
+
+    if (buffers->slab && buffers->slab != MAP_FAILED)
+    {
+        munmap(buffers->slab, buffers->slab_size);
+    }
+
+    memset(buffers, 0, sizeof(uring_buffers));
+}
+
+bool uring_register_buffers(uring *ring, const struct iovec *iov, unsigned count)
+{
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+}
+
+void destroy_uring(uring *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+    {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+
+    if (ring->sq_map && ring->sq_map != MAP_FAILED)
+    {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+static unsigned publish_sqes(uring *ring)
+{
+    STORE_RELEASE(ring->sq_tail, ring->sq_pending);
+
+    return ring->sq_pending - LOAD_ACQUIRE(ring->sq_head);
+}
+
+static bool supports_opcodes(uring *ring, const unsigned char *opcodes, size_t count)
+{
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+
+    if (!probe)
+    {
+        return false;
+    }
+
+    bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+
+    for (size_t i = 0; supported && i < count; i++)
+    {
+        supported = opcodes[i] <= probe->last_op && probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED;
+
+        if (!supported)
+        {
+            errno = EOPNOTSUPP;
+        }
+    }
+
+    free(probe);
+    return supported;
+}
+
+static void add_buffer(uring_buffers *buffers, unsigned short id, unsigned offset)
+{
+    struct io_uring_buf *buf = &buffers->ring->bufs[(buffers->ring->tail + offset) & (buffers->count - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(buffers, id);
+    buf->len = buffers->buffer_size;
+    buf->bid = id;
+}
@@ -29,28 +29,46 @@ int main(int argc, const char *argv[])
 
     setup();
 
+    // The same command line starts the new process of an upgrade
+    set_upgrade_command((char *const *)argv);
+
     struct sockaddr_in6 address_pop = get_pop_adport();
+    struct sockaddr_in6 address_manager = get_manager_adport();
+    int manager_fd = -1;
 
-    int pop_fd = start_server(&address_pop);
-    if (pop_fd < 0)
+    // When upgrading, the servers come from the running process
+    int inherited = inherit_servers(&address_manager, &manager_fd);
+    if (inherited < 0)
     {
         return EXIT_FAILURE;
     }
 
-    add_server(pop_fd, &address_pop);
+    // Each worker accepts from its own socket
+    for (int i = 0; !inherited && i < get_workers(); i++)
+    {
+        int pop_fd = start_server(&address_pop);
+        if (pop_fd < 0)
+        {
+            return EXIT_FAILURE;
+        }
 
-    LOG("Server listening on port %d...\n", ntohs(address_pop.sin6_port));
+        add_server(pop_fd, &address_pop, i);
+    }
 
-    struct sockaddr_in6 address_manager = get_manager_adport();
+    LOG("Server listening on port %d...\n", ntohs(address_pop.sin6_port));
 
-    int manager_fd = start_server(&address_manager);
     if (manager_fd < 0)
     {
-        return EXIT_FAILURE;
+        manager_fd = start_server(&address_manager);
+        if (manager_fd < 0)
+        {
+            return EXIT_FAILURE;
+        }
+
+        // The administration must keep working when the POP3 workers are saturated
+        add_server(manager_fd, &address_manager, PRIORITY_WORKER);
     }
 
-    add_server(manager_fd, &address_manager);
-
     LOG("Manager listening on port %d...\n", ntohs(address_manager.sin6_port));
 
     statistics_manager *stats = create_statistics_manager();
@@ -75,6 +93,11 @@ static void sigint_handler(const int signal)
     sigterm_handler(signal);
 }
 
+static void sigusr2_handler(const int signal)
+{
+    request_upgrade();
+}
+
 static void sigchld_handler(const int signal)
 {
     waitpid(-1, NULL, WNOHANG);
@@ -86,4 +109,5 @@ static void setup()
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigterm_handler);
     signal(SIGCHLD, sigchld_handler);
+    signal(SIGUSR2, sigusr2_handler);
 }
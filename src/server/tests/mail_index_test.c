@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// asi se puede probar las funciones internas
+#include "mail_index.c"
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+static char dir_path[] = "/tmp/mail_index_test_XXXXXX";
+static int dir_fd = -1;
+
+static const uint64_t sizes[] = {55, 0, 1234567890123ULL};
+static const uint8_t name_lengths[] = {10, 5, 19};
+static const char names[] = "1.mail:2,S\0" "2.b:2\0" "3.c,S=1234567890123";
+
+static void create_dir(void) {
+    strcpy(dir_path, "/tmp/mail_index_test_XXXXXX");
+    ck_assert_ptr_nonnull(mkdtemp(dir_path));
+
+    dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ge(dir_fd, 0);
+}
+
+static void remove_dir(void) {
+    unlinkat(dir_fd, MAIL_INDEX_FILE, 0);
+    unlinkat(dir_fd, MAIL_INDEX_TEMP_FILE, 0);
+    close(dir_fd);
+    rmdir(dir_path);
+}
+
+static void write_sample(void) {
+    mail_index_header header;
+    memset(&header, 0, sizeof(header));
+
+    header.new_dir = (mail_index_stamp){.ino = 11, .sec = 1700000000, .nsec = 5};
+    header.cur_dir = (mail_index_stamp){.ino = 12, .sec = 1700000001, .nsec = 6};
+    header.count = N(sizes);
+    header.names_size = sizeof(names);
+
+    ck_assert_int_eq(true, write_mail_index(dir_fd, &header, sizes, name_lengths, names));
+}
+
+/**
+ * Overwrite part of the index file in place
+ */
+static void patch_index(off_t offset, const void *bytes, size_t length) {
+    int fd = openat(dir_fd, MAIL_INDEX_FILE, O_WRONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(length, pwrite(fd, bytes, length, offset));
+    close(fd);
+}
+
+static void truncate_index(off_t length) {
+    int fd = openat(dir_fd, MAIL_INDEX_FILE, O_WRONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(0, ftruncate(fd, length));
+    close(fd);
+}
+
+START_TEST (test_mail_index_round_trip) {
+    write_sample();
+
+    // The temporary file is renamed over the index
+    ck_assert_int_eq(-1, faccessat(dir_fd, MAIL_INDEX_TEMP_FILE, F_OK, 0));
+
+    mail_index index;
+    ck_assert_int_eq(true, open_mail_index(&index, dir_fd));
+
+    ck_assert_uint_eq(N(sizes), index.header->count);
+    ck_assert_uint_eq(sizeof(names), index.header->names_size);
+    ck_assert_uint_eq(11, index.header->new_dir.ino);
+    ck_assert_int_eq(1700000001, index.header->cur_dir.sec);
+    ck_assert_int_eq(6, index.header->cur_dir.nsec);
+
+    for (size_t i = 0; i < N(sizes); i++) {
+        ck_assert_uint_eq(sizes[i], index.sizes[i]);
+        ck_assert_uint_eq(name_lengths[i], index.name_lengths[i]);
+    }
+    ck_assert_int_eq(0, memcmp(names, index.names, sizeof(names)));
+    ck_assert_str_eq("2.b:2", index.names + 11);
+
+    close_mail_index(&index);
+    ck_assert_ptr_null(index.map);
+}
+END_TEST
+
+START_TEST (test_mail_index_empty) {
+    mail_index_header header;
+    memset(&header, 0, sizeof(header));
+
+    ck_assert_int_eq(true, write_mail_index(dir_fd, &header, NULL, NULL, NULL));
+
+    mail_index index;
+    ck_assert_int_eq(true, open_mail_index(&index, dir_fd));
+    ck_assert_uint_eq(0, index.header->count);
+    close_mail_index(&index);
+}
+END_TEST
+
+START_TEST (test_mail_index_missing) {
+    mail_index index;
+    ck_assert_int_eq(false, open_mail_index(&index, dir_fd));
+    ck_assert_ptr_null(index.map);
+}
+END_TEST
+
+START_TEST (test_mail_index_bad_magic) {
+    write_sample();
+    patch_index(0, "POP3IDX0", 8);
+
+    mail_index index;
+    ck_assert_int_eq(false, open_mail_index(&index, dir_fd));
+    ck_assert_ptr_null(index.map);
+}
+END_TEST
+
+START_TEST (test_mail_index_bad_count) {
+    write_sample();
+
+    // More mails than the file holds, and so many that the sizes would overflow
+    uint64_t counts[] = {N(sizes) + 1, UINT64_MAX / 8 + 1, UINT64_MAX};
+
+    for (size_t i = 0; i < N(counts); i++) {
+        patch_index(offsetof(mail_index_header, count), &counts[i], sizeof(uint64_t));
+
+        mail_index index;
+        ck_assert_int_eq(false, open_mail_index(&index, dir_fd));
+    }
+}
+END_TEST
+
+START_TEST (test_mail_index_bad_names) {
+    write_sample();
+
+    // A filename longer than its length says, the NULL terminators are off
+    uint8_t length = name_lengths[0] + 1;
+    off_t lengths_offset = sizeof(mail_index_header) + N(sizes) * sizeof(uint64_t);
+    patch_index(lengths_offset, &length, 1);
+
+    mail_index index;
+    ck_assert_int_eq(false, open_mail_index(&index, dir_fd));
+
+    // And a truncated file
+    write_sample();
+    truncate_index(sizeof(mail_index_header) - 1);
+    ck_assert_int_eq(false, open_mail_index(&index, dir_fd));
+
+    write_sample();
+    truncate_index(lengths_offset + N(sizes) + sizeof(names) - 1);
+    ck_assert_int_eq(false, open_mail_index(&index, dir_fd));
+}
+END_TEST
+
+START_TEST (test_mail_index_stamps) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = 42;
+
+    mail_index_stamp stamp;
+
+    // Changed right now, the next change may keep the same timestamp
+    clock_gettime(CLOCK_REALTIME, &st.st_mtim);
+    stamp_mail_dir(&stamp, &st);
+    ck_assert_uint_eq(0, stamp.ino);
+    ck_assert_int_eq(false, mail_dir_matches(&stamp, &st));
+
+    settle_mail_dir(&stamp, &st);
+    ck_assert_int_eq(true, mail_dir_matches(&stamp, &st));
+
+    st.st_mtim.tv_sec -= 2;
+    stamp_mail_dir(&stamp, &st);
+    ck_assert_uint_eq(42, stamp.ino);
+    ck_assert_int_eq(true, mail_dir_matches(&stamp, &st));
+
+    st.st_mtim.tv_nsec ^= 1;
+    ck_assert_int_eq(false, mail_dir_matches(&stamp, &st));
+}
+END_TEST
+
+Suite *
+suite(void) {
+    Suite *s   = suite_create("mail_index");
+    TCase *tc  = tcase_create("mail_index");
+
+    tcase_add_checked_fixture(tc, create_dir, remove_dir);
+    tcase_add_test(tc, test_mail_index_round_trip);
+    tcase_add_test(tc, test_mail_index_empty);
+    tcase_add_test(tc, test_mail_index_missing);
+    tcase_add_test(tc, test_mail_index_bad_magic);
+    tcase_add_test(tc, test_mail_index_bad_count);
+    tcase_add_test(tc, test_mail_index_bad_names);
+    tcase_add_test(tc, test_mail_index_stamps);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int
+main(void) {
+    SRunner *sr  = srunner_create(suite());
+    int number_failed;
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#include <netutils.h>
+
+// The responses are kept here instead of being queued in an event loop
+#define asend test_asend
+static void test_asend(int client_fd, const char *message, size_t length);
+
+// asi se puede probar las funciones internas
+#include "pop.c"
+
+#undef asend
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+#define CLIENT_FD 5
+#define SERVER_FD 3
+
+#define INVALID ERR_RESPONSE(" Invalid command")
+
+// Built by the top Makefile, the tests run from src/server
+#define BYTESTUFF "../../dist/bytestuff"
+
+static char output[8192];
+static size_t output_length;
+
+static void test_asend(int client_fd, const char *message, size_t length) {
+    ck_assert_int_eq(CLIENT_FD, client_fd);
+    ck_assert_uint_le(output_length + length, sizeof(output) - 1);
+
+    memcpy(output + output_length, message, length);
+    output_length += length;
+    output[output_length] = 0;
+}
+
+static void connect_client(void) {
+    if (!connections) {
+        pop_init(NULL, -1, NULL);
+    }
+
+    struct sockaddr_in6 address = {0};
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, handle_pop_connect(CLIENT_FD, address, SERVER_FD));
+
+    ck_assert_str_eq(OK_RESPONSE(" POP3 server ready"), output);
+    output_length = 0;
+    output[0] = 0;
+}
+
+static void disconnect_client(void) {
+    handle_pop_close(CLIENT_FD, CONNECTION_ERROR, SERVER_FD);
+    output_length = 0;
+    output[0] = 0;
+}
+
+/**
+ * Feed a message like the event loop does, the body is writable
+ */
+static ON_MESSAGE_RESULT feed(const char *message) {
+    char body[2048];
+    size_t length = strlen(message);
+    memcpy(body, message, length);
+
+    return handle_pop_message(CLIENT_FD, body, length, SERVER_FD, "::1");
+}
+
+START_TEST (test_framing_whole) {
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, feed("XYZ\r\nABC\r\n"));
+    ck_assert_str_eq(INVALID INVALID, output);
+}
+END_TEST
+
+START_TEST (test_framing_split_crlf) {
+    // The CR ends a message and its LF starts the next one
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, feed("XYZ\r"));
+    ck_assert_str_eq("", output);
+
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, feed("\nABC\r"));
+    ck_assert_str_eq(INVALID, output);
+
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, feed("\n"));
+    ck_assert_str_eq(INVALID INVALID, output);
+
+    // The buffered part is gone, QUIT is framed on its own
+    ck_assert_int_eq(CLOSE_CONNECTION, feed("QUIT\r\n"));
+}
+END_TEST
+
+START_TEST (test_framing_byte_by_byte) {
+    const char *input = "XYZ\r\nQUIT\r\n";
+    ON_MESSAGE_RESULT result = KEEP_CONNECTION_OPEN;
+
+    for (size_t i = 0; input[i]; i++) {
+        char byte[] = {input[i], 0};
+        result = feed(byte);
+
+        if (i < 4) {
+            ck_assert_str_eq("", output);
+        }
+    }
+
+    ck_assert_str_eq(INVALID, output);
+    ck_assert_int_eq(CLOSE_CONNECTION, result);
+}
+END_TEST
+
+START_TEST (test_framing_lone_lf) {
+    // Only CRLF ends a command, split or not
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, feed("QUIT\nXYZ"));
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, feed("\n"));
+    ck_assert_str_eq("", output);
+
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, feed("\r\n"));
+    ck_assert_str_eq(INVALID, output);
+}
+END_TEST
+
+START_TEST (test_framing_overflow) {
+    char line[CONNECTION_BUFFER_SIZE / 2 + 1];
+    memset(line, 'A', sizeof(line) - 1);
+    line[sizeof(line) - 1] = 0;
+
+    // A command that never ends can't take more than the buffer
+    ck_assert_int_eq(KEEP_CONNECTION_OPEN, feed(line));
+    ck_assert_int_eq(CONNECTION_ERROR, feed(line));
+}
+END_TEST
+
+/**
+ * Write a mail to a temporary file, returning its path
+ */
+static char *write_mail(const char *mail, size_t length) {
+    static char path[] = "/tmp/pop_test_XXXXXX";
+    strcpy(path, "/tmp/pop_test_XXXXXX");
+
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(length, write(fd, mail, length));
+    close(fd);
+
+    return path;
+}
+
+/**
+ * Read the output of the bytestuffer for a mail
+ */
+static size_t run_bytestuff(const char *path, char *stuffed, size_t size) {
+    ck_assert_msg(access(BYTESTUFF, X_OK) == 0, "Build " BYTESTUFF " first");
+
+    char command[sizeof(BYTESTUFF) + 64];
+    snprintf(command, sizeof(command), BYTESTUFF " < %s", path);
+
+    FILE *out = popen(command, "r");
+    ck_assert_ptr_nonnull(out);
+
+    size_t length = fread(stuffed, 1, size, out);
+    ck_assert_int_eq(0, pclose(out));
+    ck_assert_uint_lt(length, size);
+
+    return length;
+}
+
+/**
+ * Drain produce_stuffed_mail like the splitter of the event loop does
+ */
+static size_t run_produce(const char *path, char *stuffed, size_t size) {
+    int fd = open(path, O_RDONLY);
+    ck_assert_int_ge(fd, 0);
+
+    StuffedMail *mail = open_stuffed_mail(fd);
+    ck_assert_ptr_nonnull(mail);
+
+    size_t length = 0;
+    const char *segment;
+    size_t segment_length;
+
+    while ((segment_length = produce_stuffed_mail(mail, &segment))) {
+        ck_assert_uint_lt(length + segment_length, size);
+        memcpy(stuffed + length, segment, segment_length);
+        length += segment_length;
+    }
+
+    release_stuffed_mail(mail);
+    return length;
+}
+
+static void check_stuffing(const char *mail, size_t length) {
+    static char expected[1 << 20];
+    static char produced[1 << 20];
+
+    char *path = write_mail(mail, length);
+
+    size_t expected_length = run_bytestuff(path, expected, sizeof(expected));
+    size_t produced_length = run_produce(path, produced, sizeof(produced));
+    unlink(path);
+
+    ck_assert_uint_eq(expected_length, produced_length);
+    ck_assert_msg(!memcmp(expected, produced, expected_length), "The output differs from " BYTESTUFF);
+}
+
+START_TEST (test_stuffing_lines) {
+    const char *mails[] = {
+        "",
+        "hello\r\nworld\r\n",
+        "bare\nline feeds\n\n",
+        ".\r\n..two\n.one\r\nmiddle.dot\n.",
+        "no ending",
+        "ends with CR\r",
+        "CR\r\r\nand\rCR\n",
+        "\n\r\n.\n",
+    };
+
+    for (size_t i = 0; i < N(mails); i++) {
+        check_stuffing(mails[i], strlen(mails[i]));
+    }
+}
+END_TEST
+
+START_TEST (test_stuffing_long_lines) {
+    static char mail[4096];
+
+    // Around the 511 bytes fgets takes at once in the bytestuffer
+    size_t lengths[] = {509, 510, 511, 512, 1022, 1023};
+    const char *endings[] = {"\n", "\r\n", ".\n", "\r\n.x\r\n"};
+
+    for (size_t i = 0; i < N(lengths); i++) {
+        for (size_t j = 0; j < N(endings); j++) {
+            memset(mail, 'x', lengths[i]);
+            strcpy(mail + lengths[i], endings[j]);
+            check_stuffing(mail, strlen(mail));
+
+            mail[0] = '.';
+            check_stuffing(mail, strlen(mail));
+        }
+    }
+}
+END_TEST
+
+START_TEST (test_stuffing_random) {
+    static char mail[256 * 1024];
+    const char *pieces[] = {"\n", "\r\n", "\r", ".", "..", "a", "abc def", "\r\n.\r\n"};
+
+    srand(1939);
+
+    for (int round = 0; round < 20; round++) {
+        size_t length = 0;
+
+        while (length < sizeof(mail) - 1024) {
+            // Long runs of text now and then, so some lines are longer than fgets reads
+            if (rand() % 16 == 0) {
+                size_t run = rand() % 1000;
+                memset(mail + length, 'z', run);
+                length += run;
+                continue;
+            }
+
+            const char *piece = pieces[rand() % N(pieces)];
+            memcpy(mail + length, piece, strlen(piece));
+            length += strlen(piece);
+        }
+
+        check_stuffing(mail, length);
+    }
+}
+END_TEST
+
+Suite *
+suite(void) {
+    Suite *s   = suite_create("pop");
+    TCase *tc  = tcase_create("framing");
+
+    tcase_add_checked_fixture(tc, connect_client, disconnect_client);
+    tcase_add_test(tc, test_framing_whole);
+    tcase_add_test(tc, test_framing_split_crlf);
+    tcase_add_test(tc, test_framing_byte_by_byte);
+    tcase_add_test(tc, test_framing_lone_lf);
+    tcase_add_test(tc, test_framing_overflow);
+    suite_add_tcase(s, tc);
+
+    TCase *stuffing  = tcase_create("stuffing");
+
+    tcase_add_test(stuffing, test_stuffing_lines);
+    tcase_add_test(stuffing, test_stuffing_long_lines);
+    tcase_add_test(stuffing, test_stuffing_random);
+    suite_add_tcase(s, stuffing);
+
+    return s;
+}
+
+int
+main(void) {
+    SRunner *sr  = srunner_create(suite());
+    int number_failed;
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+// The internals (MAX_DELTA, the slots) are checked too
+#include "timer_wheel.c"
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+static timer_wheel wheel;
+static uint64_t fired_at[8];
+static timer_node timers[8];
+
+static void on_expire(timer_node *timer) {
+    fired_at[timer - timers] = wheel.now;
+}
+
+/**
+ * The level of the slot holding a timer, -1 if it's in none
+ */
+static int timer_level(const timer_node *timer) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            const timer_node *head = &wheel.slots[level][slot];
+            for (const timer_node *node = head->next; node != head; node = node->next) {
+                if (node == timer) {
+                    return level;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Turn the wheel like the event loop does, sleeping what timer_wheel_next says
+ */
+static void run_until_idle(uint64_t now) {
+    while (wheel.count) {
+        int64_t ticks = timer_wheel_next(&wheel);
+        now += ticks > 0 ? ticks : 1;
+        timer_wheel_advance(&wheel, now, on_expire);
+    }
+}
+
+static void reset(uint64_t now) {
+    init_timer_wheel(&wheel, now);
+    memset(timers, 0, sizeof(timers));
+    memset(fired_at, 0, sizeof(fired_at));
+}
+
+START_TEST (test_timer_wheel_levels) {
+    reset(1000);
+
+    uint64_t deltas[] = {1, TIMER_WHEEL_SLOTS - 1, TIMER_WHEEL_SLOTS, 5000, 300000, MAX_DELTA};
+    int levels[] = {0, 0, 1, 2, 3, 3};
+
+    for (size_t i = 0; i < N(deltas); i++) {
+        timer_wheel_add(&wheel, &timers[i], 1000 + deltas[i]);
+        ck_assert_int_eq(levels[i], timer_level(&timers[i]));
+    }
+    ck_assert_uint_eq(N(deltas), wheel.count);
+
+    timer_wheel_remove(&wheel, &timers[3]);
+    ck_assert_int_eq(false, timer_pending(&timers[3]));
+    ck_assert_uint_eq(N(deltas) - 1, wheel.count);
+}
+END_TEST
+
+START_TEST (test_timer_wheel_cascade) {
+    // Not aligned to any level, so every cascade lands mid slot
+    uint64_t start = 123457;
+    reset(start);
+
+    uint64_t deltas[] = {3, 70, 4097, 262145, 1000003};
+    for (size_t i = 0; i < N(deltas); i++) {
+        timer_wheel_add(&wheel, &timers[i], start + deltas[i]);
+    }
+
+    // One tick at a time, each timer fires on its own tick
+    uint64_t now = start;
+    while (wheel.count) {
+        timer_wheel_advance(&wheel, ++now, on_expire);
+    }
+
+    for (size_t i = 0; i < N(deltas); i++) {
+        ck_assert_uint_eq(start + deltas[i], fired_at[i]);
+    }
+
+    // And the same when the wheel jumps from one wakeup to the next
+    reset(start);
+    for (size_t i = 0; i < N(deltas); i++) {
+        timer_wheel_add(&wheel, &timers[i], start + deltas[i]);
+    }
+    run_until_idle(start);
+
+    for (size_t i = 0; i < N(deltas); i++) {
+        ck_assert_uint_eq(start + deltas[i], fired_at[i]);
+    }
+}
+END_TEST
+
+START_TEST (test_timer_wheel_over_range) {
+    uint64_t starts[] = {0, 5, (1 << 18) - 1, 123456789};
+    uint64_t deltas[] = {MAX_DELTA + 1, MAX_DELTA * 3 + 17, (uint64_t)1 << 30};
+
+    for (size_t s = 0; s < N(starts); s++) {
+        for (size_t d = 0; d < N(deltas); d++) {
+            reset(starts[s]);
+
+            uint64_t expires = starts[s] + deltas[d];
+            timer_wheel_add(&wheel, &timers[0], expires);
+
+            // It waits in the last level, without losing its expiry
+            ck_assert_int_eq(TIMER_WHEEL_LEVELS - 1, timer_level(&timers[0]));
+            ck_assert_uint_eq(expires, timers[0].expires);
+
+            run_until_idle(starts[s]);
+            ck_assert_uint_eq(expires, fired_at[0]);
+        }
+    }
+}
+END_TEST
+
+START_TEST (test_timer_wheel_expired) {
+    reset(50);
+
+    // Already expired, it fires on the next tick
+    timer_wheel_add(&wheel, &timers[0], 10);
+    ck_assert_uint_eq(51, timers[0].expires);
+
+    timer_wheel_advance(&wheel, 51, on_expire);
+    ck_assert_uint_eq(51, fired_at[0]);
+    ck_assert_uint_eq(0, wheel.count);
+    ck_assert_int_eq(-1, timer_wheel_next(&wheel));
+}
+END_TEST
+
+Suite *
+suite(void) {
+    Suite *s   = suite_create("timer_wheel");
+    TCase *tc  = tcase_create("timer_wheel");
+
+    tcase_add_test(tc, test_timer_wheel_levels);
+    tcase_add_test(tc, test_timer_wheel_cascade);
+    tcase_add_test(tc, test_timer_wheel_over_range);
+    tcase_add_test(tc, test_timer_wheel_expired);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int
+main(void) {
+    SRunner *sr  = srunner_create(suite());
+    int number_failed;
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}